@@ -1,7 +1,12 @@
 #include "alloc_map.h"
+#include "arena.h"
+#include "log_writer.h"
+#include "overhead.h"
 #include <unordered_map>
 #include <vector>
 #include <mutex>
+#include <atomic>
+#include <algorithm>
 #include <sys/types.h>
 
 // Internal C++ structure
@@ -12,46 +17,334 @@ struct MemoryEventInternal {
     size_t size;
 };
 
+struct History {
+    ArenaVector<MemoryEventInternal> events;
+    unsigned compacted;  // Older events already moved out to the spill file
+};
+
 // Two-level map: thread_id -> (pointer -> event_history)
-using PointerMap = std::unordered_map<void*, std::vector<MemoryEventInternal>>;
-using ThreadMap = std::unordered_map<pid_t, PointerMap>;
+using PointerMap = ArenaHashMap<void*, History>;
+using ThreadMap = ArenaHashMap<pid_t, PointerMap>;
+
+// A history event on its way to the spill file
+struct SpillRecord {
+    pid_t thread_id;
+    void* ptr;
+    MemoryEventInternal event;
+};
 
-struct AllocMap {
+struct AllocMap : ArenaObject {
     ThreadMap data;
+    ArenaHashMap<void*, pid_t> owners;  // Which thread's map holds each pointer, so a miss in the caller's is one lookup
     std::mutex lock;
+    unsigned long version;  // Bumped on every change, so unchanged maps aren't re-published
+
+    // Approximate memory held by the histories. The writer thread trims them back under budget (alloc_map_trim()),
+    // the hooks only once they are a quarter past it.
+    size_t bytes;
+    size_t events;
+    size_t budget;
+
+    unsigned long compacted;
+    unsigned long evicted;
+    unsigned long released;
+    unsigned long spill_dropped;
+
+    // Filled under the lock by whichever thread spills, written out later by the writer thread.
+    // Capped at a quarter of the budget, past that spilled events are dropped (and counted).
+    ArenaVector<SpillRecord> pending_spill;
+    log_file* spill_file;
+};
+
+// Rough cost of one pointer entry besides its events: hash nodes and bucket slots (its own and its owners entry) and the History itself
+static const size_t ENTRY_OVERHEAD = sizeof(void*) * 8 + sizeof(History);
+
+// Immutable once published. Readers only ever see complete snapshots.
+struct Snapshot : ArenaObject {
+    unsigned long version;
+    ArenaVector<AllocMapEntry> by_ptr;  // Sorted by pointer, then by timestamp
+    ArenaVector<const AllocMapEntry*> by_size;  // Largest first
 };
 
 // Global instance
 static AllocMap* g_alloc_map = nullptr;
 
+/*
+ * Snapshot reclamation: readers bump g_readers before loading g_snapshot and drop it when done.
+ * The publisher swaps in a new snapshot and only frees retired ones once it sees no readers at all,
+ * so a reader never blocks and never sees freed memory, it just delays reclamation to a later publish.
+ */
+static std::atomic<Snapshot*> g_snapshot(nullptr);
+static std::atomic<int> g_readers(0);
+static ArenaVector<Snapshot*> g_retired;  // Only touched by the publisher
+
+namespace {
+
+struct ReadGuard {
+    const Snapshot* snapshot;
+
+    ReadGuard() {
+        g_readers.fetch_add(1);
+        snapshot = g_snapshot.load();
+    }
+
+    ~ReadGuard() {
+        g_readers.fetch_sub(1);
+    }
+};
+
+}
+
+static bool is_live(const MemoryEventInternal& last) {
+    return last.event_type != MUNMAP;
+}
+
+static size_t history_bytes(const History& history) {
+    return ENTRY_OVERHEAD + history.events.capacity() * sizeof(MemoryEventInternal);
+}
+
+// Moves all but the newest keep_last events of a history to out (the pending spill unless given) and reclaims their memory
+static void spill_history(pid_t thread_id, void* ptr, History& history, size_t keep_last, ArenaVector<SpillRecord>* out = nullptr) {
+    AllocMap* map = g_alloc_map;
+    auto& events = history.events;
+    if (events.size() <= keep_last) return;
+
+    size_t spilled = events.size() - keep_last;
+    if (out == nullptr && map->budget && (map->pending_spill.size() + spilled) * sizeof(SpillRecord) > map->budget / 4) {
+        map->spill_dropped += spilled;
+    }
+    else {
+        if (out == nullptr) out = &map->pending_spill;
+        for (size_t i = 0; i < spilled; i++) {
+            out->push_back(SpillRecord{thread_id, ptr, events[i]});
+        }
+    }
+
+    map->bytes -= history_bytes(history);
+    events.erase(events.begin(), events.begin() + spilled);
+    events.shrink_to_fit();
+    map->bytes += history_bytes(history);
+
+    map->events -= spilled;
+    history.compacted += spilled;
+}
+
+static void forget_owner(pid_t thread_id, void* ptr) {
+    auto owner = g_alloc_map->owners.find(ptr);
+    if (owner != g_alloc_map->owners.end() && owner->second == thread_id) g_alloc_map->owners.erase(owner);
+}
+
+// Spills a whole history and drops the entry. Returns the iterator after it.
+static PointerMap::iterator release_entry(pid_t thread_id, PointerMap& pointers, PointerMap::iterator it,
+                                          ArenaVector<SpillRecord>* out = nullptr) {
+    AllocMap* map = g_alloc_map;
+
+    spill_history(thread_id, it->first, it->second, 0, out);
+    map->bytes -= history_bytes(it->second);
+    map->version++;
+    forget_owner(thread_id, it->first);
+    return pointers.erase(it);
+}
+
+struct TrimCandidate {
+    unsigned long last_used;
+    pid_t thread_id;
+    void* ptr;
+};
+
+static void collect_candidates(ArenaVector<TrimCandidate>& candidates) {
+    for (const auto& thread_pair : g_alloc_map->data) {
+        for (const auto& ptr_pair : thread_pair.second) {
+            candidates.push_back(TrimCandidate{ptr_pair.second.events.back().timestamp_ns, thread_pair.first, ptr_pair.first});
+        }
+    }
+}
+
+static void sort_candidates(ArenaVector<TrimCandidate>& candidates) {
+    std::sort(candidates.begin(), candidates.end(), [](const TrimCandidate& a, const TrimCandidate& b) {
+        return a.last_used < b.last_used;
+    });
+}
+
+/**
+ * Brings the map back under 3/4 of its budget, coldest (least recently touched) pointers first.
+ * Histories are first compacted down to their newest event, which keeps lookups working.
+ * Only if that isn't enough are whole entries evicted.
+ * Candidates gone or touched since they were collected are skipped.
+ */
+static void trim_candidates(const ArenaVector<TrimCandidate>& candidates, ArenaVector<SpillRecord>* out) {
+    AllocMap* map = g_alloc_map;
+    size_t target = map->budget / 4 * 3;
+
+    for (int evict = 0; evict < 2; evict++) {
+        for (const TrimCandidate& c : candidates) {
+            if (map->bytes <= target) break;
+
+            auto thread_it = map->data.find(c.thread_id);
+            if (thread_it == map->data.end()) continue;
+            auto ptr_it = thread_it->second.find(c.ptr);
+            if (ptr_it == thread_it->second.end() || ptr_it->second.events.back().timestamp_ns != c.last_used) continue;
+
+            if (evict) {
+                release_entry(c.thread_id, thread_it->second, ptr_it, out);
+                map->evicted++;
+                if (thread_it->second.empty()) map->data.erase(thread_it);
+            }
+            else {
+                size_t before = ptr_it->second.events.size();
+                spill_history(c.thread_id, c.ptr, ptr_it->second, 1, out);
+                map->compacted += before - ptr_it->second.events.size();
+            }
+        }
+    }
+
+    map->version++;
+}
+
+//Only for when the writer thread falls behind (or there is none, with LD_PRELOAD_MODE=segments): the whole pass under the lock
+static void trim_now(void) {
+    AllocMap* map = g_alloc_map;
+    if (map->budget == 0 || map->bytes <= map->budget + map->budget / 4) return;
+
+    ArenaVector<TrimCandidate> candidates;
+    collect_candidates(candidates);
+    sort_candidates(candidates);
+    trim_candidates(candidates, nullptr);
+}
+
+// Finds the entry for ptr, starting with the most likely thread
+static bool find_entry(pid_t thread_id, void* ptr, ThreadMap::iterator& thread_it, PointerMap::iterator& ptr_it) {
+    ThreadMap& data = g_alloc_map->data;
+
+    thread_it = data.find(thread_id);
+    if (thread_it != data.end()) {
+        ptr_it = thread_it->second.find(ptr);
+        if (ptr_it != thread_it->second.end()) return true;
+    }
+
+    //Freed (or moved) by a different thread than the one that allocated it
+    auto owner = g_alloc_map->owners.find(ptr);
+    if (owner == g_alloc_map->owners.end() || owner->second == thread_id) return false;
+
+    thread_it = data.find(owner->second);
+    if (thread_it == data.end()) return false;
+    ptr_it = thread_it->second.find(ptr);
+    return ptr_it != thread_it->second.end();
+}
+
+static void release(pid_t thread_id, void* ptr) {
+    ThreadMap::iterator thread_it;
+    PointerMap::iterator ptr_it;
+    if (!find_entry(thread_id, ptr, thread_it, ptr_it)) return;
+
+    release_entry(thread_it->first, thread_it->second, ptr_it);
+    g_alloc_map->released++;
+    if (thread_it->second.empty()) g_alloc_map->data.erase(thread_it);
+}
+
+//The mutators below expect the map's lock to be held
+static void add_event(pid_t thread_id, void* ptr, int event_type, unsigned long timestamp_ns, void* related_ptr, size_t size) {
+    MemoryEventInternal event;
+    event.timestamp_ns = timestamp_ns;
+    event.event_type = event_type;
+    event.related_ptr = related_ptr;
+    event.size = size;
+
+    //Each pointer lives in one thread's map. Another thread reusing the address means the old entry's block is gone.
+    auto owner = g_alloc_map->owners.find(ptr);
+    if (owner == g_alloc_map->owners.end()) {
+        g_alloc_map->owners.emplace(ptr, thread_id);
+    }
+    else if (owner->second != thread_id) {
+        release(owner->second, ptr);
+        g_alloc_map->owners[ptr] = thread_id;
+    }
+
+    History& history = g_alloc_map->data[thread_id][ptr];
+    size_t before = history.events.empty() ? 0 : history_bytes(history);
+    history.events.push_back(event);
+    g_alloc_map->bytes += history_bytes(history) - before;
+    g_alloc_map->events++;
+    g_alloc_map->version++;
+
+    //Once a mapping is gone, or a block has moved, its history is finished and can go to disk.
+    if (event_type == MUNMAP) {
+        release(thread_id, ptr);
+    }
+    else if (event_type == REALLOC && related_ptr && related_ptr != ptr) {
+        release(thread_id, related_ptr);
+    }
+
+    trim_now();
+}
+
+static void clear_thread(pid_t thread_id) {
+    auto thread_it = g_alloc_map->data.find(thread_id);
+    if (thread_it == g_alloc_map->data.end()) return;
+
+    //Blocks the thread left behind may still be live, so their histories go to disk rather than nowhere.
+    PointerMap& pointers = thread_it->second;
+    for (auto it = pointers.begin(); it != pointers.end(); ) {
+        it = release_entry(thread_id, pointers, it);
+    }
+    g_alloc_map->data.erase(thread_it);
+}
+
+//Only the writer thread (or fini) gets here, so the file itself needs no lock.
+static int write_records(const ArenaVector<SpillRecord>& records, unsigned long origin) {
+    if (records.empty()) return 0;
+
+    log_file* f = g_alloc_map->spill_file;
+    if (!f) {
+        f = log_open("alloc_spill", "thread,pointer,time_ns,event_type,related_pointer,size");
+        if (!f) return 0;
+        g_alloc_map->spill_file = f;
+    }
+
+    for (const SpillRecord& r : records) {
+        log_printf(f, "%d,\"%p\",%ld,%d,", r.thread_id, r.ptr, (long)(r.event.timestamp_ns - origin), r.event.event_type);
+        if (r.event.related_ptr) log_printf(f, "\"%p\",", r.event.related_ptr);
+        else log_printf(f, "null,");
+        log_printf(f, "%lu\n", r.event.size);
+    }
+
+    return static_cast<int>(records.size());
+}
+
 extern "C" {
 
+int alloc_map_async = 0;
+int alloc_map_inline = 0;
+
 void alloc_map_init(void) {
     if (!g_alloc_map) {
         g_alloc_map = new AllocMap();
+        g_alloc_map->spill_file = nullptr;
     }
 }
 
 void alloc_map_destroy(void) {
     if (g_alloc_map) {
+        if (g_alloc_map->spill_file) log_close(g_alloc_map->spill_file);
         delete g_alloc_map;
         g_alloc_map = nullptr;
     }
+
+    delete g_snapshot.exchange(nullptr);
+    for (Snapshot* old : g_retired) delete old;
+    g_retired.clear();
 }
 
 void alloc_map_add_event(pid_t thread_id, void* ptr, int event_type,
                          struct timespec* timestamp_ns, void* related_ptr, size_t size) {
     if (!g_alloc_map || !ptr) return;
-    
-    std::lock_guard<std::mutex> guard(g_alloc_map->lock);
-    
-    MemoryEventInternal event;
-    event.timestamp_ns = (timestamp_ns->tv_sec * 1000000000UL) + timestamp_ns->tv_nsec;
-    event.event_type = event_type;
-    event.related_ptr = related_ptr;
-    event.size = size;
-    
-    g_alloc_map->data[thread_id][ptr].push_back(event);
+    unsigned long start = overhead_clock();
+
+    {
+        std::lock_guard<std::mutex> guard(g_alloc_map->lock);
+        add_event(thread_id, ptr, event_type, (timestamp_ns->tv_sec * 1000000000UL) + timestamp_ns->tv_nsec, related_ptr, size);
+    }
+    if (start) overhead_add(event_type, OVERHEAD_ALLOC_MAP_NS, overhead_clock() - start);
 }
 
 int alloc_map_get_history(pid_t thread_id, void* ptr, MemoryEvent* events, int max_events) {
@@ -69,7 +362,7 @@ int alloc_map_get_history(pid_t thread_id, void* ptr, MemoryEvent* events, int m
         return -1;
     }
     
-    const auto& history = ptr_it->second;
+    const auto& history = ptr_it->second.events;
     int count = static_cast<int>(history.size());
     
     if (events && max_events > 0) {
@@ -92,7 +385,14 @@ void alloc_map_remove(pid_t thread_id, void* ptr) {
     
     auto thread_it = g_alloc_map->data.find(thread_id);
     if (thread_it != g_alloc_map->data.end()) {
-        thread_it->second.erase(ptr);
+        auto ptr_it = thread_it->second.find(ptr);
+        if (ptr_it == thread_it->second.end()) return;
+
+        g_alloc_map->bytes -= history_bytes(ptr_it->second);
+        g_alloc_map->events -= ptr_it->second.events.size();
+        forget_owner(thread_id, ptr);
+        thread_it->second.erase(ptr_it);
+        g_alloc_map->version++;
         
         // Remove thread entry if empty
         if (thread_it->second.empty()) {
@@ -105,7 +405,100 @@ void alloc_map_clear_thread(pid_t thread_id) {
     if (!g_alloc_map) return;
     
     std::lock_guard<std::mutex> guard(g_alloc_map->lock);
-    g_alloc_map->data.erase(thread_id);
+    clear_thread(thread_id);
+}
+
+void alloc_map_apply(const AllocMapUpdate* updates, int count) {
+    if (!g_alloc_map || count <= 0) return;
+
+    std::lock_guard<std::mutex> guard(g_alloc_map->lock);
+    for (int i = 0; i < count; i++) {
+        const AllocMapUpdate& u = updates[i];
+        switch (u.kind) {
+            case ALLOC_MAP_ADD:
+                if (u.ptr) add_event(u.thread_id, u.ptr, u.event_type, u.timestamp_ns, u.related_ptr, u.size);
+                break;
+            case ALLOC_MAP_RELEASE:
+                if (u.ptr) release(u.thread_id, u.ptr);
+                break;
+            case ALLOC_MAP_CLEAR_THREAD:
+                clear_thread(u.thread_id);
+                break;
+        }
+    }
+}
+
+void alloc_map_release(pid_t thread_id, void* ptr) {
+    if (!g_alloc_map || !ptr) return;
+    unsigned long start = overhead_clock();
+
+    {
+        std::lock_guard<std::mutex> guard(g_alloc_map->lock);
+        release(thread_id, ptr);
+    }
+    if (start) overhead_add(FREE, OVERHEAD_ALLOC_MAP_NS, overhead_clock() - start);
+}
+
+void alloc_map_set_budget(size_t bytes) {
+    if (!g_alloc_map) return;
+
+    std::lock_guard<std::mutex> guard(g_alloc_map->lock);
+    g_alloc_map->budget = bytes;
+}
+
+void alloc_map_stats(AllocMapStats* stats) {
+    if (!g_alloc_map) {
+        *stats = AllocMapStats();
+        return;
+    }
+
+    std::lock_guard<std::mutex> guard(g_alloc_map->lock);
+
+    int entries = 0;
+    for (const auto& thread_pair : g_alloc_map->data) {
+        entries += thread_pair.second.size();
+    }
+
+    stats->entries = entries;
+    stats->events = g_alloc_map->events;
+    stats->bytes = g_alloc_map->bytes;
+    stats->pending_spill_bytes = g_alloc_map->pending_spill.capacity() * sizeof(SpillRecord);
+    stats->budget = g_alloc_map->budget;
+    stats->compacted = g_alloc_map->compacted;
+    stats->evicted = g_alloc_map->evicted;
+    stats->released = g_alloc_map->released;
+    stats->spill_dropped = g_alloc_map->spill_dropped;
+}
+
+void alloc_map_trim(unsigned long origin) {
+    if (!g_alloc_map) return;
+
+    //Like publishing, only the flat copy and the spilling happen under the lock, sorting is done with writers let go
+    ArenaVector<TrimCandidate> candidates;
+    {
+        std::lock_guard<std::mutex> guard(g_alloc_map->lock);
+        if (g_alloc_map->budget == 0 || g_alloc_map->bytes <= g_alloc_map->budget) return;
+        collect_candidates(candidates);
+    }
+    sort_candidates(candidates);
+
+    ArenaVector<SpillRecord> records;
+    {
+        std::lock_guard<std::mutex> guard(g_alloc_map->lock);
+        trim_candidates(candidates, &records);
+    }
+    write_records(records, origin);
+}
+
+int alloc_map_write_spill(unsigned long origin) {
+    if (!g_alloc_map) return 0;
+
+    ArenaVector<SpillRecord> records;
+    {
+        std::lock_guard<std::mutex> guard(g_alloc_map->lock);
+        records.swap(g_alloc_map->pending_spill);
+    }
+    return write_records(records, origin);
 }
 
 int alloc_map_size(void) {
@@ -121,4 +514,104 @@ int alloc_map_size(void) {
     return total;
 }
 
+void alloc_map_publish(void) {
+    if (!g_alloc_map) return;
+
+    Snapshot* current = g_snapshot.load();
+    Snapshot* fresh = new Snapshot();
+
+    {
+        //Only a flat copy happens under the lock, sorting is done after writers are let go again.
+        std::lock_guard<std::mutex> guard(g_alloc_map->lock);
+
+        if (current && current->version == g_alloc_map->version) {
+            delete fresh;
+            return;
+        }
+
+        fresh->version = g_alloc_map->version;
+        fresh->by_ptr.reserve(current ? current->by_ptr.size() + 64 : 64);
+
+        for (const auto& thread_pair : g_alloc_map->data) {
+            for (const auto& ptr_pair : thread_pair.second) {
+                const auto& history = ptr_pair.second.events;
+                if (history.empty() || !is_live(history.back())) continue;
+
+                AllocMapEntry entry;
+                entry.thread_id = thread_pair.first;
+                entry.ptr = ptr_pair.first;
+                entry.size = history.back().size;
+                entry.last_event_type = history.back().event_type;
+                entry.last_timestamp_ns = history.back().timestamp_ns;
+                entry.event_count = static_cast<int>(history.size() + ptr_pair.second.compacted);
+                fresh->by_ptr.push_back(entry);
+            }
+        }
+    }
+
+    std::sort(fresh->by_ptr.begin(), fresh->by_ptr.end(), [](const AllocMapEntry& a, const AllocMapEntry& b) {
+        if (a.ptr != b.ptr) return a.ptr < b.ptr;
+        return a.last_timestamp_ns < b.last_timestamp_ns;
+    });
+
+    fresh->by_size.reserve(fresh->by_ptr.size());
+    for (const AllocMapEntry& entry : fresh->by_ptr) fresh->by_size.push_back(&entry);
+    std::sort(fresh->by_size.begin(), fresh->by_size.end(), [](const AllocMapEntry* a, const AllocMapEntry* b) {
+        return a->size > b->size;
+    });
+
+    Snapshot* old = g_snapshot.exchange(fresh);
+    if (old) g_retired.push_back(old);
+
+    if (g_readers.load() == 0) {
+        for (Snapshot* retired : g_retired) delete retired;
+        g_retired.clear();
+    }
+}
+
+unsigned long alloc_map_snapshot_version(void) {
+    ReadGuard read;
+    return read.snapshot ? read.snapshot->version : 0;
+}
+
+int alloc_map_visit(AllocMapVisitor visitor, void* ctx) {
+    ReadGuard read;
+    if (!read.snapshot || !visitor) return 0;
+
+    int visited = 0;
+    for (const AllocMapEntry& entry : read.snapshot->by_ptr) {
+        visited++;
+        if (visitor(&entry, ctx)) break;
+    }
+    return visited;
+}
+
+int alloc_map_lookup(void* ptr, AllocMapEntry* entry) {
+    ReadGuard read;
+    if (!read.snapshot || !ptr) return 0;
+
+    const auto& entries = read.snapshot->by_ptr;
+    auto it = std::upper_bound(entries.begin(), entries.end(), ptr, [](void* p, const AllocMapEntry& e) {
+        return p < e.ptr;
+    });
+
+    //upper_bound lands just past the newest entry for ptr
+    if (it == entries.begin() || std::prev(it)->ptr != ptr) return 0;
+
+    if (entry) *entry = *std::prev(it);
+    return 1;
+}
+
+int alloc_map_top_n(AllocMapEntry* out, int n) {
+    ReadGuard read;
+    if (!read.snapshot || !out || n <= 0) return 0;
+
+    const auto& ranked = read.snapshot->by_size;
+    int count = std::min(n, static_cast<int>(ranked.size()));
+    for (int i = 0; i < count; i++) {
+        out[i] = *ranked[i];
+    }
+    return count;
+}
+
 } // extern "C"
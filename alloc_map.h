@@ -17,6 +17,60 @@ typedef struct {
     size_t size;
 } MemoryEvent;
 
+// One tracked pointer in a read-side snapshot
+typedef struct {
+    pid_t thread_id;
+    void* ptr;
+    size_t size;  // Size from the most recent event
+    int last_event_type;  // From OVERRIDE_ID enum
+    long long last_timestamp_ns;
+    int event_count;
+} AllocMapEntry;
+
+// Memory overhead of the map, see alloc_map_stats()
+typedef struct {
+    int entries;
+    size_t events;  // Events still held in memory
+    size_t bytes;  // Approximate bytes held by histories
+    size_t pending_spill_bytes;  // Spilled events waiting for the writer thread
+    size_t budget;  // 0 means unbounded
+    unsigned long compacted;  // Events moved to the spill file to shrink cold histories
+    unsigned long evicted;  // Whole histories spilled to stay under budget
+    unsigned long released;  // Histories spilled because the pointer was freed, unmapped or moved
+    unsigned long spill_dropped;  // Events dropped rather than spilled, the pending spill being at its cap
+} AllocMapStats;
+
+// Called for each entry by alloc_map_visit(). Return non-zero to stop early.
+typedef int (*AllocMapVisitor)(const AllocMapEntry* entry, void* ctx);
+
+// What alloc_map_apply() does with an update, standing in for the call of the same name
+enum {
+    ALLOC_MAP_ADD,
+    ALLOC_MAP_RELEASE,
+    ALLOC_MAP_CLEAR_THREAD,
+};
+
+// One queued change to the map, see alloc_map_apply()
+typedef struct {
+    int kind;
+    pid_t thread_id;
+    void* ptr;
+    int event_type;  // ALLOC_MAP_ADD only, like the three fields below
+    unsigned long timestamp_ns;
+    void* related_ptr;
+    size_t size;
+} AllocMapUpdate;
+
+/*
+ * LD_PRELOAD_ASYNC_INDEX=1: the hooks leave the map alone, and the writer thread applies the same changes from the queued
+ * events with alloc_map_apply() as it drains the queue. Queries then see the map as of the writer's last batch.
+ */
+extern int alloc_map_async;
+
+// Whether the hooks update the map themselves. Off with LD_PRELOAD_ASYNC_INDEX, and in LD_PRELOAD_MODE=counts and
+// segments, where there is no map at all (its queries find nothing and no alloc_spill.csv is written).
+extern int alloc_map_inline;
+
 // Initialize the global allocation map
 void alloc_map_init(void);
 
@@ -28,6 +82,7 @@ void alloc_map_add_event(pid_t thread_id, void* ptr, int event_type,
                          struct timespec* timestamp_ns, void* related_ptr, size_t size);
 
 // Get the history for a specific thread and pointer
+// Only events still in memory are returned, older ones may have been compacted into the spill file
 // Returns the number of events, or -1 if not found
 // If events is NULL, just returns the count
 int alloc_map_get_history(pid_t thread_id, void* ptr, MemoryEvent* events, int max_events);
@@ -35,12 +90,61 @@ int alloc_map_get_history(pid_t thread_id, void* ptr, MemoryEvent* events, int m
 // Remove an entry (e.g., after free)
 void alloc_map_remove(pid_t thread_id, void* ptr);
 
-// Clear all entries for a specific thread (e.g., thread exit)
+// Clear all entries for a specific thread (e.g., thread exit), spilling their histories
 void alloc_map_clear_thread(pid_t thread_id);
 
+// A pointer's life is over (e.g., after free): spill its history and reclaim it, whichever thread owns it
+void alloc_map_release(pid_t thread_id, void* ptr);
+
+// Apply a batch of changes in order, taking the lock once for all of them
+void alloc_map_apply(const AllocMapUpdate* updates, int count);
+
+// Cap the approximate memory held by histories. Cold histories get compacted or evicted to the spill file past it.
+// Spilled events waiting for the writer thread are capped at a quarter of it on top.
+void alloc_map_set_budget(size_t bytes);
+
+// Compact or evict cold histories until the map is back under 3/4 of its budget, spilling straight to alloc_spill.csv.
+// Writer thread only. The hooks only do this themselves (under the lock) once the map is a quarter past its budget.
+void alloc_map_trim(unsigned long origin);
+
+// Get the map's current memory overhead
+void alloc_map_stats(AllocMapStats* stats);
+
+// Append spilled histories to alloc_spill.csv, with timestamps relative to origin. Writer thread only.
+// Returns the number of events written.
+int alloc_map_write_spill(unsigned long origin);
+
 // Get total number of tracked allocations across all threads
 int alloc_map_size(void);
 
+/*
+ * Read side. Queries below never take the map's lock, so they can't stall allocating threads.
+ * They see the most recently published snapshot, which the writer thread refreshes every LD_PRELOAD_SNAPSHOT_MS.
+ */
+
+// Publish a fresh snapshot if the map changed since the last one
+void alloc_map_publish(void);
+
+// Version of the current snapshot (0 before the first publish)
+unsigned long alloc_map_snapshot_version(void);
+
+// Call visitor for every live entry, in pointer order. Returns the number of entries visited.
+int alloc_map_visit(AllocMapVisitor visitor, void* ctx);
+
+// Find the latest entry for ptr, whichever thread owns it. Returns 1 if found, 0 otherwise.
+int alloc_map_lookup(void* ptr, AllocMapEntry* entry);
+
+// Copy up to n of the largest live entries into out, largest first. Returns the number copied.
+int alloc_map_top_n(AllocMapEntry* out, int n);
+
 #ifdef __cplusplus
 }
+
+// C++ convenience wrapper around alloc_map_visit(), f takes a const AllocMapEntry& and returns bool (true to stop)
+template <typename F>
+inline int alloc_map_for_each(F f) {
+    return alloc_map_visit([](const AllocMapEntry* entry, void* ctx) -> int {
+        return (*static_cast<F*>(ctx))(*entry) ? 1 : 0;
+    }, &f);
+}
 #endif
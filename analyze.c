@@ -0,0 +1,817 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/*
+ * Rebuilds a traced process's heap from its logs and reports what it looked like.
+ * Usage: analyze <pid log dir> [threads]
+ * Maps malloc, calloc, realloc, free, mmap and munmap .csv, cuts them into chunks at line boundaries and parses the
+ * chunks on all cores (SSE2 finds the field separators 16 bytes at a time). A log is in time order except where the
+ * writer thread moved on to another thread's buffer, so each chunk is left as the sorted runs it already holds and
+ * the runs are merged into time order as they are replayed. The first pass finds the peak of live heap bytes, per
+ * thread totals, the size class distribution and the mmap footprint, a second one stops at the peak to list what was
+ * live there. Reports go to stdout as CSV blocks.
+ */
+
+enum { OP_MALLOC, OP_CALLOC, OP_REALLOC, OP_FREE, OP_MMAP, OP_MUNMAP, OP_KINDS };
+
+static const char* op_names[OP_KINDS] = { "malloc", "calloc", "realloc", "free", "mmap", "munmap" };
+
+#define PAGE 4096UL
+#define CHUNK_BYTES (8UL << 20)  // Parse work is handed out in pieces of about this size
+#define SIZE_CLASSES 48  // Class c holds sizes in [2^(c-1), 2^c), class 0 is size 0
+#define TOP_SITES 20
+
+typedef struct op {
+    unsigned long time_ns;
+    uintptr_t addr;  // Argument of realloc, free and munmap
+    uintptr_t result;  // Return value of malloc, calloc, realloc and mmap
+    size_t size;
+    uintptr_t site;  // Call site, or for mmap whether the mapping is anonymous
+    int thread;
+    int kind;
+} op;
+
+// A byte range of one log, parsed by one worker into its own ops
+typedef struct chunk {
+    int kind;
+    const char* begin;
+    const char* end;
+    const char* file_begin;
+    const char* file_end;
+    op* ops;
+    size_t count;
+    size_t capacity;
+    size_t* run_starts;  // Where each stretch of ops in time order begins
+    size_t run_count;
+} chunk;
+
+typedef struct run {
+    const op* begin;
+    const op* next;
+    const op* end;
+} run;
+
+typedef struct log_map {
+    char* base;
+    size_t size;
+} log_map;
+
+// Open addressing on the address, linear probing and backward shift deletion (as in replay.c)
+typedef struct entry {
+    uintptr_t key;
+    size_t size;
+    uintptr_t site;
+    int thread;
+} entry;
+
+typedef struct table {
+    entry* entries;
+    size_t mask;
+    size_t count;
+} table;
+
+typedef struct thread_stats {
+    int tid;
+    unsigned long allocs;
+    unsigned long alloc_bytes;
+    unsigned long frees;
+    unsigned long freed_bytes;
+    unsigned long remote_frees;  // Of blocks another thread allocated
+    long live_bytes;  // Allocated by this thread and not yet freed, by anyone
+    long peak_live_bytes;
+} thread_stats;
+
+typedef struct site_stats {
+    uintptr_t site;
+    unsigned long blocks;
+    unsigned long bytes;
+} site_stats;
+
+static log_map logs[OP_KINDS];
+static chunk* chunks;
+static size_t chunk_count;
+static size_t next_chunk;
+
+//Every chunk's runs in chunk order, and a min-heap of the ones with ops left, by the time of their next op
+static run* runs;
+static size_t run_count;
+static size_t* merge_heap;
+static size_t merge_count;
+static size_t op_count;
+
+static thread_stats* threads;
+static int thread_count;
+static int thread_capacity;
+static int last_thread;
+
+static unsigned long class_allocs[SIZE_CLASSES];
+static unsigned long class_bytes[SIZE_CLASSES];
+static unsigned long class_live_blocks[SIZE_CLASSES];
+static unsigned long class_live_bytes[SIZE_CLASSES];
+
+static size_t live_bytes;
+static size_t peak_live_bytes;
+static size_t peak_op;  // How many ops in the one that reached the peak is
+static unsigned long peak_ns;
+static unsigned long unmatched_frees;
+
+static size_t mapped_bytes;
+static size_t anonymous_bytes;
+static size_t peak_mapped_bytes;
+static size_t anonymous_at_peak;
+static unsigned long peak_mapped_ns;
+static unsigned long mappings;
+static unsigned long unmaps;
+static unsigned long untracked_unmaps;
+
+
+static unsigned long now_ns(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (t.tv_sec * 1000000000UL) + t.tv_nsec;
+}
+
+static void* map_array(size_t bytes) {
+    void* p = mmap(NULL, bytes ? bytes : PAGE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        perror("analyze: mmap");
+        exit(1);
+    }
+    return p;
+}
+
+static void* grow_array(void* p, size_t old_bytes, size_t new_bytes) {
+    if (p == NULL) return map_array(new_bytes);
+    p = mremap(p, old_bytes, new_bytes, MREMAP_MAYMOVE);
+    if (p == MAP_FAILED) {
+        perror("analyze: mremap");
+        exit(1);
+    }
+    return p;
+}
+
+/**
+ * Splits the line at p into at most max fields and returns the start of the next line.
+ * count is 0 for a last line without its newline (a crash mid write), which is left alone, since the parsers below
+ * read numbers up to the first non digit and would run off the end of the mapping.
+ */
+static const char* split_line(const char* p, const char* end, const char** fields, int max, int* count) {
+    int n = 0;
+    fields[n++] = p;
+
+#ifdef __SSE2__
+    const __m128i comma = _mm_set1_epi8(',');
+    const __m128i newline = _mm_set1_epi8('\n');
+    for (; p + 16 <= end; p += 16) {
+        __m128i bytes = _mm_loadu_si128((const __m128i*)p);
+        unsigned mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(bytes, comma), _mm_cmpeq_epi8(bytes, newline)));
+        while (mask) {
+            const char* c = p + __builtin_ctz(mask);
+            if (*c == '\n') {
+                *count = n;
+                return c + 1;
+            }
+            if (n < max) fields[n++] = c + 1;
+            mask &= mask - 1;
+        }
+    }
+#endif
+
+    for (; p < end; p++) {
+        if (*p == '\n') {
+            *count = n;
+            return p + 1;
+        }
+        if (*p == ',' && n < max) fields[n++] = p + 1;
+    }
+    *count = 0;
+    return end;
+}
+
+static unsigned long parse_dec(const char* p) {
+    unsigned long v = 0;
+    while ((unsigned)(*p - '0') < 10) v = v * 10 + (*p++ - '0');
+    return v;
+}
+
+// "0x..." (quoted) or null
+static uintptr_t parse_ptr(const char* p) {
+    if (*p == '"') p++;
+    if (*p != '0' || p[1] != 'x') return 0;
+    p += 2;
+
+    uintptr_t v = 0;
+    for (;; p++) {
+        unsigned d = (unsigned)(*p - '0');
+        if (d >= 10) {
+            d = (unsigned)((*p | 0x20) - 'a');
+            if (d >= 6) return v;
+            d += 10;
+        }
+        v = (v << 4) | d;
+    }
+}
+
+static int is_true(const char* p) {
+    return *p == 'T';
+}
+
+//Fills o from one row of a log of the given kind, 0 for a row to skip
+static int parse_row(int kind, const char** f, int n, op* o) {
+    if (n < 3) return 0;
+    o->thread = (int)parse_dec(f[0]);
+    o->time_ns = parse_dec(f[1]);
+    o->addr = o->result = o->site = 0;
+    o->size = 0;
+
+    switch (kind) {
+        case OP_MALLOC:
+            if (n < 5) return 0;
+            o->size = parse_dec(f[2]);
+            o->result = parse_ptr(f[3]);
+            o->site = parse_ptr(f[4]);
+            return o->result != 0;
+        case OP_CALLOC:
+            if (n < 7) return 0;
+            o->size = parse_dec(f[4]);
+            o->result = parse_ptr(f[5]);
+            o->site = parse_ptr(f[6]);
+            return o->result != 0;
+        case OP_REALLOC:
+            if (n < 6) return 0;
+            o->addr = parse_ptr(f[2]);
+            o->size = parse_dec(f[3]);
+            o->result = parse_ptr(f[4]);
+            o->site = parse_ptr(f[5]);
+            //A failed realloc leaves the original alone
+            return o->result != 0 || o->size == 0;
+        case OP_FREE:
+            o->addr = parse_ptr(f[2]);
+            return o->addr != 0;
+        case OP_MMAP:
+            //Field 11 is anonymous, 23 the return value
+            if (n < 24) return 0;
+            o->size = parse_dec(f[3]);
+            o->result = parse_ptr(f[23]);
+            o->site = is_true(f[11]);
+            return o->result != 0 && o->result != (uintptr_t)MAP_FAILED;
+        case OP_MUNMAP:
+            if (n < 5 || !is_true(f[4])) return 0;
+            o->addr = parse_ptr(f[2]);
+            o->size = parse_dec(f[3]);
+            return 1;
+    }
+    return 0;
+}
+
+static void add_run_start(chunk* c, size_t start) {
+    if ((c->run_count & (c->run_count - 1)) == 0) {
+        size_t grown = c->run_count ? 2 * c->run_count : 1;
+        c->run_starts = grow_array(c->run_starts, c->run_count * sizeof(size_t), grown * sizeof(size_t));
+    }
+    c->run_starts[c->run_count++] = start;
+}
+
+//Parses the lines that start inside the chunk (the one straddling its end included) and notes where time goes back
+static void parse_chunk(chunk* c) {
+    const char* p = c->begin;
+    const char* fields[32];
+    int n;
+
+    //The header, or the tail of a line the previous chunk owns
+    if (p == c->file_begin || p[-1] != '\n') {
+        const char* nl = memchr(p, '\n', c->file_end - p);
+        p = nl ? nl + 1 : c->file_end;
+    }
+
+    //Every row is at least "t,t,x\n". Huge pages keep the page faults of filling it from taking longer than the parsing.
+    c->capacity = (c->end - c->begin) / 6 + 1;
+    c->ops = map_array(c->capacity * sizeof(op));
+    madvise(c->ops, c->capacity * sizeof(op), MADV_HUGEPAGE);
+
+    while (p < c->end) {
+        p = split_line(p, c->file_end, fields, 32, &n);
+        if (n == 0) break;
+
+        op* o = &c->ops[c->count];
+        if (parse_row(c->kind, fields, n, o)) {
+            o->kind = c->kind;
+            if (c->count == 0 || o->time_ns < o[-1].time_ns) add_run_start(c, c->count);
+            c->count++;
+        }
+    }
+}
+
+static void* parse_worker(void* arg) {
+    (void)arg;
+    for (;;) {
+        size_t i = __atomic_fetch_add(&next_chunk, 1, __ATOMIC_RELAXED);
+        if (i >= chunk_count) return NULL;
+        parse_chunk(&chunks[i]);
+    }
+}
+
+static size_t map_log(const char* dir, int kind) {
+    char path[4096 + 64];
+    snprintf(path, sizeof(path), "%s/%s.csv", dir, op_names[kind]);
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || st.st_size == 0) {
+        if (fd >= 0) close(fd);
+        return 0;
+    }
+
+    char* base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) return 0;
+    madvise(base, st.st_size, MADV_WILLNEED);
+
+    logs[kind].base = base;
+    logs[kind].size = st.st_size;
+
+    size_t pieces = (st.st_size + CHUNK_BYTES - 1) / CHUNK_BYTES;
+    chunks = grow_array(chunks, chunk_count * sizeof(chunk), (chunk_count + pieces) * sizeof(chunk));
+    for (size_t i = 0; i < pieces; i++) {
+        chunk* c = &chunks[chunk_count++];
+        memset(c, 0, sizeof(*c));
+        c->kind = kind;
+        c->file_begin = base;
+        c->file_end = base + st.st_size;
+        c->begin = base + i * CHUNK_BYTES;
+        c->end = i + 1 == pieces ? c->file_end : c->begin + CHUNK_BYTES;
+    }
+    return st.st_size;
+}
+
+//Run order (log kind, then offset) breaks ties between equal timestamps, which puts allocations before frees
+static int run_earlier(size_t a, size_t b) {
+    if (runs[a].next->time_ns != runs[b].next->time_ns) return runs[a].next->time_ns < runs[b].next->time_ns;
+    return a < b;
+}
+
+static void sift_down(size_t i) {
+    for (;;) {
+        size_t smallest = i;
+        size_t left = 2 * i + 1;
+        size_t right = left + 1;
+        if (left < merge_count && run_earlier(merge_heap[left], merge_heap[smallest])) smallest = left;
+        if (right < merge_count && run_earlier(merge_heap[right], merge_heap[smallest])) smallest = right;
+        if (smallest == i) return;
+
+        size_t swap = merge_heap[i];
+        merge_heap[i] = merge_heap[smallest];
+        merge_heap[smallest] = swap;
+        i = smallest;
+    }
+}
+
+//Gathers the chunks' runs, so the ops can be merged into time order (as many times as needed) without a sorted copy
+static void collect_runs(void) {
+    for (size_t i = 0; i < chunk_count; i++) run_count += chunks[i].run_count;
+    runs = map_array(run_count * sizeof(run));
+    merge_heap = map_array(run_count * sizeof(size_t));
+
+    size_t r = 0;
+    for (size_t i = 0; i < chunk_count; i++) {
+        chunk* c = &chunks[i];
+        for (size_t j = 0; j < c->run_count; j++) {
+            runs[r].begin = c->ops + c->run_starts[j];
+            runs[r].end = c->ops + (j + 1 < c->run_count ? c->run_starts[j + 1] : c->count);
+            r++;
+        }
+        //add_run_start() grows it a power of two at a time
+        size_t capacity = 1;
+        while (capacity < c->run_count) capacity <<= 1;
+        if (c->run_starts) munmap(c->run_starts, capacity * sizeof(size_t));
+        op_count += c->count;
+    }
+}
+
+static void merge_begin(void) {
+    merge_count = 0;
+    for (size_t i = 0; i < run_count; i++) {
+        runs[i].next = runs[i].begin;
+        merge_heap[merge_count++] = i;
+    }
+    for (size_t i = merge_count / 2; i-- > 0;) sift_down(i);
+}
+
+//The next op in time order, NULL after the last
+static const op* merge_next(void) {
+    if (merge_count == 0) return NULL;
+
+    run* r = &runs[merge_heap[0]];
+    const op* o = r->next++;
+    if (r->next == r->end) merge_heap[0] = merge_heap[--merge_count];
+    sift_down(0);
+    return o;
+}
+
+static size_t addr_hash(uintptr_t key, size_t mask) {
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdUL;
+    key ^= key >> 33;
+    return key & mask;
+}
+
+static void table_init(table* t) {
+    t->mask = 4095;
+    t->count = 0;
+    t->entries = map_array((t->mask + 1) * sizeof(entry));
+}
+
+static void table_destroy(table* t) {
+    munmap(t->entries, (t->mask + 1) * sizeof(entry));
+}
+
+static void table_put(table* t, const entry* e);
+
+static void table_grow(table* t) {
+    table old = *t;
+    t->mask = 2 * old.mask + 1;
+    t->count = 0;
+    t->entries = map_array((t->mask + 1) * sizeof(entry));
+    for (size_t i = 0; i <= old.mask; i++) {
+        if (old.entries[i].key) table_put(t, &old.entries[i]);
+    }
+    table_destroy(&old);
+}
+
+//Replaces whatever was at the address (a free that shares the allocation's timestamp can sort after it)
+static void table_put(table* t, const entry* e) {
+    if (2 * (t->count + 1) > t->mask + 1) table_grow(t);
+
+    size_t i = addr_hash(e->key, t->mask);
+    while (t->entries[i].key && t->entries[i].key != e->key) i = (i + 1) & t->mask;
+    if (t->entries[i].key == 0) t->count++;
+    t->entries[i] = *e;
+}
+
+static int table_take(table* t, uintptr_t key, entry* out) {
+    size_t i = addr_hash(key, t->mask);
+    while (t->entries[i].key != key) {
+        if (t->entries[i].key == 0) return 0;
+        i = (i + 1) & t->mask;
+    }
+    *out = t->entries[i];
+
+    //Pull later entries of the same run back, so lookups never stop early at the hole
+    size_t hole = i;
+    for (size_t j = (i + 1) & t->mask; t->entries[j].key; j = (j + 1) & t->mask) {
+        size_t home = addr_hash(t->entries[j].key, t->mask);
+        if (((j - home) & t->mask) >= ((j - hole) & t->mask)) {
+            t->entries[hole] = t->entries[j];
+            hole = j;
+        }
+    }
+    t->entries[hole].key = 0;
+    t->count--;
+    return 1;
+}
+
+static thread_stats* find_thread(int tid) {
+    if (last_thread < thread_count && threads[last_thread].tid == tid) return &threads[last_thread];
+    for (int i = 0; i < thread_count; i++) {
+        if (threads[i].tid == tid) {
+            last_thread = i;
+            return &threads[i];
+        }
+    }
+
+    if (thread_count == thread_capacity) {
+        int grown = thread_capacity ? 2 * thread_capacity : 64;
+        threads = grow_array(threads, thread_capacity * sizeof(thread_stats), grown * sizeof(thread_stats));
+        thread_capacity = grown;
+    }
+    last_thread = thread_count;
+    thread_stats* t = &threads[thread_count++];
+    memset(t, 0, sizeof(*t));
+    t->tid = tid;
+    return t;
+}
+
+static int size_class(size_t size) {
+    int c = size ? 64 - __builtin_clzl(size) : 0;
+    return c < SIZE_CLASSES ? c : SIZE_CLASSES - 1;
+}
+
+static void heap_alloc(table* heap, const op* o, int collect) {
+    entry e = { o->result, o->size, o->site, o->thread };
+    entry old;
+    if (table_take(heap, o->result, &old)) live_bytes -= old.size;
+    table_put(heap, &e);
+    live_bytes += o->size;
+
+    if (!collect) return;
+    thread_stats* t = find_thread(o->thread);
+    t->allocs++;
+    t->alloc_bytes += o->size;
+    t->live_bytes += o->size;
+    if (t->live_bytes > t->peak_live_bytes) t->peak_live_bytes = t->live_bytes;
+
+    int c = size_class(o->size);
+    class_allocs[c]++;
+    class_bytes[c] += o->size;
+}
+
+static void heap_free(table* heap, const op* o, int collect) {
+    entry e;
+    if (!table_take(heap, o->addr, &e)) {
+        if (collect) unmatched_frees++;
+        return;
+    }
+    live_bytes -= e.size;
+
+    if (!collect) return;
+    thread_stats* t = find_thread(o->thread);
+    t->frees++;
+    t->freed_bytes += e.size;
+    if (e.thread != o->thread) t->remote_frees++;
+    find_thread(e.thread)->live_bytes -= e.size;
+}
+
+//Page granular, a partial munmap from the start of a mapping keeps the rest of it
+static void map_add(table* maps, const op* o) {
+    size_t size = (o->size + PAGE - 1) & ~(PAGE - 1);
+    entry e = { o->result, size, o->site, o->thread };
+    entry old;
+    if (table_take(maps, o->result, &old)) {
+        mapped_bytes -= old.size;
+        if (old.site) anonymous_bytes -= old.size;
+    }
+    table_put(maps, &e);
+    mappings++;
+
+    mapped_bytes += size;
+    if (o->site) anonymous_bytes += size;
+    if (mapped_bytes > peak_mapped_bytes) {
+        peak_mapped_bytes = mapped_bytes;
+        anonymous_at_peak = anonymous_bytes;
+        peak_mapped_ns = o->time_ns;
+    }
+}
+
+static void map_remove(table* maps, const op* o) {
+    size_t size = (o->size + PAGE - 1) & ~(PAGE - 1);
+    entry e;
+    unmaps++;
+    if (!table_take(maps, o->addr, &e)) {
+        untracked_unmaps++;
+        return;
+    }
+
+    if (size > e.size) size = e.size;
+    mapped_bytes -= size;
+    if (e.site) anonymous_bytes -= size;
+    if (size < e.size) {
+        e.key += size;
+        e.size -= size;
+        table_put(maps, &e);
+    }
+}
+
+
+/**
+ * Replays the first stop ops, in time order, into heap. With collect set it also gathers every statistic and finds the peak,
+ * without it only the live blocks are rebuilt.
+ */
+static void replay(table* heap, size_t stop, int collect) {
+    table maps;
+    table_init(&maps);
+    live_bytes = 0;
+
+    merge_begin();
+    for (size_t i = 0; i < stop; i++) {
+        const op* o = merge_next();
+        if (o == NULL) break;
+
+        switch (o->kind) {
+            case OP_MALLOC:
+            case OP_CALLOC:
+                heap_alloc(heap, o, collect);
+                break;
+            case OP_REALLOC:
+                //A free of the original and an allocation of the result, either of which can be missing
+                if (o->addr) heap_free(heap, o, collect);
+                if (o->result) heap_alloc(heap, o, collect);
+                break;
+            case OP_FREE:
+                heap_free(heap, o, collect);
+                break;
+            case OP_MMAP:
+                if (collect) map_add(&maps, o);
+                break;
+            case OP_MUNMAP:
+                if (collect) map_remove(&maps, o);
+                break;
+        }
+
+        if (collect && live_bytes > peak_live_bytes) {
+            peak_live_bytes = live_bytes;
+            peak_op = i;
+            peak_ns = o->time_ns;
+        }
+    }
+
+    table_destroy(&maps);
+}
+
+static void print_ptr(uintptr_t p) {
+    if (p) printf("\"0x%lx\"", p);
+    else printf("null");
+}
+
+static int by_bytes(const void* a, const void* b) {
+    const site_stats* x = a;
+    const site_stats* y = b;
+    return x->bytes > y->bytes ? -1 : x->bytes < y->bytes;
+}
+
+static int by_tid(const void* a, const void* b) {
+    return ((const thread_stats*)a)->tid - ((const thread_stats*)b)->tid;
+}
+
+//What was live at the peak, by call site and by size class
+static void report_peak(table* heap) {
+    //Sites are keyed one up, so an unknown (null) site doesn't look like an empty slot
+    table sites;
+    table_init(&sites);
+    for (size_t i = 0; i <= heap->mask; i++) {
+        const entry* e = &heap->entries[i];
+        if (e->key == 0) continue;
+
+        int c = size_class(e->size);
+        class_live_blocks[c]++;
+        class_live_bytes[c] += e->size;
+
+        entry s = { e->site + 1, 0, 0, 0 };
+        entry found;
+        if (table_take(&sites, s.key, &found)) s = found;
+        s.size += e->size;
+        s.site++;
+        table_put(&sites, &s);
+    }
+
+    size_t count = 0;
+    size_t bytes = (sites.count + 1) * sizeof(site_stats);
+    site_stats* sorted = map_array(bytes);
+    for (size_t i = 0; i <= sites.mask; i++) {
+        const entry* e = &sites.entries[i];
+        if (e->key) sorted[count++] = (site_stats){ e->key - 1, e->site, e->size };
+    }
+    qsort(sorted, count, sizeof(site_stats), by_bytes);
+
+    printf("\ncall_site,live_blocks_at_peak,live_bytes_at_peak\n");
+    for (size_t i = 0; i < count && i < TOP_SITES; i++) {
+        print_ptr(sorted[i].site);
+        printf(",%lu,%lu\n", sorted[i].blocks, sorted[i].bytes);
+    }
+
+    munmap(sorted, bytes);
+    table_destroy(&sites);
+}
+
+static void report_threads(void) {
+    qsort(threads, thread_count, sizeof(thread_stats), by_tid);
+
+    printf("\nthread,allocs,alloc_bytes,frees,freed_bytes,remote_frees,peak_live_bytes,final_live_bytes\n");
+    for (int i = 0; i < thread_count; i++) {
+        const thread_stats* t = &threads[i];
+        printf("%d,%lu,%lu,%lu,%lu,%lu,%ld,%ld\n", t->tid, t->allocs, t->alloc_bytes, t->frees, t->freed_bytes,
+               t->remote_frees, t->peak_live_bytes, t->live_bytes);
+    }
+}
+
+static void report_size_classes(void) {
+    printf("\nmin_size,max_size,allocs,bytes,live_blocks_at_peak,live_bytes_at_peak\n");
+    for (int c = 0; c < SIZE_CLASSES; c++) {
+        if (class_allocs[c] == 0) continue;
+        unsigned long min = c ? 1UL << (c - 1) : 0;
+        unsigned long max = c ? (1UL << c) - 1 : 0;
+        printf("%lu,%lu,%lu,%lu,%lu,%lu\n", min, max, class_allocs[c], class_bytes[c], class_live_blocks[c],
+               class_live_bytes[c]);
+    }
+}
+
+//glibc's own view of its heap (mallinfo.csv) from the sample nearest the peak, against what was live at the peak
+static void report_fragmentation(const char* dir) {
+    char path[4096 + 64];
+    snprintf(path, sizeof(path), "%s/mallinfo.csv", dir);
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || st.st_size == 0) {
+        if (fd >= 0) close(fd);
+        return;
+    }
+    char* base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) return;
+
+    const char* end = base + st.st_size;
+    const char* fields[8];
+    int n;
+    unsigned long sample[4] = { 0 };
+    unsigned long sample_ns = 0;
+    unsigned long distance = ~0UL;
+
+    const char* p = split_line(base, end, fields, 8, &n);
+    while (p < end) {
+        p = split_line(p, end, fields, 8, &n);
+        if (n < 6) continue;
+
+        unsigned long t = parse_dec(fields[1]);
+        unsigned long d = t > peak_ns ? t - peak_ns : peak_ns - t;
+        if (d >= distance) continue;
+        distance = d;
+        sample_ns = t;
+        for (int i = 0; i < 4; i++) sample[i] = parse_dec(fields[2 + i]);
+    }
+    munmap(base, st.st_size);
+    if (distance == ~0UL) return;
+
+    unsigned long held = sample[0] + sample[1];
+    printf("\nsample_time_ns,heap_bytes,mmapped_bytes,in_use_bytes,free_bytes,live_bytes_at_peak,fragmentation\n");
+    printf("%lu,%lu,%lu,%lu,%lu,%zu,%.4f\n", sample_ns, sample[0], sample[1], sample[2], sample[3], peak_live_bytes,
+           held > peak_live_bytes ? (double)(held - peak_live_bytes) / held : 0.0);
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <pid log dir> [threads]\n", argv[0]);
+        return 1;
+    }
+    long workers = argc > 2 ? atol(argv[2]) : sysconf(_SC_NPROCESSORS_ONLN);
+    if (workers < 1) workers = 1;
+
+    size_t input_bytes = 0;
+    for (int kind = 0; kind < OP_KINDS; kind++) input_bytes += map_log(argv[1], kind);
+    if (chunk_count == 0) {
+        fprintf(stderr, "analyze: no allocation logs in %s\n", argv[1]);
+        return 1;
+    }
+    if ((size_t)workers > chunk_count) workers = chunk_count;
+
+    unsigned long start = now_ns();
+    pthread_t* pool = map_array(workers * sizeof(pthread_t));
+    for (long i = 1; i < workers; i++) pthread_create(&pool[i], NULL, parse_worker, NULL);
+    parse_worker(NULL);
+    for (long i = 1; i < workers; i++) pthread_join(pool[i], NULL);
+    munmap(pool, workers * sizeof(pthread_t));
+    unsigned long parsed = now_ns();
+
+    for (int kind = 0; kind < OP_KINDS; kind++) {
+        if (logs[kind].base) munmap(logs[kind].base, logs[kind].size);
+    }
+    collect_runs();
+
+    table heap;
+    table_init(&heap);
+    replay(&heap, op_count, 1);
+    size_t final_blocks = heap.count;
+    size_t final_bytes = live_bytes;
+
+    //Again up to the peak, for what was live there
+    table_destroy(&heap);
+    table_init(&heap);
+    if (peak_live_bytes) replay(&heap, peak_op + 1, 0);
+    unsigned long replayed = now_ns();
+
+    printf("ops,peak_live_bytes,peak_live_blocks,peak_time_ns,final_live_bytes,final_live_blocks,unmatched_frees\n");
+    printf("%zu,%zu,%zu,%lu,%zu,%zu,%lu\n", op_count, peak_live_bytes, heap.count, peak_ns, final_bytes, final_blocks,
+           unmatched_frees);
+
+    report_peak(&heap);
+    report_threads();
+    report_size_classes();
+
+    printf("\nmappings,unmaps,untracked_unmaps,peak_mapped_bytes,peak_anonymous_bytes,peak_time_ns,final_mapped_bytes,"
+           "final_anonymous_bytes\n");
+    printf("%lu,%lu,%lu,%zu,%zu,%lu,%zu,%zu\n", mappings, unmaps, untracked_unmaps, peak_mapped_bytes, anonymous_at_peak,
+           peak_mapped_ns, mapped_bytes, anonymous_bytes);
+
+    report_fragmentation(argv[1]);
+
+    fprintf(stderr, "analyze: parsed %zu bytes on %ld threads in %lu ns (%.0f MB/s), merged and replayed in %lu ns\n",
+            input_bytes, workers, parsed - start, input_bytes / 1e6 / ((parsed - start) / 1e9), replayed - parsed);
+
+    table_destroy(&heap);
+    for (size_t i = 0; i < chunk_count; i++) munmap(chunks[i].ops, chunks[i].capacity * sizeof(op));
+    munmap(chunks, chunk_count * sizeof(chunk));
+    munmap(runs, run_count * sizeof(run));
+    munmap(merge_heap, run_count * sizeof(size_t));
+    return 0;
+}
@@ -0,0 +1,329 @@
+#define _GNU_SOURCE
+#include "arena.h"
+#include "define_override.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+
+/*
+ * Small blocks come in power of two size classes (16 B to 64 KiB), each with a 16 byte header in front.
+ * Every thread keeps a free list per class, and carves new blocks out of its own slab of a shared 2 MiB chunk.
+ * Freed blocks go to the freeing thread's list. Past CACHE_LIMIT, half of the list moves to a shared list for that class.
+ * That matters because the blocks mostly flow one way (hooks allocate events, the writer thread frees them).
+ * Anything bigger than the largest class is mapped on its own.
+ */
+
+#define CHUNK_SIZE (2UL << 20)
+#define SLAB_SIZE (16UL << 10)
+#define MIN_SHIFT 4
+#define NUM_CLASSES 13
+#define MAX_SMALL (1UL << (MIN_SHIFT + NUM_CLASSES - 1))
+#define CACHE_LIMIT 64
+#define LARGE_CLASS NUM_CLASSES
+
+typedef struct header {
+    size_t size_class;
+    size_t mapped; //Only for large blocks, the length of their mapping
+} header;
+
+typedef struct free_block {
+    struct free_block* next;
+} free_block;
+
+typedef struct free_list {
+    free_block* head;
+    unsigned long count;
+} free_list;
+
+typedef struct shared_list {
+    pthread_mutex_t lock;
+    free_block* head;
+    unsigned long count;
+} shared_list;
+
+typedef struct thread_cache {
+    free_list lists[NUM_CLASSES];
+    char* slab_next;
+    char* slab_end;
+    int registered;
+} thread_cache;
+
+static shared_list shared[NUM_CLASSES] = {
+    [0 ... NUM_CLASSES - 1] = { PTHREAD_MUTEX_INITIALIZER, NULL, 0 }
+};
+
+static __thread thread_cache cache;
+
+//The chunk slabs (and blocks of the larger classes) are currently being cut from
+static pthread_mutex_t chunk_lock = PTHREAD_MUTEX_INITIALIZER;
+static char* chunk_next;
+static char* chunk_end;
+static int try_hugetlb = 1;
+
+static size_t chunk_bytes;
+static size_t huge_page_bytes;
+static size_t large_bytes;
+
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t cache_key;
+
+
+static inline size_t size_class(size_t size) {
+    if (size <= (1UL << MIN_SHIFT)) return 0;
+    return (64 - __builtin_clzl(size - 1)) - MIN_SHIFT;
+}
+
+static inline size_t class_size(size_t c) {
+    return 1UL << (c + MIN_SHIFT);
+}
+
+static void give_back(size_t c, free_block* head, free_block* tail, unsigned long count) {
+    shared_list* list = &shared[c];
+    pthread_mutex_lock(&list->lock);
+    tail->next = list->head;
+    list->head = head;
+    list->count += count;
+    pthread_mutex_unlock(&list->lock);
+}
+
+//Runs when a thread exits, so its cached blocks aren't stranded
+static void flush_cache(void* arg) {
+    thread_cache* tc = arg;
+    for (size_t c = 0; c < NUM_CLASSES; c++) {
+        free_list* list = &tc->lists[c];
+        if (!list->head) continue;
+
+        free_block* tail = list->head;
+        while (tail->next) tail = tail->next;
+        give_back(c, list->head, tail, list->count);
+        list->head = NULL;
+        list->count = 0;
+    }
+}
+
+static void make_key(void) {
+    pthread_key_create(&cache_key, flush_cache);
+}
+
+static void register_cache(void) {
+    pthread_once(&key_once, make_key);
+    pthread_setspecific(cache_key, &cache);
+    cache.registered = 1;
+}
+
+/**
+ * Maps a 2 MiB aligned chunk, preferably out of the explicit huge page pool.
+ * When there is none, it over-maps to get the alignment and asks for transparent huge pages instead.
+ */
+static char* map_chunk(void) {
+    if (try_hugetlb) {
+        void* p = tracer_mmap(NULL, CHUNK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (p != MAP_FAILED) {
+            huge_page_bytes += CHUNK_SIZE;
+            return p;
+        }
+        try_hugetlb = 0;
+    }
+
+    char* raw = tracer_mmap(NULL, 2 * CHUNK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED) return NULL;
+
+    char* aligned = (char*)(((uintptr_t)raw + CHUNK_SIZE - 1) & ~(CHUNK_SIZE - 1));
+    if (aligned > raw) tracer_munmap(raw, aligned - raw);
+    char* tail = aligned + CHUNK_SIZE;
+    if (tail < raw + 2 * CHUNK_SIZE) tracer_munmap(tail, raw + 2 * CHUNK_SIZE - tail);
+
+    tracer_madvise(aligned, CHUNK_SIZE, MADV_HUGEPAGE);
+    return aligned;
+}
+
+//Cuts len bytes off the current chunk, mapping a new one when it runs out. The leftover of the old chunk is abandoned.
+static char* carve_chunk(size_t len) {
+    pthread_mutex_lock(&chunk_lock);
+
+    if (chunk_next == NULL || (size_t)(chunk_end - chunk_next) < len) {
+        char* chunk = map_chunk();
+        if (chunk == NULL) {
+            pthread_mutex_unlock(&chunk_lock);
+            return NULL;
+        }
+        chunk_bytes += CHUNK_SIZE;
+        chunk_next = chunk;
+        chunk_end = chunk + CHUNK_SIZE;
+    }
+
+    char* send = chunk_next;
+    chunk_next += len;
+
+    pthread_mutex_unlock(&chunk_lock);
+    return send;
+}
+
+static free_block* carve_block(size_t c) {
+    size_t len = sizeof(header) + class_size(c);
+    char* mem;
+
+    if (len > SLAB_SIZE / 4) {
+        mem = carve_chunk(len);
+    }
+    else {
+        if ((size_t)(cache.slab_end - cache.slab_next) < len) {
+            char* slab = carve_chunk(SLAB_SIZE);
+            if (slab == NULL) return NULL;
+            cache.slab_next = slab;
+            cache.slab_end = slab + SLAB_SIZE;
+        }
+        mem = cache.slab_next;
+        cache.slab_next += len;
+    }
+
+    if (mem == NULL) return NULL;
+
+    header* h = (header*)mem;
+    h->size_class = c;
+    h->mapped = 0;
+    return (free_block*)(h + 1);
+}
+
+//Refills an empty thread list, from the shared list if it has anything, otherwise with fresh blocks.
+static void refill(size_t c) {
+    free_list* list = &cache.lists[c];
+    shared_list* source = &shared[c];
+
+    pthread_mutex_lock(&source->lock);
+    unsigned long taken = 0;
+    free_block* head = source->head;
+    free_block* tail = NULL;
+    for (free_block* b = head; b != NULL && taken < CACHE_LIMIT / 2; b = b->next) {
+        tail = b;
+        taken++;
+    }
+    if (tail) {
+        source->head = tail->next;
+        source->count -= taken;
+        tail->next = NULL;
+    }
+    pthread_mutex_unlock(&source->lock);
+
+    if (taken) {
+        list->head = head;
+        list->count = taken;
+        return;
+    }
+
+    //Small classes come out of the thread's own slab, so carving a few at once is cheap.
+    unsigned long batch = sizeof(header) + class_size(c) > SLAB_SIZE / 4 ? 1 : 8;
+    for (unsigned long i = 0; i < batch; i++) {
+        free_block* b = carve_block(c);
+        if (b == NULL) break;
+        b->next = list->head;
+        list->head = b;
+        list->count++;
+    }
+}
+
+static void* alloc_large(size_t size) {
+    size_t len = (sizeof(header) + size + 4095) & ~4095UL;
+    header* h = tracer_mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (h == MAP_FAILED) return NULL;
+
+    h->size_class = LARGE_CLASS;
+    h->mapped = len;
+    __atomic_add_fetch(&large_bytes, len, __ATOMIC_RELAXED);
+    return h + 1;
+}
+
+void* arena_alloc(size_t size) {
+    if (size > MAX_SMALL) return alloc_large(size);
+
+    if (!cache.registered) register_cache();
+
+    size_t c = size_class(size);
+    free_list* list = &cache.lists[c];
+    if (list->head == NULL) {
+        refill(c);
+        if (list->head == NULL) return NULL;
+    }
+
+    free_block* b = list->head;
+    list->head = b->next;
+    list->count--;
+    return b;
+}
+
+void* arena_calloc(size_t count, size_t size) {
+    size_t total;
+    if (__builtin_mul_overflow(count, size, &total)) return NULL;
+
+    void* send = arena_alloc(total);
+    if (send) memset(send, 0, total);
+    return send;
+}
+
+void arena_free(void* ptr) {
+    if (ptr == NULL) return;
+
+    header* h = (header*)ptr - 1;
+    if (h->size_class == LARGE_CLASS) {
+        __atomic_sub_fetch(&large_bytes, h->mapped, __ATOMIC_RELAXED);
+        tracer_munmap(h, h->mapped);
+        return;
+    }
+
+    if (!cache.registered) register_cache();
+
+    free_list* list = &cache.lists[h->size_class];
+    free_block* b = ptr;
+    b->next = list->head;
+    list->head = b;
+
+    if (++list->count > CACHE_LIMIT) {
+        //Keep the most recently freed (still cache-warm) half, hand the rest over.
+        free_block* keep_tail = list->head;
+        for (unsigned long i = 1; i < CACHE_LIMIT / 2; i++) keep_tail = keep_tail->next;
+
+        free_block* head = keep_tail->next;
+        free_block* tail = head;
+        unsigned long moved = 1;
+        while (tail->next) {
+            tail = tail->next;
+            moved++;
+        }
+
+        keep_tail->next = NULL;
+        list->count -= moved;
+        give_back(h->size_class, head, tail, moved);
+    }
+}
+
+void arena_stats(ArenaStats* stats) {
+    pthread_mutex_lock(&chunk_lock);
+    stats->chunk_bytes = chunk_bytes;
+    stats->huge_page_bytes = huge_page_bytes;
+    pthread_mutex_unlock(&chunk_lock);
+
+    stats->large_bytes = __atomic_load_n(&large_bytes, __ATOMIC_RELAXED);
+
+    stats->free_bytes = 0;
+    for (size_t c = 0; c < NUM_CLASSES; c++) {
+        pthread_mutex_lock(&shared[c].lock);
+        stats->free_bytes += shared[c].count * (sizeof(header) + class_size(c));
+        pthread_mutex_unlock(&shared[c].lock);
+    }
+}
+
+//No lock can be left held by a thread that doesn't exist in the child
+static void lock_all(void) {
+    pthread_mutex_lock(&chunk_lock);
+    for (size_t c = 0; c < NUM_CLASSES; c++) pthread_mutex_lock(&shared[c].lock);
+}
+
+static void unlock_all(void) {
+    for (size_t c = 0; c < NUM_CLASSES; c++) pthread_mutex_unlock(&shared[c].lock);
+    pthread_mutex_unlock(&chunk_lock);
+}
+
+void arena_init(void) {
+    pthread_atfork(lock_all, unlock_all, unlock_all);
+}
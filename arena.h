@@ -0,0 +1,92 @@
+#pragma once
+#include <stddef.h>
+
+#ifdef __cplusplus
+#include <new>
+#include <functional>
+#include <map>
+#include <unordered_map>
+#include <vector>
+
+extern "C" {
+#endif
+
+/*
+ * The tracer's private heap. Everything the library allocates for its own bookkeeping (event nodes,
+ * payloads, index containers) comes from here instead of malloc, so it neither skews the target's heap
+ * nor competes for its arena locks. Memory is mapped through tracer_mmap(), so it never shows up as a traced mmap.
+ */
+
+// Footprint of the arena, see arena_stats()
+typedef struct {
+    size_t chunk_bytes;  // Mapped for small blocks
+    size_t huge_page_bytes;  // Part of chunk_bytes backed by explicit huge pages (MAP_HUGETLB)
+    size_t large_bytes;  // Mapped for blocks too big for a size class
+    size_t free_bytes;  // Sitting in the shared free lists, not counting per-thread caches
+} ArenaStats;
+
+// Sets up the fork handlers. Must run before the writer thread registers its own, so the arena is locked last.
+void arena_init(void);
+
+// Blocks are 16 byte aligned. Returns NULL only when the kernel refuses to map more memory.
+void* arena_alloc(size_t size);
+
+void* arena_calloc(size_t count, size_t size);
+
+// Accepts NULL. Any thread may free any block.
+void arena_free(void* ptr);
+
+void arena_stats(ArenaStats* stats);
+
+#ifdef __cplusplus
+}
+
+// Allocator adaptor so standard containers keep their nodes in the arena
+template <typename T>
+struct ArenaAllocator {
+    typedef T value_type;
+
+    ArenaAllocator() noexcept {}
+
+    template <typename U>
+    ArenaAllocator(const ArenaAllocator<U>&) noexcept {}
+
+    T* allocate(size_t n) {
+        void* ptr = arena_alloc(n * sizeof(T));
+        if (!ptr) throw std::bad_alloc();
+        return static_cast<T*>(ptr);
+    }
+
+    void deallocate(T* ptr, size_t) noexcept {
+        arena_free(ptr);
+    }
+};
+
+template <typename T, typename U>
+inline bool operator==(const ArenaAllocator<T>&, const ArenaAllocator<U>&) { return true; }
+
+template <typename T, typename U>
+inline bool operator!=(const ArenaAllocator<T>&, const ArenaAllocator<U>&) { return false; }
+
+template <typename T>
+using ArenaVector = std::vector<T, ArenaAllocator<T>>;
+
+template <typename K, typename V>
+using ArenaMap = std::map<K, V, std::less<K>, ArenaAllocator<std::pair<const K, V>>>;
+
+template <typename K, typename V, typename Hash = std::hash<K>>
+using ArenaHashMap = std::unordered_map<K, V, Hash, std::equal_to<K>, ArenaAllocator<std::pair<const K, V>>>;
+
+// Inherit from this to have new/delete of a type go through the arena
+struct ArenaObject {
+    static void* operator new(size_t size) {
+        void* ptr = arena_alloc(size);
+        if (!ptr) throw std::bad_alloc();
+        return ptr;
+    }
+
+    static void operator delete(void* ptr) {
+        arena_free(ptr);
+    }
+};
+#endif
@@ -0,0 +1,63 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * Per-call cost of the hooks. Usage: bench [calls per thread] [threads]
+ * Run it bare and under each LD_PRELOAD_MODE ("make run_bench") and compare the ns/call columns.
+ */
+
+//Called through volatile pointers so the compiler can't fold or inline the calls away from the hooks
+static void* (*volatile do_malloc)(size_t) = malloc;
+static void (*volatile do_free)(void*) = free;
+static void* (*volatile do_memcpy)(void*, const void*, size_t) = memcpy;
+
+static long calls = 200000;
+
+static unsigned long now_ns(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000UL + t.tv_nsec;
+}
+
+static void* malloc_free(void* arg) {
+    for (long i = 0; i < calls; i++) do_free(do_malloc(i % 256 + 1));
+    return NULL;
+}
+
+static void* copy(void* arg) {
+    char src[64] = {0};
+    char dest[64];
+    for (long i = 0; i < calls; i++) do_memcpy(dest, src, i % 64);
+    return NULL;
+}
+
+//Runs body on every thread at once, returns ns per call per thread
+static double run(void* (*body)(void*), int threads) {
+    pthread_t ids[threads];
+    unsigned long start = now_ns();
+    for (int i = 0; i < threads; i++) pthread_create(&ids[i], NULL, body, NULL);
+    for (int i = 0; i < threads; i++) pthread_join(ids[i], NULL);
+    return (double)(now_ns() - start) / calls;
+}
+
+int main(int argc, char** argv) {
+    if (argc > 1) calls = strtol(argv[1], NULL, 10);
+    int threads = argc > 2 ? atoi(argv[2]) : 4;
+    if (calls <= 0 || threads <= 0) {
+        fprintf(stderr, "usage: %s [calls per thread] [threads]\n", argv[0]);
+        return 1;
+    }
+
+    const char* mode = getenv("LD_PRELOAD") ? getenv("LD_PRELOAD_MODE") : "untraced";
+    if (mode == NULL) mode = "events";
+
+    //Counts a malloc and a free as two calls
+    fprintf(stderr, "%-9s malloc+free  1 thread:  %7.1f ns/call\n", mode, run(malloc_free, 1) / 2);
+    fprintf(stderr, "%-9s malloc+free  %d threads: %7.1f ns/call\n", mode, threads, run(malloc_free, threads) / 2);
+    fprintf(stderr, "%-9s memcpy       1 thread:  %7.1f ns/call\n", mode, run(copy, 1));
+    return 0;
+}
@@ -0,0 +1,310 @@
+#define _GNU_SOURCE
+#include "collector.h"
+#include <errno.h>
+#include <poll.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+/*
+ * Collector daemon for LD_PRELOAD_COLLECTOR. Usage: collector <socket path> [output dir]
+ * Rows from every traced process go to <output dir>/<log name>.csv with a leading pid column,
+ * and process_tree.csv records where each process came from. Stop it with SIGINT or SIGTERM.
+ */
+
+#define MAX_OUTPUTS 64
+
+typedef struct output {
+    char name[64];
+    FILE* file;
+} output;
+
+typedef struct process {
+    pid_t pid;
+    pid_t ppid;  // From the HELLO, 0 until it connects
+    pid_t forked_by;  // From the parent's FORK or CLONE3 rows, 0 when none were seen
+    const char* created_by;  // "fork", "vfork", "clone3", or "" when no row was seen
+    unsigned long fork_time_ns;
+    unsigned long frames;
+    unsigned long rows;
+    unsigned long dropped_rows;
+    int connections;
+    int said_bye;
+} process;
+
+typedef struct client {
+    int fd;
+    size_t process;  // Index into processes, valid once the HELLO arrived
+    int hello;
+} client;
+
+static output outputs[MAX_OUTPUTS];
+static int output_count;
+
+static process* processes;
+static size_t process_count;
+static size_t process_capacity;
+
+static client* clients;
+static struct pollfd* polls;
+static size_t client_count;
+static size_t client_capacity;
+
+static const char* out_dir = ".";
+static volatile sig_atomic_t stop;
+
+//Frames are read whole, so this only needs to fit the largest one
+static char frame[sizeof(collector_frame) + COLLECTOR_MAX_FRAME];
+
+
+static void on_signal(int sig) {
+    stop = 1;
+}
+
+static size_t find_process(pid_t pid) {
+    for (size_t i = 0; i < process_count; i++) {
+        if (processes[i].pid == pid) return i;
+    }
+
+    if (process_count == process_capacity) {
+        process_capacity = process_capacity ? 2 * process_capacity : 64;
+        processes = realloc(processes, process_capacity * sizeof(process));
+        if (processes == NULL) exit(1);
+    }
+    memset(&processes[process_count], 0, sizeof(process));
+    processes[process_count].pid = pid;
+    processes[process_count].created_by = "";
+    return process_count++;
+}
+
+static FILE* find_output(const char* name, const char* header) {
+    for (int i = 0; i < output_count; i++) {
+        if (strcmp(outputs[i].name, name) == 0) return outputs[i].file;
+    }
+    if (output_count == MAX_OUTPUTS || strlen(name) >= sizeof(outputs[0].name) || strchr(name, '/')) return NULL;
+
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s.csv", out_dir, name);
+    FILE* f = fopen(path, "w");
+    if (f == NULL) {
+        fprintf(stderr, "collector: can't create %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+    fprintf(f, "pid,%s\n", header);
+
+    strcpy(outputs[output_count].name, name);
+    outputs[output_count].file = f;
+    output_count++;
+    return f;
+}
+
+static void write_process_tree(void) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/process_tree.csv", out_dir);
+    FILE* f = fopen(path, "w");
+    if (f == NULL) return;
+
+    fprintf(f, "pid,ppid,forked_by,created_by,fork_time_ns,frames,rows,dropped_rows,finished\n");
+    for (size_t i = 0; i < process_count; i++) {
+        process* p = &processes[i];
+        fprintf(f, "%d,%d,%d,%s,%lu,%lu,%lu,%lu,%s\n", p->pid, p->ppid, p->forked_by, p->created_by, p->fork_time_ns,
+                p->frames, p->rows, p->dropped_rows, p->said_bye ? "True" : "False");
+    }
+    fclose(f);
+}
+
+static void note_child(pid_t parent, int child, unsigned long time_ns, const char* created_by) {
+    if (child <= 0) return;
+
+    //find_process() may move the array, so index it only after
+    size_t i = find_process(child);
+    process* p = &processes[i];
+    p->forked_by = parent;
+    p->created_by = created_by;
+    p->fork_time_ns = time_ns;
+}
+
+//A FORK row reads thread,time_ns,virtual,return_value. The return value in the parent is the child's pid.
+static void note_fork(pid_t parent, const char* line) {
+    unsigned long time_ns;
+    char is_virtual[8];
+    int child;
+    if (sscanf(line, "%*d,%lu,%7[^,],%d", &time_ns, is_virtual, &child) != 3) return;
+
+    note_child(parent, child, time_ns, strcmp(is_virtual, "True") == 0 ? "vfork" : "fork");
+}
+
+//A CLONE3 row reads thread,time_ns, the 11 clone_args fields (flags first), the size, then the return value, which is
+//the child's pid. Clones sharing the address space (CLONE_THREAD) are threads, not processes.
+static void note_clone3(pid_t parent, const char* line, const char* eol) {
+    unsigned long time_ns;
+    unsigned long flags;
+    if (sscanf(line, "%*d,%lu,%lu", &time_ns, &flags) != 2 || (flags & CLONE_THREAD)) return;
+
+    const char* last = eol;
+    while (last > line && last[-1] != ',') last--;
+    if (last == line) return;
+
+    note_child(parent, (int)strtoul(last, NULL, 10), time_ns, "clone3");
+}
+
+static void handle_rows(process* p, const collector_frame* h, const char* body) {
+    const char* name = body;
+    size_t name_len = strnlen(name, h->label_len);
+    if (name_len + 1 >= h->label_len) return;
+    const char* header = name + name_len + 1;
+    if (body[h->label_len - 1] != '\0') return;
+
+    FILE* out = find_output(name, header);
+    int is_fork = strcmp(name, "fork") == 0;
+    int is_clone3 = strcmp(name, "clone3") == 0;
+
+    const char* line = body + h->label_len;
+    const char* end = line + h->length;
+    while (line < end) {
+        const char* eol = memchr(line, '\n', end - line);
+        if (eol == NULL) eol = end;
+
+        if (out) {
+            fprintf(out, "%d,", p->pid);
+            fwrite(line, 1, eol - line, out);
+            fputc('\n', out);
+        }
+        if (is_fork) note_fork(p->pid, line);
+        if (is_clone3) note_clone3(p->pid, line, eol);
+
+        p->rows++;
+        line = eol + 1;
+    }
+    p->frames++;
+}
+
+//Returns 0 once the client has hung up
+static int handle_frame(client* c) {
+    ssize_t n = recv(c->fd, frame, sizeof(frame), MSG_TRUNC);
+    if (n <= 0) return n < 0 && (errno == EAGAIN || errno == EINTR);
+    if ((size_t)n > sizeof(frame) || (size_t)n < sizeof(collector_frame)) return 1;
+
+    collector_frame h;
+    memcpy(&h, frame, sizeof(h));
+    if (h.magic != COLLECTOR_MAGIC) return 0;
+    if (sizeof(h) + h.label_len + h.length > (size_t)n) return 1;
+
+    if (!c->hello) {
+        if (h.kind != FRAME_HELLO) return 0;
+        c->hello = 1;
+        c->process = find_process(h.pid);
+        processes[c->process].ppid = h.ppid;
+        processes[c->process].connections++;
+        return 1;
+    }
+
+    process* p = &processes[c->process];
+    switch (h.kind) {
+        case FRAME_ROWS:
+            handle_rows(p, &h, frame + sizeof(h));
+            break;
+        case FRAME_BYE:
+            p->said_bye = 1;
+            p->dropped_rows += h.dropped_rows;
+            break;
+    }
+    return 1;
+}
+
+//The listener takes the first poll slot, so there is always one more of those than clients
+static void grow_clients(void) {
+    client_capacity = client_capacity ? 2 * client_capacity : 64;
+    clients = realloc(clients, client_capacity * sizeof(client));
+    polls = realloc(polls, (client_capacity + 1) * sizeof(struct pollfd));
+    if (clients == NULL || polls == NULL) exit(1);
+}
+
+static void add_client(int fd) {
+    if (client_count == client_capacity) grow_clients();
+    clients[client_count].fd = fd;
+    clients[client_count].hello = 0;
+    client_count++;
+}
+
+static void remove_client(size_t i) {
+    close(clients[i].fd);
+    clients[i] = clients[--client_count];
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <socket path> [output dir]\n", argv[0]);
+        return 1;
+    }
+    if (argc > 2) out_dir = argv[2];
+    mkdir(out_dir, 0777);
+
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(argv[1]) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "collector: socket path too long\n");
+        return 1;
+    }
+    strcpy(addr.sun_path, argv[1]);
+
+    int listener = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    unlink(addr.sun_path);
+    if (listener < 0 || bind(listener, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(listener, 128) != 0) {
+        fprintf(stderr, "collector: can't listen on %s: %s\n", addr.sun_path, strerror(errno));
+        return 1;
+    }
+
+    //No SA_RESTART, so poll() returns as soon as a signal arrives
+    struct sigaction sa = { .sa_handler = on_signal };
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    grow_clients();
+
+    while (!stop) {
+        polls[0].fd = listener;
+        polls[0].events = POLLIN;
+        for (size_t i = 0; i < client_count; i++) {
+            polls[i + 1].fd = clients[i].fd;
+            polls[i + 1].events = POLLIN;
+        }
+
+        int ready = poll(polls, client_count + 1, 1000);
+        if (ready < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (ready == 0) {
+            //Quiet moment, get what we have onto disk
+            for (int i = 0; i < output_count; i++) fflush(outputs[i].file);
+            write_process_tree();
+            continue;
+        }
+
+        //Walk backwards, since removing a client moves the last one into its place
+        size_t polled = client_count;
+        for (size_t i = polled; i-- > 0;) {
+            if (polls[i + 1].revents == 0) continue;
+            if (!handle_frame(&clients[i])) remove_client(i);
+        }
+
+        if (polls[0].revents & POLLIN) {
+            int fd = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+            if (fd >= 0) add_client(fd);
+        }
+    }
+
+    for (size_t i = 0; i < client_count; i++) close(clients[i].fd);
+    close(listener);
+    unlink(addr.sun_path);
+
+    for (int i = 0; i < output_count; i++) fclose(outputs[i].file);
+    write_process_tree();
+    return 0;
+}
@@ -0,0 +1,30 @@
+#pragma once
+#include <stdint.h>
+
+/*
+ * Wire format between the library and the collector daemon (collector.c).
+ * The transport is a SOCK_SEQPACKET Unix socket, so every frame arrives whole or not at all.
+ * The library sends a HELLO after connecting, then ROWS frames as its log buffers fill up, then a BYE from its destructor.
+ */
+
+#define COLLECTOR_MAGIC 0x5448454dU
+
+// Largest frame the library will send, label and payload included
+#define COLLECTOR_MAX_FRAME (64U << 10)
+
+enum {
+    FRAME_HELLO,
+    FRAME_ROWS,
+    FRAME_BYE
+};
+
+typedef struct {
+    uint32_t magic;
+    uint16_t kind;
+    uint16_t label_len;  // ROWS: "<log name>\0<header line>\0" follows this struct
+    int32_t pid;
+    int32_t ppid;
+    uint32_t length;  // ROWS: bytes of complete CSV lines after the label
+    uint32_t reserved;
+    uint64_t dropped_rows;  // BYE: rows this process could not deliver
+} collector_frame;
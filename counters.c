@@ -0,0 +1,72 @@
+#define _GNU_SOURCE
+#include "counters.h"
+#include "event_writer.h"
+
+int counters_enabled;
+__thread counter_block* counters_mine __attribute__((tls_model("initial-exec")));
+
+//Everything exited threads counted
+static counter_block retired;
+
+static log_file* counts_file;
+
+
+//Adds an exiting thread's counts to the retired ones
+static void fold(thread_block* into, const thread_block* from) {
+    counter_block* sum = (counter_block*)into;
+    const counter_block* c = (const counter_block*)from;
+    for (int id = 0; id < MAX_OVERRIDE_VAL; id++) {
+        for (int b = 0; b < COUNT_BUCKETS; b++) {
+            sum->calls[id][b] += c->calls[id][b];
+            sum->bytes[id][b] += c->bytes[id][b];
+        }
+    }
+}
+
+static void set_mine(thread_block* block) {
+    counters_mine = (counter_block*)block;
+}
+
+static thread_blocks registry = THREAD_BLOCKS_INITIALIZER(counter_block, retired, fold, set_mine);
+
+counter_block* counters_register(void) {
+    return (counter_block*)thread_blocks_register(&registry);
+}
+
+void counters_init(void) {
+    counters_enabled = 1;
+    thread_blocks_init(&registry);
+}
+
+static void write_block(const thread_block* block, pid_t thread_id, void* ctx) {
+    const counter_block* c = (const counter_block*)block;
+    unsigned long time_ns = *(const unsigned long*)ctx;
+    for (int id = 0; id < MAX_OVERRIDE_VAL; id++) {
+        for (int b = 0; b < COUNT_BUCKETS; b++) {
+            unsigned long calls = __atomic_load_n(&c->calls[id][b], __ATOMIC_RELAXED);
+            if (calls == 0) continue;
+
+            unsigned long bytes = __atomic_load_n(&c->bytes[id][b], __ATOMIC_RELAXED);
+            log_printf(counts_file, "%lu,%d,%s,%lu,%lu,%lu\n", time_ns, thread_id, event_name(id),
+                       log2_bucket_min(b), calls, bytes);
+        }
+    }
+}
+
+void counters_write(unsigned long time_ns) {
+    if (!counters_enabled) return;
+
+    if (counts_file == NULL) {
+        counts_file = log_open("counts", "time_ns,thread,event,min_size,calls,bytes");
+        if (counts_file == NULL) return;
+    }
+
+    thread_blocks_visit(&registry, write_block, &time_ns);
+
+    log_flush(counts_file);
+}
+
+void counters_close(void) {
+    if (counts_file) log_close(counts_file);
+    counts_file = NULL;
+}
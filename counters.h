@@ -0,0 +1,55 @@
+#pragma once
+#include "event_queue.h"
+#include "thread_blocks.h"
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * LD_PRELOAD_MODE=counts: the hooks only bump per-thread counters of calls and bytes per OVERRIDE_ID and power of two
+ * size bucket. There are no events, timestamps or alloc_map updates. The writer thread merges the counters into
+ * counts.csv every LD_PRELOAD_COUNTS_MS (default 10000, 0 for exit only), and once more at exit.
+ * Lock waits (MUTEX_WAIT, COND_WAIT) are bucketed and summed by wait ns in place of bytes.
+ */
+
+#define COUNT_BUCKETS 24  // Bucket b holds sizes in [2^(b-1), 2^b), bucket 0 is size 0 and the last one is open ended
+
+// One thread's counters. Only the owning thread writes to it, and the alignment keeps it off other threads' lines.
+typedef struct counter_block {
+    thread_block header;
+    unsigned long calls[MAX_OVERRIDE_VAL][COUNT_BUCKETS];
+    unsigned long bytes[MAX_OVERRIDE_VAL][COUNT_BUCKETS];
+} __attribute__((aligned(64))) counter_block;
+
+extern int counters_enabled;
+extern __thread counter_block* counters_mine __attribute__((tls_model("initial-exec")));
+
+// Hands the calling thread its block on its first counted call, NULL if none could be mapped
+counter_block* counters_register(void);
+
+static inline __attribute__((always_inline)) void count_call(int id, size_t bytes) {
+    counter_block* c = counters_mine;
+    if (__builtin_expect(c == NULL, 0)) {
+        c = counters_register();
+        if (c == NULL) return;
+    }
+
+    int bucket = log2_bucket(bytes, COUNT_BUCKETS);
+
+    //Plain stores, since only this thread writes here. Being atomic just keeps the writer thread's reads well defined.
+    __atomic_store_n(&c->calls[id][bucket], c->calls[id][bucket] + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&c->bytes[id][bucket], c->bytes[id][bucket] + bytes, __ATOMIC_RELAXED);
+}
+
+void counters_init(void);
+
+// Append the merged totals, one row per thread, event and bucket that saw calls. Exited threads are merged as thread 0.
+void counters_write(unsigned long time_ns);
+
+void counters_close(void);
+
+#ifdef __cplusplus
+}
+#endif
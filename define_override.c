@@ -3,6 +3,9 @@
 #include "define_override.h"
 #include "alloc_map.h"
 #include "event_queue.h"
+#include "arena.h"
+#include "counters.h"
+#include "faults.h"
 #include <pthread.h>
 #include <sys/mman.h>
 #include <string.h>
@@ -10,64 +13,78 @@
 #include <sys/syscall.h>
 #include <sched.h>
 #include <time.h>
+#include <errno.h>
+#include <sys/uio.h>
 
 
-static __thread int new_behavior = 0;
+__thread int tracer_new_behavior = 0;
+__thread void* tracer_call_site = NULL;
 static __thread struct timespec time_buffer;
 
-void enable_new_behavior(void) {
-    new_behavior = 1;
-}
-
-void disable_new_behavior(void) {
-    new_behavior = 0;
-}
-
-int use_new_behavior(void) {
-    return new_behavior;
-}
+//LD_PRELOAD_MODE=counts: count the call and return before any event data, timestamp or alloc_map work
+#define COUNT_ONLY(id, bytes, result) \
+    if (counters_enabled) {           \
+        overhead_note(id);            \
+        count_call(id, bytes);        \
+        return result;                \
+    }
 
 
 OVERRIDE(void*, malloc, (size_t size), (size)) {
     //printf("MALLOC %ld\n", size);
-    void* send = real_malloc(size);
+    void* send = OVERHEAD_REAL(real_malloc(size));
+    COUNT_ONLY(MALLOC, size, send)
+    if (faults_enabled) faults_tick();
     
-    void** data = real_malloc(2*sizeof(void*));
+    void** data = event_data(MALLOC);
     data[0] = (void*)size;
     data[1] = (void*)send;
+    data[2] = get_call_site();
     push_event(MALLOC, data, &time_buffer);
-    alloc_map_add_event(gettid(), send, MALLOC, &time_buffer, NULL, size);
+    if (alloc_map_inline) alloc_map_add_event(gettid(), send, MALLOC, &time_buffer, NULL, size);
     return send;
 }
 
 OVERRIDE(void*, calloc, (size_t mem_count, size_t mem_size), (mem_count, mem_size)) {
-    void* send = real_calloc(mem_count, mem_size);
+    void* send = OVERHEAD_REAL(real_calloc(mem_count, mem_size));
+    COUNT_ONLY(CALLOC, mem_count * mem_size, send)
+    if (faults_enabled) faults_tick();
 
-    void** data = malloc(3*sizeof(void*));
+    void** data = event_data(CALLOC);
     data[0] = (void*)mem_count;
     data[1] = (void*)mem_size;
     data[2] = send;
+    data[3] = get_call_site();
     push_event(CALLOC, data, &time_buffer);
-    alloc_map_add_event(gettid(), send, CALLOC, &time_buffer, NULL, mem_count*mem_size);
+    if (alloc_map_inline) alloc_map_add_event(gettid(), send, CALLOC, &time_buffer, NULL, mem_count*mem_size);
     return send;
 }
 
 OVERRIDE(void*, realloc, (void* ptr, size_t size), (ptr, size)) {
-    void* send = real_realloc(ptr, size);
+    void* send = OVERHEAD_REAL(real_realloc(ptr, size));
+    COUNT_ONLY(REALLOC, size, send)
+    if (faults_enabled) faults_tick();
 
-    void** data = malloc(3*sizeof(void*));
+    void** data = event_data(REALLOC);
     data[0] = ptr;
     data[1] = (void*)size;
     data[2] = send;
+    data[3] = get_call_site();
     push_event(REALLOC, data, &time_buffer);
-    alloc_map_add_event(gettid(), send, REALLOC, &time_buffer, ptr, size);
+    if (alloc_map_inline) alloc_map_add_event(gettid(), send, REALLOC, &time_buffer, ptr, size);
     return send;
 }
 
 OVERRIDE(void*, mmap, (void *addr, size_t len, int prot, int flags, int fd, off_t offset), (addr, len, prot, flags, fd, offset)) {
-    void* send = real_mmap(addr, len, prot, flags, fd, offset);
+    //Closes the window before, so the populating faults are the only ones in the next sample
+    int populate = faults_enabled && (flags & MAP_POPULATE);
+    if (populate) faults_sample();
 
-    mmap_data* data = malloc(sizeof(mmap_data));
+    void* send = OVERHEAD_REAL(real_mmap(addr, len, prot, flags, fd, offset));
+    COUNT_ONLY(MMAP, len, send)
+    if (faults_enabled && !populate) faults_tick();
+
+    mmap_data* data = event_data(MMAP);
     data->addr = addr;
     data->len = len;
     data->prot = prot;
@@ -75,57 +92,389 @@ OVERRIDE(void*, mmap, (void *addr, size_t len, int prot, int flags, int fd, off_
     data->fd = fd;
     data->offset = offset;
     data->retVal = send;
+    data->call_site = get_call_site();
 
     push_event(MMAP, data, &time_buffer);
-    alloc_map_add_event(gettid(), send, MMAP, &time_buffer, addr, len);
+    if (alloc_map_inline) alloc_map_add_event(gettid(), send, MMAP, &time_buffer, addr, len);
+    if (populate) faults_sample();
     return send;
 }
 
 OVERRIDE(int, munmap, (void* addr, size_t size), (addr, size)) {
-    int send = real_munmap(addr, size);
+    int send = OVERHEAD_REAL(real_munmap(addr, size));
+    COUNT_ONLY(MUNMAP, size, send)
 
-    void** data = malloc(3*sizeof(void));
+    void** data = event_data(MUNMAP);
     data[0] = addr;
     data[1] = (void*) size;
     data[2] = (void*)((long)send);
 
     push_event(MUNMAP, data, &time_buffer);
-    alloc_map_add_event(gettid(), addr, MUNMAP, &time_buffer, NULL, send);
+    if (alloc_map_inline) alloc_map_add_event(gettid(), addr, MUNMAP, &time_buffer, NULL, send);
+    return send;
+}
+
+
+/**
+ * mremap() is variadic (the new address is only passed along with MREMAP_FIXED), which OVERRIDE can't express.
+ * So this is the same wrapper OVERRIDE would generate, written out by hand.
+ */
+typedef void* (*mremap_t)(void*, size_t, size_t, int, ...);
+static mremap_t real_mremap = NULL;
+RESOLVE_EAGERLY(mremap)
+
+static void* new_mremap(void* old_address, size_t old_size, size_t new_size, int flags, void* new_address);
+
+void* mremap(void* old_address, size_t old_size, size_t new_size, int flags, ...) {
+    ASSERT_REAL(mremap)
+
+    void* new_address = NULL;
+    if (flags & MREMAP_FIXED) {
+        va_list ap;
+        va_start(ap, flags);
+        new_address = va_arg(ap, void*);
+        va_end(ap);
+    }
+
+    if (use_new_behavior()) {
+        disable_new_behavior();
+        set_call_site(__builtin_return_address(0));
+        unsigned long overhead_start = overhead_hook_begin();
+        void* send = new_mremap(old_address, old_size, new_size, flags, new_address);
+        overhead_hook_end(overhead_start);
+        enable_new_behavior();
+        return send;
+    }
+    else {
+        return real_mremap(old_address, old_size, new_size, flags, new_address);
+    }
+}
+
+static void* new_mremap(void* old_address, size_t old_size, size_t new_size, int flags, void* new_address) {
+    void* send = OVERHEAD_REAL(real_mremap(old_address, old_size, new_size, flags, new_address));
+    COUNT_ONLY(MREMAP, new_size, send)
+
+    void** data = event_data(MREMAP);
+    data[0] = old_address;
+    data[1] = (void*)old_size;
+    data[2] = (void*)new_size;
+    data[3] = (void*)((long)flags);
+    data[4] = new_address;
+    data[5] = send;
+
+    push_event(MREMAP, data, &time_buffer);
     return send;
 }
 
+OVERRIDE(int, madvise, (void* addr, size_t len, int advice), (addr, len, advice)) {
+    int send = OVERHEAD_REAL(real_madvise(addr, len, advice));
+    COUNT_ONLY(MADVISE, len, send)
+
+    void** data = event_data(MADVISE);
+    data[0] = addr;
+    data[1] = (void*)len;
+    data[2] = (void*)((long)advice);
+    data[3] = (void*)((long)send);
+
+    push_event(MADVISE, data, &time_buffer);
+    return send;
+}
+
+OVERRIDE(int, mprotect, (void* addr, size_t len, int prot), (addr, len, prot)) {
+    int send = OVERHEAD_REAL(real_mprotect(addr, len, prot));
+    COUNT_ONLY(MPROTECT, len, send)
+
+    void** data = event_data(MPROTECT);
+    data[0] = addr;
+    data[1] = (void*)len;
+    data[2] = (void*)((long)prot);
+    data[3] = (void*)((long)send);
+
+    push_event(MPROTECT, data, &time_buffer);
+    return send;
+}
+
+//glibc malloc grows its main arena through internal calls to __brk/__sbrk, which can't be interposed.
+//These only catch the target application (or other libraries) moving the break directly.
+OVERRIDE(int, brk, (void* addr), (addr)) {
+    int send = OVERHEAD_REAL(real_brk(addr));
+    COUNT_ONLY(BRK, 0, send)
+
+    void** data = event_data(BRK);
+    data[0] = addr;
+    data[1] = (void*)((long)send);
+
+    push_event(BRK, data, &time_buffer);
+    return send;
+}
+
+OVERRIDE(void*, sbrk, (intptr_t increment), (increment)) {
+    void* send = OVERHEAD_REAL(real_sbrk(increment));
+    COUNT_ONLY(SBRK, increment > 0 ? increment : -increment, send)
+
+    void** data = event_data(SBRK);
+    data[0] = (void*)increment;
+    data[1] = send;
+
+    push_event(SBRK, data, &time_buffer);
+    return send;
+}
+
+void* tracer_mmap(void* addr, size_t len, int prot, int flags, int fd, off_t offset) {
+    ASSERT_REAL(mmap)
+    return real_mmap(addr, len, prot, flags, fd, offset);
+}
+
+int tracer_munmap(void* addr, size_t len) {
+    ASSERT_REAL(munmap)
+    return real_munmap(addr, len);
+}
+
+int tracer_madvise(void* addr, size_t len, int advice) {
+    ASSERT_REAL(madvise)
+    return real_madvise(addr, len, advice);
+}
 
 V_OVERRIDE(free, (void* arg), (arg)) {
+    if (counters_enabled) {
+        overhead_note(FREE);
+        count_call(FREE, 0);
+        OVERHEAD_REAL_VOID(real_free(arg));
+        return;
+    }
     push_event(FREE, arg, &time_buffer);
-    real_free(arg);
+    if (alloc_map_inline) alloc_map_release(gettid(), arg);
+    OVERHEAD_REAL_VOID(real_free(arg));
 }
 
 
 OVERRIDE(void*, memcpy, (void* dest, const void* src, size_t n), (dest, src, n)) {
-    void** data = malloc(3*sizeof(void*));
+    COUNT_ONLY(MEMCPY, n, OVERHEAD_REAL(real_memcpy(dest, src, n)))
+    void** data = event_data(MEMCPY);
     data[0] = dest;
     data[1] = (void*)src;
     data[2] = (void*)n;
 
     push_event(MEMCPY, data, &time_buffer);
 
-    return real_memcpy(dest, src, n);
+    return OVERHEAD_REAL(real_memcpy(dest, src, n));
 }
 
 
 
 OVERRIDE(char*, strncpy, (char* dest, const char* src, size_t n), (dest, src, n)) {
-    void** data = malloc(3*sizeof(void*));
+    COUNT_ONLY(STRNCPY, n, OVERHEAD_REAL(real_strncpy(dest, src, n)))
+    void** data = event_data(STRNCPY);
     data[0] = dest;
     data[1] = (void*)src;
     data[2] = (void*)n;
 
     push_event(STRNCPY, data, &time_buffer);
 
-    return real_strncpy(dest, src, n);
+    return OVERHEAD_REAL(real_strncpy(dest, src, n));
+}
+
+
+
+static unsigned long monotonic_ns(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (t.tv_sec * 1000000000UL) + t.tv_nsec;
+}
+
+/**
+ * Lock hooks only cost a trylock while the lock is free. Only a caller that finds it taken gets timed and recorded.
+ * The tracer's own locks are taken with new behavior off (inside a hook, or on the writer thread), so they go straight to the real calls.
+ */
+OVERRIDE(int, pthread_mutex_trylock, (pthread_mutex_t* mutex), (mutex)) {
+    int send = OVERHEAD_REAL(real_pthread_mutex_trylock(mutex));
+    if (send != EBUSY) return send;
+    COUNT_ONLY(MUTEX_BUSY, 0, send)
+
+    void** data = event_data(MUTEX_BUSY);
+    data[0] = mutex;
+    data[1] = get_call_site();
+    push_event(MUTEX_BUSY, data, &time_buffer);
+    return send;
+}
+
+OVERRIDE(int, pthread_mutex_lock, (pthread_mutex_t* mutex), (mutex)) {
+    int send = OVERHEAD_REAL(real_pthread_mutex_trylock(mutex));
+    //Anything but EBUSY is what the real lock would have said, and EOWNERDEAD already holds the lock
+    if (send != EBUSY) return send;
+
+    unsigned long start = monotonic_ns();
+    send = OVERHEAD_REAL(real_pthread_mutex_lock(mutex));
+    unsigned long wait = monotonic_ns() - start;
+    //Counted in wait ns rather than bytes
+    COUNT_ONLY(MUTEX_WAIT, wait, send)
+
+    void** data = event_data(MUTEX_WAIT);
+    data[0] = mutex;
+    data[1] = (void*)wait;
+    data[2] = (void*)(long)send;
+    data[3] = get_call_site();
+    push_event(MUTEX_WAIT, data, &time_buffer);
+    return send;
+}
+
+//Condition waits always block, so every one is timed. The time includes taking the mutex back.
+static void record_cond_wait(pthread_cond_t* cond, pthread_mutex_t* mutex, unsigned long wait, int send) {
+    if (counters_enabled) {
+        overhead_note(COND_WAIT);
+        count_call(COND_WAIT, wait);
+        return;
+    }
+
+    void** data = event_data(COND_WAIT);
+    data[0] = cond;
+    data[1] = mutex;
+    data[2] = (void*)wait;
+    data[3] = (void*)(long)send;
+    data[4] = get_call_site();
+    push_event(COND_WAIT, data, &time_buffer);
+}
+
+//The default dlsym() lookup finds the pre-2.3.2 condition variables, which use a different layout
+OVERRIDE_VERSIONED(int, pthread_cond_wait, "GLIBC_2.3.2", (pthread_cond_t* cond, pthread_mutex_t* mutex), (cond, mutex)) {
+    unsigned long start = monotonic_ns();
+    int send = OVERHEAD_REAL(real_pthread_cond_wait(cond, mutex));
+    record_cond_wait(cond, mutex, monotonic_ns() - start, send);
+    return send;
+}
+
+OVERRIDE_VERSIONED(int, pthread_cond_timedwait, "GLIBC_2.3.2",
+        (pthread_cond_t* cond, pthread_mutex_t* mutex, const struct timespec* abstime), (cond, mutex, abstime)) {
+    unsigned long start = monotonic_ns();
+    int send = OVERHEAD_REAL(real_pthread_cond_timedwait(cond, mutex, abstime));
+    record_cond_wait(cond, mutex, monotonic_ns() - start, send);
+    return send;
 }
 
 
+/**
+ * I/O hooks time the real call and record it. The writer thread writes its logs with new behavior off, so it never traces itself.
+ * errno is kept, callers of a failed (or would-block) call still need to see why.
+ */
+static void record_io(int id, int fd, size_t requested, ssize_t returned, unsigned long start, long extra) {
+    unsigned long duration = monotonic_ns() - start;
+    int saved_errno = errno;
+
+    if (counters_enabled) {
+        overhead_note(id);
+        count_call(id, returned > 0 ? returned : 0);
+    }
+    else {
+        void** data = event_data(id);
+        data[0] = (void*)(long)fd;
+        data[1] = (void*)requested;
+        data[2] = (void*)returned;
+        data[3] = (void*)duration;
+        data[4] = get_call_site();
+        data[5] = (void*)extra;
+        push_event(id, data, &time_buffer);
+    }
+
+    errno = saved_errno;
+}
+
+static void record_sync(int id, int fd, int send, unsigned long start) {
+    unsigned long duration = monotonic_ns() - start;
+    int saved_errno = errno;
+
+    if (counters_enabled) {
+        overhead_note(id);
+        count_call(id, 0);
+    }
+    else {
+        void** data = event_data(id);
+        data[0] = (void*)(long)fd;
+        data[1] = (void*)(long)send;
+        data[2] = (void*)duration;
+        data[3] = get_call_site();
+        push_event(id, data, &time_buffer);
+    }
+
+    errno = saved_errno;
+}
+
+static size_t iovec_bytes(const struct iovec* iov, int count) {
+    size_t total = 0;
+    for (int i = 0; i < count; i++) total += iov[i].iov_len;
+    return total;
+}
+
+OVERRIDE(ssize_t, read, (int fd, void* buf, size_t count), (fd, buf, count)) {
+    unsigned long start = monotonic_ns();
+    ssize_t send = OVERHEAD_REAL(real_read(fd, buf, count));
+    record_io(READ, fd, count, send, start, 0);
+    return send;
+}
+
+OVERRIDE(ssize_t, write, (int fd, const void* buf, size_t count), (fd, buf, count)) {
+    unsigned long start = monotonic_ns();
+    ssize_t send = OVERHEAD_REAL(real_write(fd, buf, count));
+    record_io(WRITE, fd, count, send, start, 0);
+    return send;
+}
+
+OVERRIDE(ssize_t, pread, (int fd, void* buf, size_t count, off_t offset), (fd, buf, count, offset)) {
+    unsigned long start = monotonic_ns();
+    ssize_t send = OVERHEAD_REAL(real_pread(fd, buf, count, offset));
+    record_io(PREAD, fd, count, send, start, offset);
+    return send;
+}
+
+OVERRIDE(ssize_t, pwrite, (int fd, const void* buf, size_t count, off_t offset), (fd, buf, count, offset)) {
+    unsigned long start = monotonic_ns();
+    ssize_t send = OVERHEAD_REAL(real_pwrite(fd, buf, count, offset));
+    record_io(PWRITE, fd, count, send, start, offset);
+    return send;
+}
+
+OVERRIDE(ssize_t, readv, (int fd, const struct iovec* iov, int iovcnt), (fd, iov, iovcnt)) {
+    unsigned long start = monotonic_ns();
+    ssize_t send = OVERHEAD_REAL(real_readv(fd, iov, iovcnt));
+    record_io(READV, fd, iovec_bytes(iov, iovcnt), send, start, iovcnt);
+    return send;
+}
+
+OVERRIDE(ssize_t, writev, (int fd, const struct iovec* iov, int iovcnt), (fd, iov, iovcnt)) {
+    unsigned long start = monotonic_ns();
+    ssize_t send = OVERHEAD_REAL(real_writev(fd, iov, iovcnt));
+    record_io(WRITEV, fd, iovec_bytes(iov, iovcnt), send, start, iovcnt);
+    return send;
+}
+
+OVERRIDE(int, fsync, (int fd), (fd)) {
+    unsigned long start = monotonic_ns();
+    int send = OVERHEAD_REAL(real_fsync(fd));
+    record_sync(FSYNC, fd, send, start);
+    return send;
+}
+
+OVERRIDE(int, fdatasync, (int fd), (fd)) {
+    unsigned long start = monotonic_ns();
+    int send = OVERHEAD_REAL(real_fdatasync(fd));
+    record_sync(FDATASYNC, fd, send, start);
+    return send;
+}
+
+//Not timed, it only tells the I/O index that the descriptor's number may now be reused for something else
+OVERRIDE(int, close, (int fd), (fd)) {
+    int send = OVERHEAD_REAL(real_close(fd));
+    COUNT_ONLY(CLOSE, 0, send)
+    int saved_errno = errno;
+
+    void** data = event_data(CLOSE);
+    data[0] = (void*)(long)fd;
+    data[1] = (void*)(long)send;
+    push_event(CLOSE, data, &time_buffer);
+
+    errno = saved_errno;
+    return send;
+}
+
 
 /**
  * When a new thread spawns using pthread_create(), this wrapper function is passed in instead
@@ -146,7 +495,10 @@ static void* thread_wrapper(void* thread_pack) {
 
     void* send = func(arg);
     disable_new_behavior();
+    //Faults since the thread's last allocation still go to its last window
+    if (faults_enabled) faults_sample();
     push_event(THREAD_EXIT, send, &time_buffer);
+    if (alloc_map_inline) alloc_map_clear_thread(gettid());
     return send;
 }
 
@@ -157,7 +509,7 @@ OVERRIDE(int, pthread_create,
     void *__restrict__ __arg),
     (__newthread, __attr, __start_routine, __arg)) {
 
-    void** pack = malloc(4*sizeof(void*));
+    void** pack = event_data(THREAD_CREATE);
     pack[0] = __start_routine;
     pack[1] = __arg;
     pack[2] = (void*)((unsigned long)gettid());
@@ -170,8 +522,9 @@ V_OVERRIDE_NORETURN(pthread_exit, (void* retval), (retval)) {
     //Called if the thread decides to terminate early
     //printf("EXITED WITH: %p\n", retval);
 
+    if (faults_enabled) faults_sample();
     push_event(THREAD_EXIT, retval, &time_buffer);
-    alloc_map_clear_thread(gettid());
+    if (alloc_map_inline) alloc_map_clear_thread(gettid());
     end_loop();
     real_pthread_exit(retval);
     __builtin_unreachable();
@@ -218,7 +571,7 @@ OVERRIDE_MAIN {
         printf("%d: %s\n", i, envp[i]);
     }
 
-    void** dummy_arg = malloc(4*sizeof(void*));
+    void** dummy_arg = event_data(THREAD_CREATE);
     dummy_arg[0] = real_main;
     dummy_arg[1] = argv;
     dummy_arg[2] = 0;
@@ -230,6 +583,7 @@ OVERRIDE_MAIN {
     int ret = real_main(argc, argv, envp);
 
     disable_new_behavior();
+    if (faults_enabled) faults_sample();
 
     unsigned long val = ret;
     push_event(THREAD_EXIT, (void*)val, &time_buffer);
@@ -241,10 +595,11 @@ typedef long (*syscall_fn)(long number, ...);
 typedef long (*syscall_listener)(long number, va_list ap);
 
 static syscall_fn real_syscall = NULL;
+RESOLVE_EAGERLY(syscall)
 static syscall_listener syscall_monitors[470] = {0L};
 
 long syscall(long number, ...) {
-    if (!real_syscall) real_syscall = dlsym(RTLD_NEXT, "syscall");
+    ASSERT_REAL(syscall)
 
     va_list ap;
     va_start(ap, number);
@@ -282,7 +637,7 @@ ON_SYSCALL(435) {
     long ret = real_syscall(435, ap);
 
     if (ret > 0) {
-        unsigned long* send = malloc(sizeof(struct clone_args) + sizeof(size_t) + sizeof(long));
+        unsigned long* send = event_data(CLONE3);
         send[0] = cl_args->flags;
         send[1] = cl_args->pidfd;
         send[2] = cl_args->child_tid;
@@ -1,15 +1,46 @@
 #pragma once
+#include "overhead.h"
 #include <dlfcn.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <stdarg.h>
 
-void enable_new_behavior(void);
+/*
+ * Per-thread hook state, checked on every overridden call, so the accessors below are inline.
+ * The library is always preloaded, which gets it static TLS: initial-exec makes each access a single thread pointer relative load
+ * instead of a __tls_get_addr() call.
+ */
+extern __thread int tracer_new_behavior __attribute__((tls_model("initial-exec")));
+extern __thread void* tracer_call_site __attribute__((tls_model("initial-exec")));
+
+static inline __attribute__((always_inline)) void enable_new_behavior(void) {
+    tracer_new_behavior = 1;
+}
+
+static inline __attribute__((always_inline)) void disable_new_behavior(void) {
+    tracer_new_behavior = 0;
+}
+
+static inline __attribute__((always_inline)) int use_new_behavior(void) {
+    return tracer_new_behavior;
+}
+
+//The return address of the outermost overridden call the current thread is in, i.e. the call site in the target application.
+static inline __attribute__((always_inline)) void set_call_site(void* site) {
+    tracer_call_site = site;
+}
 
-void disable_new_behavior(void);
+static inline __attribute__((always_inline)) void* get_call_site(void) {
+    return tracer_call_site;
+}
 
-int use_new_behavior(void);
+//The untraced mmap/munmap/madvise, for memory the tracer maps for itself (see arena.c)
+void* tracer_mmap(void* addr, size_t len, int prot, int flags, int fd, off_t offset);
+
+int tracer_munmap(void* addr, size_t len);
+
+int tracer_madvise(void* addr, size_t len, int advice);
 
 
 /**
@@ -17,7 +48,7 @@ int use_new_behavior(void);
  * You only need to invoke this if you plan to call the "real" version of an overridden funciton OUTSIDE the replacement function.
  */
 #define ASSERT_REAL(name) \
-    if (!real_##name) {   \
+    if (__builtin_expect(!real_##name, 0)) {   \
         real_##name = dlsym(RTLD_NEXT, #name); \
         if (!real_##name) { \
             fprintf(stderr, "dlsym failed for '%s'\n", #name); \
@@ -25,6 +56,29 @@ int use_new_behavior(void);
         } \
     }                                           
 
+/**
+ * ASSERT_REAL() for symbols glibc exports in several versions, where a plain dlsym() can hand back an old compatibility one.
+ * Falls back to the default version on targets that never had the requested one.
+ */
+#define ASSERT_REAL_VERSION(name, version) \
+    if (__builtin_expect(!real_##name, 0)) {   \
+        real_##name = dlvsym(RTLD_NEXT, #name, version); \
+        if (!real_##name) real_##name = dlsym(RTLD_NEXT, #name); \
+        if (!real_##name) { \
+            fprintf(stderr, "dlsym failed for '%s'\n", #name); \
+            exit(1); \
+        } \
+    }
+
+/**
+ * Looks the real function up in a constructor, so the calls themselves only ever see the branch in ASSERT_REAL() not taken.
+ * Calls that come in before constructors run (the dynamic loader allocating, say) still resolve lazily.
+ */
+#define RESOLVE_EAGERLY(name) \
+    __attribute__((constructor)) static void resolve_##name(void) { \
+        ASSERT_REAL(name) \
+    }
+
 /**
  * Overrides a specific NON-VOID function with new behavior.
  * If new behavior is enabled for a thread, your new user-specified behavior will be called instead of the original behavior.
@@ -36,18 +90,54 @@ int use_new_behavior(void);
  * 
  * During execution of your override function, new behavior is temporarily disabled. 
  * This is to prevent any behavior within the overrides from contaminating the data we're trying to gather on the target application.
+ * The address the function was called from is available through get_call_site().
+ * With LD_PRELOAD_OVERHEAD on, the call is timed (see overhead.h); wrap real calls in OVERHEAD_REAL() to tell them apart.
  */
 #define OVERRIDE(ret, name, args, call_args)                 \
     typedef ret (*name##_t) args;                                   \
     static name##_t real_##name = NULL;                             \
+    RESOLVE_EAGERLY(name)                                           \
                                                                     \
-    ret new_##name args;                                            \
+    static ret new_##name args;                                     \
                                                                     \
     ret name args {                                                 \
         ASSERT_REAL(name)                                           \
         if (use_new_behavior()) {                                   \
             disable_new_behavior();                                 \
+            set_call_site(__builtin_return_address(0));             \
+            unsigned long overhead_start = overhead_hook_begin();   \
+            ret send = new_##name call_args;                        \
+            overhead_hook_end(overhead_start);                      \
+            enable_new_behavior();                                  \
+            return send;                                            \
+        }                                                           \
+        else {                                                      \
+            return real_##name call_args;                           \
+        }                                                           \
+    }                                                               \
+    static ret new_##name args
+
+/**
+ * OVERRIDE for a symbol with several versions, calling through to the given one (see ASSERT_REAL_VERSION).
+ * The override itself is unversioned, so it takes the calls made to any of them.
+ */
+#define OVERRIDE_VERSIONED(ret, name, version, args, call_args)     \
+    typedef ret (*name##_t) args;                                   \
+    static name##_t real_##name = NULL;                             \
+    __attribute__((constructor)) static void resolve_##name(void) { \
+        ASSERT_REAL_VERSION(name, version)                          \
+    }                                                               \
+                                                                    \
+    static ret new_##name args;                                     \
+                                                                    \
+    ret name args {                                                 \
+        ASSERT_REAL_VERSION(name, version)                          \
+        if (use_new_behavior()) {                                   \
+            disable_new_behavior();                                 \
+            set_call_site(__builtin_return_address(0));             \
+            unsigned long overhead_start = overhead_hook_begin();   \
             ret send = new_##name call_args;                        \
+            overhead_hook_end(overhead_start);                      \
             enable_new_behavior();                                  \
             return send;                                            \
         }                                                           \
@@ -55,7 +145,7 @@ int use_new_behavior(void);
             return real_##name call_args;                           \
         }                                                           \
     }                                                               \
-    ret new_##name args
+    static ret new_##name args
 
 
 /**
@@ -73,21 +163,25 @@ int use_new_behavior(void);
 #define V_OVERRIDE(name, args, call_args)                           \
     typedef void (*name##_t) args;                                  \
     static name##_t real_##name = NULL;                             \
+    RESOLVE_EAGERLY(name)                                           \
                                                                     \
-    void new_##name args;                                           \
+    static void new_##name args;                                    \
                                                                     \
     void name args {                                                \
         ASSERT_REAL(name)                                           \
         if (use_new_behavior()) {                                   \
             disable_new_behavior();                                 \
+            set_call_site(__builtin_return_address(0));             \
+            unsigned long overhead_start = overhead_hook_begin();   \
             new_##name call_args;                                   \
+            overhead_hook_end(overhead_start);                      \
             enable_new_behavior();                                  \
         }                                                           \
         else {                                                      \
             real_##name call_args;                                  \
         }                                                           \
     }                                                               \
-    void new_##name args
+    static void new_##name args
 
 /** 
  * A variation of V_OVERRIDE
@@ -96,15 +190,16 @@ int use_new_behavior(void);
 #define V_OVERRIDE_NORETURN(name, args, call_args) \
     typedef void (*name##_t) args;                                  \
     static name##_t real_##name = NULL;                             \
+    RESOLVE_EAGERLY(name)                                           \
                                                                     \
-    __attribute__((noreturn)) void new_##name args;                 \
+    static __attribute__((noreturn)) void new_##name args;          \
                                                                     \
     __attribute__((noreturn)) void name args {                      \
         ASSERT_REAL(name)                                           \
         disable_new_behavior();                                     \
         new_##name call_args;                                       \
     }                                                               \
-    __attribute__((noreturn)) void new_##name args
+    static __attribute__((noreturn)) void new_##name args
 
 /**
  * Overrides a specific NON-VOID function with new behavior.
@@ -115,8 +210,9 @@ int use_new_behavior(void);
 #define OVERRIDE_ALWAYS(ret, name, args, call_args) \
     typedef ret (*name##_t) args;                                   \
     static name##_t real_##name = NULL;                             \
+    RESOLVE_EAGERLY(name)                                           \
                                                                     \
-    ret new_##name args;                                            \
+    static ret new_##name args;                                     \
                                                                     \
     ret name args {                                                 \
         ASSERT_REAL(name)                                           \
@@ -126,7 +222,7 @@ int use_new_behavior(void);
         if (flag) enable_new_behavior();                            \
         return send;                                                \
     }                                                               \
-    ret new_##name args
+    static ret new_##name args
 
 /**
  * Overrides a specific VOID function with new behavior.
@@ -137,8 +233,9 @@ int use_new_behavior(void);
 #define V_OVERRIDE_ALWAYS(name, args, call_args) \
     typedef void (*name##_t) args;                                  \
     static name##_t real_##name = NULL;                             \
+    RESOLVE_EAGERLY(name)                                           \
                                                                     \
-    void new_##name args;                                           \
+    static void new_##name args;                                    \
                                                                     \
     void name args {                                                \
         ASSERT_REAL(name)                                           \
@@ -147,7 +244,7 @@ int use_new_behavior(void);
         new_##name call_args;                                       \
         if (flag) enable_new_behavior();                            \
     }                                                               \
-    void new_##name args
+    static void new_##name args
 
 /**
  * Forks are a special case. Children are expected to execute a separate program, meaning the library setup will start all over again.
@@ -155,7 +252,8 @@ int use_new_behavior(void);
  */
 #define ON_FORK \
     static int (*real_fork)(void); \
-    int new_fork(void);             \
+    RESOLVE_EAGERLY(fork)           \
+    static int new_fork(void);      \
                                     \
     int fork(void) {                \
         ASSERT_REAL(fork)           \
@@ -165,14 +263,15 @@ int use_new_behavior(void);
         return ret;                 \
     }                               \
                                     \
-    int new_fork(void)
+    static int new_fork(void)
 
 /**
  * Special handle for vfork()
  */
 #define ON_VFORK \
     static int (*real_vfork)(void); \
-    int new_vfork(void);            \
+    RESOLVE_EAGERLY(vfork)          \
+    static int new_vfork(void);     \
                                     \
     int vfork(void) {               \
         ASSERT_REAL(vfork)          \
@@ -182,7 +281,7 @@ int use_new_behavior(void);
         return ret;                 \
     }                               \
                                     \
-    int new_vfork(void)
+    static int new_vfork(void)
 
 /**
  * Overrides the int main() function. You have access to its parameters (int argc, char** argv, char** envp)
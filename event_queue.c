@@ -2,11 +2,28 @@
 #define _GNU_SOURCE
 #include "event_queue.h"
 #include "alloc_map.h"
+#include "region_map.h"
+#include "heap_index.h"
+#include "false_sharing.h"
+#include "arena.h"
+#include "log_writer.h"
+#include "event_writer.h"
+#include "segment_log.h"
+#include "counters.h"
+#include "pprof.h"
+#include "lock_index.h"
+#include "io_index.h"
+#include "fault_index.h"
+#include "faults.h"
+#include "overhead.h"
 #include <stdint.h>
 #include <time.h>
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+#include <signal.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/stat.h>
@@ -38,133 +55,102 @@ static int size;
 static pthread_mutex_t lock;
 static pthread_cond_t cond;
 
-static FILE* files[MAX_OVERRIDE_VAL];
+//Producers wait on this once the queue holds LD_PRELOAD_MAX_QUEUE events (default 262144, at most ~150 bytes each, so
+//a writer that falls behind costs the app tens of MB rather than all of its memory). 0 leaves the queue unbounded.
+static pthread_cond_t space;
+static unsigned long max_queue;
 
 static int keep_looping;
 
+//LD_PRELOAD_MODE=segments: hooks append to per-thread segment files themselves, there is no queue or writer thread.
+static int segments;
+
 //Printed timestamps are only relative to the very first event (just before main() starts)
 static unsigned long origin = 0;
 
+//The writer thread wakes up at least this often (in ms) even without events, 0 means only on events.
+static unsigned long tick_ms;
 
-static inline void pp(void* ptr, FILE* f, int newline) {
-    if (ptr == NULL) fprintf(f, "null");
-    else fprintf(f, "\"%p\"", ptr);
-    fprintf(f,newline ? "\n" : ",");
-}
-
-static inline void pb(int bool, FILE* f, int newline) {
-    fprintf(f, bool ? "True":"False");
-    fprintf(f,newline ? "\n" : ",");
-}
-
-static void handle_malloc(void* info, FILE* f) {
-    size_t* data = info;
-    fprintf(f, "%lu,", data[0]);
-    pp((void*)data[1], f, 1);
-}
-
-static void handle_calloc(void* info, FILE* f) {
-    size_t* data = info;
-    size_t total = data[0] * data[1];
-    fprintf(f, "%lu,%lu,%lu,", data[0], data[1], total);
-    pp((void*)data[2], f, 1);
-}
-
-static void handle_free(void* info, FILE* f) {
-    pp(info, f, 1);
-}
-
-static void handle_pthread_create(void* info, FILE* f) {
-    void** data = info;
+//STATM, MAPPED, ALLOC_MAP and TRACER timeline sampling period (LD_PRELOAD_STATM_MS), 0 disables them.
+static unsigned long statm_interval_ms;
+static unsigned long next_statm;
+static int statm_fd = -1;
 
-    pp(data[0], f, 0);
-    pp(data[1], f, 0);
-    fprintf(f, "%lu,", (unsigned long)data[2]);
-    pp(data[3], f, 1);
-}
+//How often the writer thread publishes a fresh alloc_map read snapshot (LD_PRELOAD_SNAPSHOT_MS), 0 disables it.
+static unsigned long snapshot_interval_ms;
+static unsigned long next_snapshot;
 
-static void handle_pthread_exit(void* info, FILE* f) {
-    pp(info, f, 1);
-}
+//MALLINFO sampling period (LD_PRELOAD_MALLINFO_MS), 0 disables it. LD_PRELOAD_MALLOC_INFO=1 adds the malloc_info() figures.
+static unsigned long mallinfo_interval_ms;
+static unsigned long next_mallinfo;
+static int use_malloc_info;
 
-static void handle_exit(void* info, FILE* f) {
-    fprintf(f, "%ld\n", (long)info);
-}
+//How often LD_PRELOAD_MODE=counts writes its counters (LD_PRELOAD_COUNTS_MS), 0 writes them only at exit.
+static unsigned long counts_interval_ms;
+static unsigned long next_counts;
 
-static void handle_fork(void* info, FILE* f) {
-    unsigned long data = (unsigned long) info;
+//Numbered heap_profile_<n>.pb snapshots every LD_PRELOAD_PPROF_MS (0 disables them), and whenever
+//LD_PRELOAD_PPROF_SIGNAL (a signal number, 0 for none) arrives. heap_profile.pb is always written at exit.
+static unsigned long pprof_interval_ms;
+static unsigned long next_pprof;
+static unsigned pprof_snapshots;
+static volatile sig_atomic_t pprof_requested;
+static int pprof_signal;
 
-    int is_virtual = (data & (1L << 32)) != 0L;
+//overhead.csv rewrites every LD_PRELOAD_OVERHEAD_MS (0 for exit only) and on LD_PRELOAD_OVERHEAD_SIGNAL, see overhead.h
+static unsigned long overhead_interval_ms;
+static unsigned long next_overhead;
+static volatile sig_atomic_t overhead_requested;
+static int overhead_signal;
 
-    if (is_virtual) {
-        data = data & ~(1L << 32);
-    }
 
-    pb(is_virtual, f, 0);
-    fprintf(f, "%lu\n", data);
-}
 
-static void handle_realloc(void* info, FILE* f) {
-    void** data = info;
-    pp(data[0], f, 0);
-    fprintf(f, "%lu,", (size_t)data[1]);
-    pp(data[2], f, 1);
+unsigned long env_ulong(const char* name, unsigned long fallback) {
+    char* value = getenv(name);
+    if (value == NULL || value[0] == '\0') return fallback;
+    return strtoul(value, NULL, 10);
 }
 
-
-
-static void handle_mmap(void* info, FILE* f) {
-    mmap_data* data = info;
-
-    pp(data->addr, f, 0);
-    fprintf(f, "%lu,", data->len);
-
-    int anyPerms = 0;
-    int prots[] = {PROT_EXEC, PROT_READ, PROT_WRITE};
-    for (int i = 0; i < 3; i++) {
-        int b = data->prot & prots[i];
-        if (b) anyPerms = 1;
-        pb(b, f, 0);
-    }
-    pb(!anyPerms, f, 0);
-
-
-    int flags[] = {MAP_SHARED, MAP_PRIVATE, MAP_32BIT, MAP_ANON, MAP_FIXED, MAP_FIXED_NOREPLACE, MAP_GROWSDOWN, MAP_HUGETLB,
-                    MAP_LOCKED, MAP_NONBLOCK, MAP_NORESERVE, MAP_POPULATE, MAP_SYNC};
-
-    for (int i = 0; i < 13; i++) {
-        pb(data->flags & flags[i], f, 0);
+void* event_data(int event_type) {
+    void* data = arena_alloc(event_payload_size(event_type));
+    if (data == NULL) {
+        fprintf(stderr, "Unable to allocate event data\n");
+        exit(1);
     }
-
-    fprintf(f, "%d,%ld,", data->fd, data->offset);
-    pp(data->retVal, f, 1);
+    return data;
 }
 
-static void handle_munmap(void* info, FILE* f) {
-    void** data = info;
-
-    pp(data[0], f, 0);
-    fprintf(f, "%lu,", (size_t)data[1]);
-    pb(data[2] == NULL, f, 1);
-}
+//The first event fixes the origin, which children inherit through the environment. Segment mode has no lock to hold here.
+static void set_origin(unsigned long now) {
+    unsigned long unset = 0;
+    if (!__atomic_compare_exchange_n(&origin, &unset, now, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) return;
 
-static void handle_strncpy(void* info, FILE* f) {
-    void** data = info;
-    pp(data[0], f, 0);
-    pp(data[1], f, 0);
-    fprintf(f, "%lu\n", (size_t)data[2]);
-}
-
-static void handle_clone3(void* info, FILE* f) {
-    unsigned long* data = info;
-    for (int i = 0; i < 12; i++) fprintf(f, "%lu,", data[i]);
-    fprintf(f, "%lu\n", data[12]);
+    char print[100];
+    sprintf(print, "%lu", now);
+    setenv("LD_ORIGIN_TIME", print,1);
 }
 
 void push_event(int event_type, void* data, struct timespec* time) {
     timespec_get(time, TIME_UTC);
+    //The hook's own event, not a FAULTS sample it pushes after it
+    if (overhead_event < 0) overhead_note(event_type);
+
+    //The rarer hooks still come through here in counting mode
+    if (counters_enabled) {
+        count_call(event_type, 0);
+        if (event_payload_size(event_type)) arena_free(data);
+        return;
+    }
 
-    event* e = malloc(sizeof(event));
+    if (segments) {
+        unsigned long now = (time->tv_sec * 1000000000UL) + time->tv_nsec;
+        if (origin == 0) set_origin(now);
+        segment_log_append(event_type, now, origin, data);
+        if (event_payload_size(event_type)) arena_free(data);
+        return;
+    }
+
+    event* e = arena_alloc(sizeof(event));
     if (e == NULL) {
         fprintf(stderr, "Unable to allocate event\n");
         exit(1);
@@ -176,14 +162,17 @@ void push_event(int event_type, void* data, struct timespec* time) {
     e->thread_id = gettid();
     e->time = *time;
 
+    unsigned long wait_start = overhead_clock();
     pthread_mutex_lock(&lock);
 
-    if (origin == 0) {
-        origin = (time->tv_sec * 1000000000UL) + time->tv_nsec;
-        char print[100];
-        sprintf(print, "%lu", origin);
-        setenv("LD_ORIGIN_TIME", print,1);
+    //Slowing the app down beats buffering without limit when the writer can't keep up.
+    while (max_queue && (unsigned long)size >= max_queue && keep_looping) {
+        pthread_cond_signal(&cond);
+        pthread_cond_wait(&space, &lock);
     }
+    if (wait_start) overhead_add(event_type, OVERHEAD_LOCK_WAIT_NS, overhead_clock() - wait_start);
+
+    if (origin == 0) set_origin((time->tv_sec * 1000000000UL) + time->tv_nsec);
 
     if (first == NULL) {
         first = e;
@@ -196,189 +185,352 @@ void push_event(int event_type, void* data, struct timespec* time) {
     if (++size >= 20) {
         pthread_cond_signal(&cond);
     }
+    if (wait_start) overhead_add(event_type, OVERHEAD_QUEUE_DEPTH, size);
 
     pthread_mutex_unlock(&lock);
 }
 
 
-int create_file(int event_type, FILE** file) {
-    if (files[event_type] != NULL) {
-        *file = files[event_type];
-        return 0;
-    }
+
+void log_dir(char* path, size_t len) {
     char* log_root = getenv("LD_PRELOAD_LOG");
     if (log_root == NULL || log_root[0] == '\0') log_root = "./logs/";
 
-
-    pid_t pid = getpid();
-    const char* event_names[] = { "malloc", "calloc", "free", "thread_create", "thread_exit", "exit", "fork", "realloc", "mmap", "munmap",
-                                    "strncpy", "memcpy", "clone3" };
-    char path[4096];
-
-    snprintf(path, sizeof(path), "%s/%d/%s.csv", log_root, pid, event_names[event_type]);
+    snprintf(path, len, "%s/%d", log_root, getpid());
     // Create directory if needed
-    char dir_path[4096];
-    snprintf(dir_path, sizeof(dir_path), "%s/%d", log_root, pid);
     mkdir(log_root, 0777);
-    mkdir(dir_path, 0777);
+    mkdir(path, 0777);
+}
 
-    FILE* f = fopen(path, "w");
-    if (f == NULL) {
-        fprintf(stderr, "FAILED TO CREATE LOG FILE: %s\n", path);
-        exit(1);
+void log_path(const char* name, char* path, size_t len) {
+    char dir_path[4096];
+    log_dir(dir_path, sizeof(dir_path));
+    snprintf(path, len, "%s/%s.csv", dir_path, name);
+}
+
+
+#define INDEX_BATCH 256
+
+//LD_PRELOAD_ASYNC_INDEX: the alloc_map change the event's hook would have made itself. Returns 0 if it makes none.
+static int alloc_map_update(const event* e, AllocMapUpdate* u) {
+    void** data = e->data;
+
+    u->kind = ALLOC_MAP_ADD;
+    u->thread_id = e->thread_id;
+    u->event_type = e->event_type;
+    u->timestamp_ns = (e->time.tv_sec * 1000000000UL) + e->time.tv_nsec;
+    u->related_ptr = NULL;
+
+    switch (e->event_type) {
+        case MALLOC:
+            u->ptr = data[1];
+            u->size = (size_t)data[0];
+            return 1;
+        case CALLOC:
+            u->ptr = data[2];
+            u->size = (size_t)data[0] * (size_t)data[1];
+            return 1;
+        case REALLOC:
+            u->ptr = data[2];
+            u->related_ptr = data[0];
+            u->size = (size_t)data[1];
+            return 1;
+        case MMAP: {
+            mmap_data* m = e->data;
+            u->ptr = m->retVal;
+            u->related_ptr = m->addr;
+            u->size = m->len;
+            return 1;
+        }
+        case MUNMAP:
+            u->ptr = data[0];
+            u->size = (size_t)(long)data[2];
+            return 1;
+        case FREE:
+            u->kind = ALLOC_MAP_RELEASE;
+            u->ptr = e->data;
+            return 1;
+        case THREAD_EXIT:
+            //main() returning leaves its entries in place, like it does without the async index
+            if (e->thread_id == getpid()) return 0;
+            u->kind = ALLOC_MAP_CLEAR_THREAD;
+            return 1;
     }
-    int fd = fileno(f);
-    fcntl(fd, F_SETFD, FD_CLOEXEC);
-    files[event_type] = f;
-    *file = f;
-    return 1;
+    return 0;
+}
+
+static void apply_updates(const AllocMapUpdate* updates, int count) {
+    if (count == 0) return;
+
+    unsigned long start = overhead_clock();
+    alloc_map_apply(updates, count);
+    if (start) overhead_writer_add(OVERHEAD_APPLY_NS, overhead_clock() - start);
 }
 
 void flush_events(void) {
     event* e;
+    AllocMapUpdate updates[INDEX_BATCH];
+    int pending = 0;
 
     pthread_mutex_lock(&lock);
 
-    if (keep_looping && first == NULL) pthread_cond_wait(&cond, &lock);
+    if (keep_looping && first == NULL) {
+        if (tick_ms == 0) {
+            pthread_cond_wait(&cond, &lock);
+        }
+        else {
+            //Wake up at least once per tick so the periodic samplers in analytics_loop() still run when the app is idle.
+            struct timespec deadline;
+            timespec_get(&deadline, TIME_UTC);
+            unsigned long ns = deadline.tv_nsec + (tick_ms % 1000) * 1000000UL;
+            deadline.tv_sec += tick_ms / 1000 + ns / 1000000000UL;
+            deadline.tv_nsec = ns % 1000000000UL;
+            pthread_cond_timedwait(&cond, &lock, &deadline);
+        }
+    }
     
     e = first;
     first = NULL;
     last = NULL;
     size = 0;
+    if (max_queue) pthread_cond_broadcast(&space);
 
     pthread_mutex_unlock(&lock);
 
+    unsigned long flush_start = overhead_clock();
+    unsigned long batch = 0;
     while (e != NULL) {
 
-        int type = e->event_type;
-
-        FILE* f;
-        int print_first_line = create_file(type, &f);
-
-        if (print_first_line) {
-            char* line;
-
-            switch(type) {
-                case MALLOC:
-                    line = "size,return_value";
-                    break;
-                case CALLOC:
-                    line = "members,size_per_member,total_size,return_value";
-                    break;
-                case FREE:
-                    line = "address";
-                    break;
-                case THREAD_CREATE:
-                    line = "function,arg,parent_thread,stack_base";
-                    break;
-                case THREAD_EXIT:
-                    line = "return_value";
-                    break;
-                case EXIT:
-                    line = "code";
-                    break;
-                case FORK:
-                    line = "virtual,return_value";
-                    break;
-                case REALLOC:
-                    line = "original_pointer,new_size,return_value";
-                    break;
-                case MMAP:
-                    line = "hint_address,size,executable,readable,writable,inaccessible,shared,copy_on_write,32_bit,anonymous,exact_hint,no_replace,grows_down,huge_page,locked,no_blocking,no_reserve,populate,sync,file_desc,offset,return_value";
-                    break;
-                case MUNMAP:
-                    line = "address,size,success";
-                    break;
-                case STRNCPY:
-                    line = "destination,source,max_length";
-                    break;
-                case MEMCPY:
-                    line = "destination,source,size";
-                    break;
-                case CLONE3:
-                    line = "flags,pidfd,child_tid,parent_tid,exit_signal,stack,stack_size,tls,set_tid,set_tid_size,cgroup";
-                    break;
-                default:
-                    fprintf(stderr, "UNHANDLED EVENT SPOTTED\n");
-                    exit(1);
-            }
-
-            fprintf(f, "thread,time_ns,%s\n", line);
-        }
-
         // Convert to REALTIVE nanoseconds since epoch for reasonable JSON numbers
         unsigned long time_ms = ((e->time.tv_sec * 1000000000UL) + e->time.tv_nsec) - origin;
+        write_event(e->event_type, e->thread_id, time_ms, e->data);
 
-        //All file lines start with a thread id and timestamp
-        fprintf(f, "%d,%ld,", e->thread_id, time_ms);
-
-        int should_free_data = 1;
-        switch(type) {
-            case MALLOC:
-                handle_malloc(e->data, f);
-                break;
-            case CALLOC:
-                handle_calloc(e->data, f);
-                break;
-            case FREE:
-                handle_free(e->data, f);
-                should_free_data = 0; // FREE stores a pointer value, not allocated data
-                break;
-            case THREAD_CREATE:
-                handle_pthread_create(e->data, f);
-                break;
-            case THREAD_EXIT:
-                handle_pthread_exit(e->data, f);
-                should_free_data = 0; // THREAD_EXIT stores a pointer value, not allocated data
-                break;
-            case EXIT:
-                handle_exit(e->data, f);
-                should_free_data = 0; // EXIT stores an integer value, not allocated data
-                break;
-            case FORK:
-                handle_fork(e->data, f); //Fork shows a process id, not allocated data
-                should_free_data = 0;
-                break;
-            case REALLOC:
-                handle_realloc(e->data, f);
-                break;
-            case MMAP:
-                handle_mmap(e->data, f);
-                break;
-            case MUNMAP:
-                handle_munmap(e->data, f);
-                break;
-            case STRNCPY:
-            case MEMCPY:
-                handle_strncpy(e->data, f);
-                break;
-            case CLONE3:
-                handle_clone3(e->data, f);
-                break;
-            default:
-                fprintf(stderr, "UNHANDLED EVENT SPOTTED\n");
-                exit(1);
+        if (alloc_map_async && alloc_map_update(e, &updates[pending]) && ++pending == INDEX_BATCH) {
+            apply_updates(updates, pending);
+            pending = 0;
         }
 
         event* next = e->next;
 
-        if (should_free_data) {
-            free(e->data);
+        //FREE, THREAD_EXIT, EXIT and FORK store a value, not allocated data
+        if (event_payload_size(e->event_type)) {
+            arena_free(e->data);
         }
-        free(e);
+        arena_free(e);
         e = next;
+        batch++;
+    }
+
+    apply_updates(updates, pending);
+
+    if (flush_start && batch) {
+        overhead_writer_add(OVERHEAD_BATCH_EVENTS, batch);
+        overhead_writer_add(OVERHEAD_FLUSH_NS, overhead_clock() - flush_start);
+    }
+}
+
+static unsigned long now_ns(void) {
+    struct timespec t;
+    timespec_get(&t, TIME_UTC);
+    return (t.tv_sec * 1000000000UL) + t.tv_nsec;
+}
+
+/**
+ * Appends one line of /proc/self/statm (converted from pages to bytes) to the STATM timeline.
+ * Rows share the time origin of the event logs, so footprint jumps can be lined up with the calls around them.
+ */
+static void sample_statm(unsigned long now) {
+    if (statm_fd < 0) {
+        statm_fd = open("/proc/self/statm", O_RDONLY | O_CLOEXEC);
+        if (statm_fd < 0) return;
     }
+
+    char buf[256];
+    ssize_t n = pread(statm_fd, buf, sizeof(buf) - 1, 0);
+    if (n <= 0) return;
+    buf[n] = '\0';
+
+    unsigned long size, resident, shared, text, lib, data;
+    if (sscanf(buf, "%lu %lu %lu %lu %lu %lu", &size, &resident, &shared, &text, &lib, &data) != 6) return;
+
+    unsigned long page = sysconf(_SC_PAGESIZE);
+
+    log_file* f;
+    create_file(STATM, &f);
+    log_printf(f, "%d,%ld,%lu,%lu,%lu,%lu,%lu\n", gettid(), now - origin,
+            size * page, resident * page, shared * page, text * page, data * page);
+}
+
+static void sample_mapped(unsigned long now) {
+    MappedTotals t;
+    region_map_totals(&t);
+
+    log_file* f;
+    create_file(MAPPED, &f);
+    log_printf(f, "%d,%ld,%lu,%lu,%lu,%d", gettid(), now - origin, t.total, t.anonymous, t.file_backed, t.regions);
+    for (int i = 0; i < 8; i++) log_printf(f, ",%lu", t.by_prot[i]);
+    log_printf(f, "\n");
+}
+
+static void sample_alloc_map(unsigned long now) {
+    AllocMapStats stats;
+    alloc_map_stats(&stats);
+
+    log_file* f;
+    create_file(ALLOC_MAP, &f);
+    log_printf(f, "%d,%ld,%d,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu\n", gettid(), now - origin, stats.entries, stats.events, stats.bytes,
+            stats.pending_spill_bytes, stats.budget, stats.compacted, stats.evicted, stats.released, stats.spill_dropped);
+}
+
+static void sample_tracer(unsigned long now) {
+    ArenaStats stats;
+    arena_stats(&stats);
+
+    log_file* f;
+    create_file(TRACER, &f);
+    log_printf(f, "%d,%ld,%lu,%lu,%lu,%lu\n", gettid(), now - origin, stats.chunk_bytes, stats.huge_page_bytes,
+            stats.large_bytes, stats.free_bytes);
+}
+
+typedef struct {
+    unsigned long arenas;
+    unsigned long system;
+    unsigned long system_max;
+} malloc_info_totals;
+
+//Pulls the arena count and the process-wide system totals (the ones outside any <heap>) out of malloc_info()'s XML.
+static int read_malloc_info(malloc_info_totals* totals) {
+    char* xml = NULL;
+    size_t len = 0;
+    FILE* f = open_memstream(&xml, &len);
+    if (f == NULL) return 0;
+
+    int ok = malloc_info(0, f) == 0;
+    fclose(f);
+
+    if (ok) {
+        totals->arenas = 0;
+        for (char* c = xml; (c = strstr(c, "<heap nr=")) != NULL; c++) totals->arenas++;
+
+        char* last_heap = strstr(xml, "</heap>");
+        for (char* c = last_heap; c != NULL; c = strstr(c + 1, "</heap>")) last_heap = c;
+        char* tail = last_heap ? last_heap : xml;
+
+        char* current = strstr(tail, "<system type=\"current\"");
+        char* max = strstr(tail, "<system type=\"max\"");
+        ok = current && max && sscanf(current, "<system type=\"current\" size=\"%lu\"", &totals->system) == 1
+                && sscanf(max, "<system type=\"max\" size=\"%lu\"", &totals->system_max) == 1;
+    }
+
+    free(xml);
+    return ok;
+}
+
+/**
+ * What glibc malloc holds next to what the program has asked for and not freed (as of the events processed so far).
+ * Overhead is everything malloc has from the system beyond the requested bytes, fragmentation the share of the heap sitting free.
+ */
+static void sample_mallinfo(unsigned long now) {
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+    struct mallinfo2 mi = mallinfo2();
+#else
+    struct mallinfo mi = mallinfo();
+#endif
+    size_t requested = heap_index_live_bytes();
+    size_t held = (size_t)mi.arena + (size_t)mi.hblkhd;
+
+    log_file* f;
+    create_file(MALLINFO, &f);
+    log_printf(f, "%d,%ld,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%ld,%.4f,", gettid(), now - origin,
+               (unsigned long)mi.arena, (unsigned long)mi.hblkhd, (unsigned long)mi.uordblks, (unsigned long)mi.fordblks,
+               (unsigned long)mi.fsmblks, (unsigned long)mi.ordblks, (unsigned long)mi.keepcost,
+               requested, (long)(held - requested), mi.arena ? (double)mi.fordblks / mi.arena : 0.0);
+
+    malloc_info_totals totals;
+    if (use_malloc_info && read_malloc_info(&totals)) {
+        log_printf(f, "%lu,%lu,%lu\n", totals.arenas, totals.system, totals.system_max);
+    }
+    else {
+        log_printf(f, "null,null,null\n");
+    }
+}
+
+//Only flags the request, the writer thread picks it up on its next wake-up
+static void request_report(int sig) {
+    if (sig == pprof_signal) pprof_requested = 1;
+    if (sig == overhead_signal) overhead_requested = 1;
 }
 
 static void analytics_loop(void) {
+    //Nothing to line the samples up against until the first event sets the origin.
+    if (origin == 0) return;
 
+    unsigned long now = now_ns();
+
+    if (statm_interval_ms && now >= next_statm) {
+        sample_statm(now);
+        //Counting mode feeds neither the region index nor the alloc_map, so these would only log zeros
+        if (!counters_enabled) {
+            sample_mapped(now);
+            sample_alloc_map(now);
+        }
+        sample_tracer(now);
+        next_statm = now + statm_interval_ms * 1000000UL;
+    }
+
+    if (mallinfo_interval_ms && now >= next_mallinfo) {
+        sample_mallinfo(now);
+        next_mallinfo = now + mallinfo_interval_ms * 1000000UL;
+    }
+
+    if (counts_interval_ms && now >= next_counts) {
+        counters_write(now - origin);
+        next_counts = now + counts_interval_ms * 1000000UL;
+    }
+
+    if (pprof_requested || (pprof_interval_ms && now >= next_pprof)) {
+        char name[64];
+        pprof_requested = 0;
+        snprintf(name, sizeof(name), "heap_profile_%u", ++pprof_snapshots);
+        pprof_write(name);
+        next_pprof = now + pprof_interval_ms * 1000000UL;
+    }
+
+    if (overhead_requested || (overhead_interval_ms && now >= next_overhead)) {
+        overhead_requested = 0;
+        overhead_write();
+        next_overhead = now + overhead_interval_ms * 1000000UL;
+    }
+
+    if (counters_enabled) return;
+
+    alloc_map_trim(origin);
+    alloc_map_write_spill(origin);
+
+    if (snapshot_interval_ms && now >= next_snapshot) {
+        alloc_map_publish();
+        next_snapshot = now + snapshot_interval_ms * 1000000UL;
+    }
 } 
 
+//The shorter of two sampling periods, where 0 means that sampler is off.
+static unsigned long shortest_interval(unsigned long a, unsigned long b) {
+    if (a == 0) return b;
+    if (b == 0) return a;
+    return a < b ? a : b;
+}
+
 static void* thread_loop(void* arg) {
     while (keep_looping) {
         flush_events();
         analytics_loop();
     }
+
+    //Whatever was pushed while the last batch was being written is still queued
+    flush_events();
+
+    //Whatever is still buffered goes out before a fork, so the child doesn't inherit (and later write) a copy of it.
+    flush_event_files();
     return NULL;
 }
 
@@ -386,15 +538,22 @@ static void* thread_loop(void* arg) {
 pthread_t thread;
 
 void end_loop(void) {
+    if (segments) return;
+
     pthread_mutex_lock(&lock);
     keep_looping = 0;
     pthread_cond_signal(&cond);
+    pthread_cond_broadcast(&space);
     pthread_mutex_unlock(&lock);
 
     pthread_join(thread, NULL);
+    log_writer_stop();
 }
 
 void restart_loop(void) {
+    if (segments) return;
+
+    log_writer_start();
     keep_looping = 1;
     pthread_create(&thread, NULL, thread_loop, NULL);
 }
@@ -411,13 +570,80 @@ void init(void) {
         origin = strtoul(originStr, NULL, 10);
     }
 
+    statm_interval_ms = env_ulong("LD_PRELOAD_STATM_MS", 100);
+    snapshot_interval_ms = env_ulong("LD_PRELOAD_SNAPSHOT_MS", 1000);
+    mallinfo_interval_ms = env_ulong("LD_PRELOAD_MALLINFO_MS", 1000);
+    use_malloc_info = env_ulong("LD_PRELOAD_MALLOC_INFO", 0) != 0;
+
+    char* mode = getenv("LD_PRELOAD_MODE");
+    segments = mode != NULL && strcmp(mode, "segments") == 0;
+    if (mode != NULL && strcmp(mode, "counts") == 0) {
+        counters_init();
+        counts_interval_ms = env_ulong("LD_PRELOAD_COUNTS_MS", 10000);
+        //No events will come along to set the origin
+        if (origin == 0) set_origin(now_ns());
+    }
+
+    tick_ms = shortest_interval(shortest_interval(statm_interval_ms, snapshot_interval_ms), mallinfo_interval_ms);
+    tick_ms = shortest_interval(tick_ms, counts_interval_ms);
+
+    pprof_interval_ms = env_ulong("LD_PRELOAD_PPROF_MS", 0);
+    next_pprof = now_ns() + pprof_interval_ms * 1000000UL;
+    tick_ms = shortest_interval(tick_ms, pprof_interval_ms);
+    pprof_signal = env_ulong("LD_PRELOAD_PPROF_SIGNAL", 0);
+
+    if (env_ulong("LD_PRELOAD_OVERHEAD", 0)) {
+        overhead_init();
+        overhead_interval_ms = env_ulong("LD_PRELOAD_OVERHEAD_MS", 0);
+        next_overhead = now_ns() + overhead_interval_ms * 1000000UL;
+        tick_ms = shortest_interval(tick_ms, overhead_interval_ms);
+        overhead_signal = env_ulong("LD_PRELOAD_OVERHEAD_SIGNAL", 0);
+    }
+
+    //The writer has to wake up now and then to notice the signals
+    if (pprof_signal || overhead_signal) tick_ms = shortest_interval(tick_ms, 1000);
+    max_queue = env_ulong("LD_PRELOAD_MAX_QUEUE", 1UL << 18);
+
     pthread_mutex_init(&lock, NULL);
     pthread_cond_init(&cond, NULL);
+    pthread_cond_init(&space, NULL);
     first = NULL;
     last = NULL;
 
-    alloc_map_init();
+    //Has to come before the writer thread's fork handlers, see arena_init()
+    arena_init();
+
+    //Segments mode has no writer thread to trim, spill or publish it, and the hooks are better off without its lock
+    if (!counters_enabled && !segments) alloc_map_init();
+    //Needs the writer thread to drain the queue into the map
+    alloc_map_async = !segments && !counters_enabled && env_ulong("LD_PRELOAD_ASYNC_INDEX", 0) != 0;
+    alloc_map_inline = !segments && !counters_enabled && !alloc_map_async;
+    alloc_map_set_budget(env_ulong("LD_PRELOAD_MAP_BUDGET_MB", 64) << 20);
+    region_map_init();
+    heap_index_init();
+    false_sharing_init(env_ulong("LD_PRELOAD_FALSE_SHARING_MAX", 256));
+    lock_index_init();
+    io_index_init();
+    //Allocations only have to be followed while there are samples to hand out
+    if (!counters_enabled) faults_init();
+    if (faults_enabled) fault_index_init();
+    pprof_init(NULL);
+
+    if (segments) {
+        //No writer thread, so nothing has to stop and restart around fork()
+        segment_log_init();
+        //For seg2csv's heap profile even if the process never gets to fini(), which saves them again
+        pprof_save_maps();
+        return;
+    }
     
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = request_report;
+    action.sa_flags = SA_RESTART;
+    if (pprof_signal) sigaction(pprof_signal, &action, NULL);
+    if (overhead_signal) sigaction(overhead_signal, &action, NULL);
+
     restart_loop();
 
     //Children don't copy threads, and are likely to exec() to something else, restarting their own setup anyway.
@@ -428,13 +654,55 @@ void init(void) {
 __attribute__((destructor))
 void fini(void) {
     //Behavior here runs whenn the library unloads, after execution is over.
+    if (segments) {
+        segment_log_close();
+
+        //The event logs and writer-side reports come from seg2csv, only the tracer's own overhead report is written here.
+        //seg2csv also writes the heap profile, from this copy of the mappings (now with anything dlopen()ed since).
+        log_writer_start();
+        overhead_write();
+        log_writer_stop();
+        pprof_save_maps();
+
+        region_map_destroy();
+        heap_index_destroy();
+        false_sharing_destroy();
+        lock_index_destroy();
+        io_index_destroy();
+        fault_index_destroy();
+        pprof_destroy();
+        return;
+    }
+
     end_loop();
 
+    if (counters_enabled) {
+        counters_write(now_ns() - origin);
+        counters_close();
+    }
+
     pthread_mutex_destroy(&lock);
     pthread_cond_destroy(&cond);
-    for (int i = 0; i < MAX_OVERRIDE_VAL; i++) {
-        if (files[i]) fclose(files[i]);
-    }
+    pthread_cond_destroy(&space);
+    close_event_files();
+    if (statm_fd >= 0) close(statm_fd);
+
+    heap_index_report();
+    false_sharing_report();
+    lock_index_report();
+    io_index_report();
+    fault_index_report();
+    pprof_write("heap_profile");
+    alloc_map_write_spill(origin);
+    overhead_write();
+    log_writer_report();
 
     alloc_map_destroy();
+    region_map_destroy();
+    heap_index_destroy();
+    false_sharing_destroy();
+    lock_index_destroy();
+    io_index_destroy();
+    fault_index_destroy();
+    pprof_destroy();
 }
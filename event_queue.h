@@ -3,22 +3,64 @@
 
 #include <unistd.h>
 #include <time.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Every event type, in one place. Adding an override (other than main) means adding a line here, which gives it
+ * its OVERRIDE_ID, its log name, the size of the data its hook hands to push_event() (0 when the data pointer
+ * is the value itself) and the columns that follow thread,time_ns in its log. Then format it in event_writer.c.
+ */
+#define EVENT_LIST(X) \
+    X(MALLOC, "malloc", 3 * sizeof(void*), "size,return_value,call_site") \
+    X(CALLOC, "calloc", 4 * sizeof(void*), "members,size_per_member,total_size,return_value,call_site") \
+    X(FREE, "free", 0, "address") \
+    X(THREAD_CREATE, "thread_create", 4 * sizeof(void*), "function,arg,parent_thread,stack_base") \
+    X(THREAD_EXIT, "thread_exit", 0, "return_value") \
+    X(EXIT, "exit", 0, "code") \
+    X(FORK, "fork", 0, "virtual,return_value") \
+    X(REALLOC, "realloc", 4 * sizeof(void*), "original_pointer,new_size,return_value,call_site") \
+    X(MMAP, "mmap", sizeof(mmap_data), "hint_address,size,executable,readable,writable,inaccessible,shared,copy_on_write," \
+      "32_bit,anonymous,exact_hint,no_replace,grows_down,huge_page,locked,no_blocking,no_reserve,populate,sync,file_desc,offset,return_value") \
+    X(MUNMAP, "munmap", 3 * sizeof(void*), "address,size,success") \
+    X(STRNCPY, "strncpy", 3 * sizeof(void*), "destination,source,max_length,destination_block,destination_offset,source_block,source_offset") \
+    X(MEMCPY, "memcpy", 3 * sizeof(void*), "destination,source,size,destination_block,destination_offset,source_block,source_offset") \
+    X(CLONE3, "clone3", 13 * sizeof(unsigned long), "flags,pidfd,child_tid,parent_tid,exit_signal,stack,stack_size,tls,set_tid,set_tid_size,cgroup") \
+    X(MREMAP, "mremap", 6 * sizeof(void*), "old_address,old_size,new_size,may_move,fixed,dont_unmap,new_address,return_value") \
+    X(MADVISE, "madvise", 4 * sizeof(void*), "address,size,advice,success") \
+    X(MPROTECT, "mprotect", 4 * sizeof(void*), "address,size,executable,readable,writable,inaccessible,success") \
+    X(BRK, "brk", 2 * sizeof(void*), "address,success") \
+    X(SBRK, "sbrk", 2 * sizeof(void*), "increment,return_value") \
+    /* Lock contention, only recorded when the lock wasn't free (see define_override.c) */ \
+    X(MUTEX_WAIT, "mutex_wait", 4 * sizeof(void*), "mutex,wait_ns,return_value,call_site") \
+    X(MUTEX_BUSY, "mutex_busy", 2 * sizeof(void*), "mutex,call_site") \
+    X(COND_WAIT, "cond_wait", 5 * sizeof(void*), "cond,mutex,wait_ns,return_value,call_site") \
+    /* I/O, returned is -1 for a failed call */ \
+    X(READ, "read", 6 * sizeof(void*), "fd,requested,returned,duration_ns,call_site") \
+    X(WRITE, "write", 6 * sizeof(void*), "fd,requested,returned,duration_ns,call_site") \
+    X(PREAD, "pread", 6 * sizeof(void*), "fd,requested,offset,returned,duration_ns,call_site") \
+    X(PWRITE, "pwrite", 6 * sizeof(void*), "fd,requested,offset,returned,duration_ns,call_site") \
+    X(READV, "readv", 6 * sizeof(void*), "fd,requested,buffers,returned,duration_ns,call_site") \
+    X(WRITEV, "writev", 6 * sizeof(void*), "fd,requested,buffers,returned,duration_ns,call_site") \
+    X(FSYNC, "fsync", 4 * sizeof(void*), "fd,return_value,duration_ns,call_site") \
+    X(FDATASYNC, "fdatasync", 4 * sizeof(void*), "fd,return_value,duration_ns,call_site") \
+    X(CLOSE, "close", 2 * sizeof(void*), "fd,return_value") /* Ends the descriptor's generation in io_latency.csv */ \
+    X(FAULTS, "faults", 2 * sizeof(unsigned long), "minor_faults,major_faults") /* The thread's growth since its last sample, see faults.h */ \
+    /* Not overrides, sampled by the writer thread */ \
+    X(STATM, "statm", 0, "size,resident,shared,text,data") /* From /proc/self/statm */ \
+    X(MAPPED, "mapped", 0, "total,anonymous,file_backed,regions,inaccessible,read,write,read_write,exec,read_exec,write_exec,read_write_exec") /* From the region index */ \
+    X(ALLOC_MAP, "alloc_map", 0, "entries,events,bytes,pending_spill_bytes,budget,compacted,evicted,released,spill_dropped") /* The alloc_map's own memory overhead */ \
+    X(TRACER, "tracer", 0, "chunk_bytes,huge_page_bytes,large_bytes,free_bytes") /* The footprint of the tracer's private arena */ \
+    X(MALLINFO, "mallinfo", 0, "heap_bytes,mmapped_bytes,in_use_bytes,free_bytes,fastbin_free_bytes,free_chunks,releasable_bytes," \
+      "requested_bytes,overhead_bytes,fragmentation,arenas,system_bytes,system_max_bytes") /* glibc malloc's own accounting (mallinfo2) */
 
-//Every time you add a new (non-main) override in define_override.c, make an ID for it here
 enum OVERRIDE_ID {
-    MALLOC,
-    CALLOC,
-    FREE,
-    THREAD_CREATE,
-    THREAD_EXIT,
-    EXIT,
-    FORK,
-    REALLOC,
-    MMAP,
-    MUNMAP,
-    STRNCPY,
-    MEMCPY,
-    CLONE3,
+#define EVENT_ID(id, name, payload, header) id,
+    EVENT_LIST(EVENT_ID)
+#undef EVENT_ID
     MAX_OVERRIDE_VAL //Not an actual override, just easy way to get size of enum.
 };
 
@@ -31,13 +73,41 @@ typedef struct mmap_data {
     int fd; 
     long offset;
     void* retVal;
+    void* call_site;  // Not logged, for the fault attribution
 } mmap_data;
 
 void push_event(int event_type, void* data, struct timespec* buffer);
 
+//Allocates the data a hook hands to push_event(), sized for its event type
+void* event_data(int event_type);
+
+//Reads a numeric LD_PRELOAD_* setting, returning fallback when it is unset or empty.
+unsigned long env_ulong(const char* name, unsigned long fallback);
+
+//The tracer's histograms put values in [2^(b-1), 2^b) in bucket b, 0 in bucket 0, and everything past the last bucket in it.
+static inline __attribute__((always_inline)) int log2_bucket(unsigned long value, int buckets) {
+    int bucket = value ? 64 - __builtin_clzl(value) : 0;
+    return bucket < buckets ? bucket : buckets - 1;
+}
+
+//The smallest value that lands in bucket b
+static inline unsigned long log2_bucket_min(int bucket) {
+    return bucket ? 1UL << (bucket - 1) : 0UL;
+}
+
+//Builds the path of <log root>/<pid>, creating the directories as needed.
+void log_dir(char* path, size_t len);
+
+//Builds the path of <log root>/<pid>/<name>.csv, creating the directories as needed.
+void log_path(const char* name, char* path, size_t len);
+
 void end_loop(void);
 void restart_loop(void);
 
+#ifdef __cplusplus
+}
+#endif
+
 #endif /* EVENT_QUEUE_H */
 
 
@@ -0,0 +1,496 @@
+#define _GNU_SOURCE
+#include "event_writer.h"
+#include "region_map.h"
+#include "heap_index.h"
+#include "lock_index.h"
+#include "io_index.h"
+#include "fault_index.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+static log_file* files[MAX_OVERRIDE_VAL];
+
+static const char* event_names[] = {
+#define EVENT_NAME(id, name, payload, header) name,
+    EVENT_LIST(EVENT_NAME)
+#undef EVENT_NAME
+};
+
+static const char* event_headers[] = {
+#define EVENT_HEADER(id, name, payload, header) header,
+    EVENT_LIST(EVENT_HEADER)
+#undef EVENT_HEADER
+};
+
+static const size_t event_payload_sizes[] = {
+#define EVENT_PAYLOAD(id, name, payload, header) payload,
+    EVENT_LIST(EVENT_PAYLOAD)
+#undef EVENT_PAYLOAD
+};
+
+
+static inline void pp(void* ptr, log_file* f, int newline) {
+    if (ptr == NULL) log_printf(f, "null");
+    else log_printf(f, "\"%p\"", ptr);
+    log_printf(f,newline ? "\n" : ",");
+}
+
+static inline void pb(int bool, log_file* f, int newline) {
+    log_printf(f, bool ? "True":"False");
+    log_printf(f,newline ? "\n" : ",");
+}
+
+static void handle_malloc(void* info, log_file* f) {
+    size_t* data = info;
+    log_printf(f, "%lu,", data[0]);
+    pp((void*)data[1], f, 0);
+    pp((void*)data[2], f, 1);
+}
+
+static void handle_calloc(void* info, log_file* f) {
+    size_t* data = info;
+    size_t total = data[0] * data[1];
+    log_printf(f, "%lu,%lu,%lu,", data[0], data[1], total);
+    pp((void*)data[2], f, 0);
+    pp((void*)data[3], f, 1);
+}
+
+static void handle_free(void* info, log_file* f) {
+    pp(info, f, 1);
+}
+
+static void handle_pthread_create(void* info, log_file* f) {
+    void** data = info;
+
+    pp(data[0], f, 0);
+    pp(data[1], f, 0);
+    log_printf(f, "%lu,", (unsigned long)data[2]);
+    pp(data[3], f, 1);
+}
+
+static void handle_pthread_exit(void* info, log_file* f) {
+    pp(info, f, 1);
+}
+
+static void handle_exit(void* info, log_file* f) {
+    log_printf(f, "%ld\n", (long)info);
+}
+
+static void handle_fork(void* info, log_file* f) {
+    unsigned long data = (unsigned long) info;
+
+    int is_virtual = (data & (1L << 32)) != 0L;
+
+    if (is_virtual) {
+        data = data & ~(1L << 32);
+    }
+
+    pb(is_virtual, f, 0);
+    log_printf(f, "%lu\n", data);
+}
+
+static void handle_realloc(void* info, log_file* f) {
+    void** data = info;
+    pp(data[0], f, 0);
+    log_printf(f, "%lu,", (size_t)data[1]);
+    pp(data[2], f, 0);
+    pp(data[3], f, 1);
+}
+
+
+
+static void print_prot(int prot, log_file* f) {
+    int anyPerms = 0;
+    int prots[] = {PROT_EXEC, PROT_READ, PROT_WRITE};
+    for (int i = 0; i < 3; i++) {
+        int b = prot & prots[i];
+        if (b) anyPerms = 1;
+        pb(b, f, 0);
+    }
+    pb(!anyPerms, f, 0);
+}
+
+static void handle_mmap(void* info, log_file* f) {
+    mmap_data* data = info;
+
+    pp(data->addr, f, 0);
+    log_printf(f, "%lu,", data->len);
+
+    print_prot(data->prot, f);
+
+
+    int flags[] = {MAP_SHARED, MAP_PRIVATE, MAP_32BIT, MAP_ANON, MAP_FIXED, MAP_FIXED_NOREPLACE, MAP_GROWSDOWN, MAP_HUGETLB,
+                    MAP_LOCKED, MAP_NONBLOCK, MAP_NORESERVE, MAP_POPULATE, MAP_SYNC};
+
+    for (int i = 0; i < 13; i++) {
+        pb(data->flags & flags[i], f, 0);
+    }
+
+    log_printf(f, "%d,%ld,", data->fd, data->offset);
+    pp(data->retVal, f, 1);
+}
+
+static void handle_munmap(void* info, log_file* f) {
+    void** data = info;
+
+    pp(data[0], f, 0);
+    log_printf(f, "%lu,", (size_t)data[1]);
+    pb(data[2] == NULL, f, 1);
+}
+
+static void handle_strncpy(void* info, log_file* f) {
+    void** data = info;
+    pp(data[0], f, 0);
+    pp(data[1], f, 0);
+    log_printf(f, "%lu,", (size_t)data[2]);
+
+    //Resolve both ends to the heap blocks they land in, as of this point in the event stream.
+    HeapBlock dest, src;
+    heap_index_copy(data[0], data[1], (size_t)data[2], &dest, &src);
+
+    pp(dest.start, f, 0);
+    log_printf(f, "%ld,", dest.start ? (long)((char*)data[0] - (char*)dest.start) : 0L);
+    pp(src.start, f, 0);
+    log_printf(f, "%ld\n", src.start ? (long)((char*)data[1] - (char*)src.start) : 0L);
+}
+
+static void handle_mremap(void* info, log_file* f) {
+    void** data = info;
+    int flags = (int)(long)data[3];
+
+    pp(data[0], f, 0);
+    log_printf(f, "%lu,%lu,", (size_t)data[1], (size_t)data[2]);
+    pb(flags & MREMAP_MAYMOVE, f, 0);
+    pb(flags & MREMAP_FIXED, f, 0);
+#ifdef MREMAP_DONTUNMAP
+    pb(flags & MREMAP_DONTUNMAP, f, 0);
+#else
+    pb(0, f, 0);
+#endif
+    pp(data[4], f, 0);
+    pp(data[5] == MAP_FAILED ? NULL : data[5], f, 1);
+}
+
+static const char* advice_name(int advice) {
+    switch (advice) {
+        case MADV_NORMAL: return "normal";
+        case MADV_RANDOM: return "random";
+        case MADV_SEQUENTIAL: return "sequential";
+        case MADV_WILLNEED: return "will_need";
+        case MADV_DONTNEED: return "dont_need";
+        case MADV_FREE: return "free";
+        case MADV_REMOVE: return "remove";
+        case MADV_DONTFORK: return "dont_fork";
+        case MADV_DOFORK: return "do_fork";
+        case MADV_MERGEABLE: return "mergeable";
+        case MADV_UNMERGEABLE: return "unmergeable";
+        case MADV_HUGEPAGE: return "huge_page";
+        case MADV_NOHUGEPAGE: return "no_huge_page";
+        case MADV_DONTDUMP: return "dont_dump";
+        case MADV_DODUMP: return "do_dump";
+        default: return NULL;
+    }
+}
+
+static void handle_madvise(void* info, log_file* f) {
+    void** data = info;
+    int advice = (int)(long)data[2];
+    const char* name = advice_name(advice);
+
+    pp(data[0], f, 0);
+    log_printf(f, "%lu,", (size_t)data[1]);
+    if (name) log_printf(f, "%s,", name);
+    else log_printf(f, "%d,", advice);
+    pb(data[3] == NULL, f, 1);
+}
+
+static void handle_mprotect(void* info, log_file* f) {
+    void** data = info;
+
+    pp(data[0], f, 0);
+    log_printf(f, "%lu,", (size_t)data[1]);
+    print_prot((int)(long)data[2], f);
+    pb(data[3] == NULL, f, 1);
+}
+
+static void handle_brk(void* info, log_file* f) {
+    void** data = info;
+    pp(data[0], f, 0);
+    pb(data[1] == NULL, f, 1);
+}
+
+static void handle_sbrk(void* info, log_file* f) {
+    void** data = info;
+    log_printf(f, "%ld,", (long)data[0]);
+    pp(data[1] == (void*)-1 ? NULL : data[1], f, 1);
+}
+
+static void handle_mutex_wait(void* info, log_file* f) {
+    void** data = info;
+    pp(data[0], f, 0);
+    log_printf(f, "%lu,%d,", (unsigned long)data[1], (int)(long)data[2]);
+    pp(data[3], f, 1);
+}
+
+static void handle_mutex_busy(void* info, log_file* f) {
+    void** data = info;
+    pp(data[0], f, 0);
+    pp(data[1], f, 1);
+}
+
+static void handle_cond_wait(void* info, log_file* f) {
+    void** data = info;
+    pp(data[0], f, 0);
+    pp(data[1], f, 0);
+    log_printf(f, "%lu,%d,", (unsigned long)data[2], (int)(long)data[3]);
+    pp(data[4], f, 1);
+}
+
+//Slot 5 (the offset, or the iovec count) is only a column for the positioned and vectored calls
+static void handle_io(void* info, log_file* f, int extra) {
+    void** data = info;
+    log_printf(f, "%d,%lu,", (int)(long)data[0], (size_t)data[1]);
+    if (extra) log_printf(f, "%ld,", (long)data[5]);
+    log_printf(f, "%ld,%lu,", (long)data[2], (unsigned long)data[3]);
+    pp(data[4], f, 1);
+}
+
+static void handle_sync(void* info, log_file* f) {
+    void** data = info;
+    log_printf(f, "%d,%d,%lu,", (int)(long)data[0], (int)(long)data[1], (unsigned long)data[2]);
+    pp(data[3], f, 1);
+}
+
+static void handle_close(void* info, log_file* f) {
+    long* data = info;
+    log_printf(f, "%ld,%ld\n", data[0], data[1]);
+}
+
+static void handle_faults(void* info, log_file* f) {
+    unsigned long* data = info;
+    log_printf(f, "%lu,%lu\n", data[0], data[1]);
+}
+
+static void handle_clone3(void* info, log_file* f) {
+    unsigned long* data = info;
+    for (int i = 0; i < 12; i++) log_printf(f, "%lu,", data[i]);
+    log_printf(f, "%lu\n", data[12]);
+}
+
+const char* event_name(int event_type) {
+    if (event_type < 0 || event_type >= MAX_OVERRIDE_VAL) return NULL;
+    return event_names[event_type];
+}
+
+size_t event_payload_size(int event_type) {
+    if (event_type < 0 || event_type >= MAX_OVERRIDE_VAL) return 0;
+    return event_payload_sizes[event_type];
+}
+
+int create_file(int event_type, log_file** file) {
+    if (files[event_type] != NULL) {
+        *file = files[event_type];
+        return 0;
+    }
+
+    //The thread,time_ns prefix is written by write_event() and the samplers
+    char header[1024];
+    snprintf(header, sizeof(header), "thread,time_ns,%s", event_headers[event_type]);
+
+    log_file* f = log_open(event_names[event_type], header);
+    if (f == NULL) exit(1);
+
+    files[event_type] = f;
+    *file = f;
+    return 1;
+}
+
+/**
+ * Keeps the writer-side indexes up to date with an event, before its data gets freed.
+ * This runs on the writer thread (or in seg2csv), so the hooks never pay for it.
+ */
+static void index_event(int event_type, pid_t thread_id, void* info) {
+    void** data = info;
+
+    switch (event_type) {
+        case MALLOC:
+            heap_index_alloc(data[1], (size_t)data[0], data[2], thread_id);
+            fault_index_alloc(thread_id, data[2], FAULT_HEAP, (size_t)data[0]);
+            break;
+        case CALLOC:
+            heap_index_alloc(data[2], (size_t)data[0] * (size_t)data[1], data[3], thread_id);
+            fault_index_alloc(thread_id, data[3], FAULT_HEAP, (size_t)data[0] * (size_t)data[1]);
+            break;
+        case REALLOC:
+            heap_index_realloc(data[0], (size_t)data[1], data[2], data[3], thread_id);
+            fault_index_alloc(thread_id, data[3], FAULT_HEAP, (size_t)data[1]);
+            break;
+        case FREE:
+            heap_index_free(info, thread_id);
+            break;
+        case THREAD_CREATE:
+            //Pushed by the new thread itself, with its creator in slot 2
+            heap_index_thread(thread_id, (pid_t)(long)data[2], data[0]);
+            break;
+        case MMAP: {
+            mmap_data* m = info;
+            region_map_map(m->retVal, m->len, m->prot, m->flags);
+            if (m->retVal != MAP_FAILED) {
+                fault_index_alloc(thread_id, m->call_site, m->flags & MAP_POPULATE ? FAULT_MMAP_POPULATE : FAULT_MMAP, m->len);
+            }
+            break;
+        }
+        case MUNMAP:
+            if (data[2] == NULL) region_map_unmap(data[0], (size_t)data[1]);
+            break;
+        case MPROTECT:
+            if (data[3] == NULL) region_map_protect(data[0], (size_t)data[1], (int)(long)data[2]);
+            break;
+        case MREMAP: {
+            int keep_old = 0;
+#ifdef MREMAP_DONTUNMAP
+            keep_old = ((long)data[3] & MREMAP_DONTUNMAP) != 0;
+#endif
+            region_map_remap(data[0], (size_t)data[1], data[5], (size_t)data[2], keep_old);
+            break;
+        }
+        case MUTEX_WAIT:
+            lock_index_wait(MUTEX_WAIT, data[0], data[3], (unsigned long)data[1]);
+            break;
+        case MUTEX_BUSY:
+            lock_index_wait(MUTEX_BUSY, data[0], data[1], 0);
+            break;
+        case COND_WAIT:
+            lock_index_wait(COND_WAIT, data[0], data[4], (unsigned long)data[2]);
+            break;
+        case READ:
+        case WRITE:
+        case PREAD:
+        case PWRITE:
+        case READV:
+        case WRITEV:
+            io_index_call(event_type, (int)(long)data[0], (unsigned long)data[3], (long)data[2] > 0 ? (size_t)data[2] : 0);
+            break;
+        case FSYNC:
+        case FDATASYNC:
+            io_index_call(event_type, (int)(long)data[0], (unsigned long)data[2], 0);
+            break;
+        case CLOSE:
+            if ((long)data[1] == 0) io_index_close((int)(long)data[0]);
+            break;
+        case FAULTS:
+            fault_index_sample(thread_id, (unsigned long)data[0], (unsigned long)data[1]);
+            break;
+    }
+}
+
+void write_event(int event_type, pid_t thread_id, unsigned long time_ns, void* data) {
+    log_file* f;
+    create_file(event_type, &f);
+
+    //All file lines start with a thread id and timestamp
+    log_printf(f, "%d,%ld,", thread_id, time_ns);
+
+    switch(event_type) {
+        case MALLOC:
+            handle_malloc(data, f);
+            break;
+        case CALLOC:
+            handle_calloc(data, f);
+            break;
+        case FREE:
+            handle_free(data, f);
+            break;
+        case THREAD_CREATE:
+            handle_pthread_create(data, f);
+            break;
+        case THREAD_EXIT:
+            handle_pthread_exit(data, f);
+            break;
+        case EXIT:
+            handle_exit(data, f);
+            break;
+        case FORK:
+            handle_fork(data, f);
+            break;
+        case REALLOC:
+            handle_realloc(data, f);
+            break;
+        case MMAP:
+            handle_mmap(data, f);
+            break;
+        case MUNMAP:
+            handle_munmap(data, f);
+            break;
+        case STRNCPY:
+        case MEMCPY:
+            handle_strncpy(data, f);
+            break;
+        case CLONE3:
+            handle_clone3(data, f);
+            break;
+        case MREMAP:
+            handle_mremap(data, f);
+            break;
+        case MADVISE:
+            handle_madvise(data, f);
+            break;
+        case MPROTECT:
+            handle_mprotect(data, f);
+            break;
+        case BRK:
+            handle_brk(data, f);
+            break;
+        case SBRK:
+            handle_sbrk(data, f);
+            break;
+        case MUTEX_WAIT:
+            handle_mutex_wait(data, f);
+            break;
+        case MUTEX_BUSY:
+            handle_mutex_busy(data, f);
+            break;
+        case COND_WAIT:
+            handle_cond_wait(data, f);
+            break;
+        case READ:
+        case WRITE:
+            handle_io(data, f, 0);
+            break;
+        case PREAD:
+        case PWRITE:
+        case READV:
+        case WRITEV:
+            handle_io(data, f, 1);
+            break;
+        case FSYNC:
+        case FDATASYNC:
+            handle_sync(data, f);
+            break;
+        case CLOSE:
+            handle_close(data, f);
+            break;
+        case FAULTS:
+            handle_faults(data, f);
+            break;
+        default:
+            fprintf(stderr, "UNHANDLED EVENT SPOTTED\n");
+            exit(1);
+    }
+
+    index_event(event_type, thread_id, data);
+}
+
+void flush_event_files(void) {
+    for (int i = 0; i < MAX_OVERRIDE_VAL; i++) {
+        if (files[i]) log_flush(files[i]);
+    }
+}
+
+void close_event_files(void) {
+    for (int i = 0; i < MAX_OVERRIDE_VAL; i++) {
+        if (files[i]) log_close(files[i]);
+        files[i] = NULL;
+    }
+}
@@ -0,0 +1,34 @@
+#pragma once
+#include "event_queue.h"
+#include "log_writer.h"
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Turns events into rows of their <name>.csv logs and keeps the writer-side indexes (heap index, region map, lock, I/O and fault indexes) up to date.
+ * The writer thread feeds it from the event queue, seg2csv from the segment files of LD_PRELOAD_MODE=segments.
+ * Either way one thread does all of it, from the first event to the indexes' reports, so none of those indexes
+ * (heap_index, false_sharing, pprof, lock_index, io_index, fault_index) take locks.
+ */
+
+// The log name of an event type ("malloc", "mmap", ...), NULL when out of range
+const char* event_name(int event_type);
+
+// Bytes of data a hook passes to push_event() for an event type, 0 when the data pointer is the value itself
+size_t event_payload_size(int event_type);
+
+// Opens the log of an event type on first use. Returns 1 when it was just opened, 0 when it already was.
+int create_file(int event_type, log_file** file);
+
+// Write one event as a row of its log (time_ns relative to the origin) and index it
+void write_event(int event_type, pid_t thread_id, unsigned long time_ns, void* data);
+
+void flush_event_files(void);
+void close_event_files(void);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,249 @@
+#include "false_sharing.h"
+#include "arena.h"
+#include "log_writer.h"
+#include <algorithm>
+#include <stdint.h>
+
+#define LINE_SHIFT 6
+#define LINE_OWNERS 4
+#define MIN_LINES 4096
+
+struct Owner {
+    uintptr_t start;
+    void* site;
+    uint32_t size;
+    pid_t thread_id;
+};
+
+// A cache line with live small blocks on it. A zero line number marks an empty table slot.
+struct Line {
+    uintptr_t line;
+    uint32_t count;
+    uint32_t overflow;  // Blocks past LINE_OWNERS, counted but not kept
+    Owner owners[LINE_OWNERS];
+};
+
+// Two allocation sites whose blocks met on a line, ordered so (a, b) and (b, a) are the same pair
+struct SitePair {
+    void* first;
+    void* second;
+
+    bool operator==(const SitePair& other) const {
+        return first == other.first && second == other.second;
+    }
+};
+
+struct SitePairHash {
+    size_t operator()(const SitePair& p) const {
+        return std::hash<void*>()(p.first) * 31 + std::hash<void*>()(p.second);
+    }
+};
+
+struct SharedTotals {
+    unsigned long occurrences;
+    unsigned long first_bytes;
+    unsigned long second_bytes;
+    // One example, for finding it again in the event logs
+    pid_t first_thread;
+    pid_t second_thread;
+    uintptr_t line;
+};
+
+/**
+ * Lines live in one flat open addressing table (linear probing, backward shift deletion) rather than a node
+ * based map, so following full rate malloc traffic costs a multiply and a probe or two per line.
+ */
+struct FalseSharing : ArenaObject {
+    Line* table;
+    size_t mask;
+    size_t used;
+    size_t max_size;
+    ArenaHashMap<SitePair, SharedTotals, SitePairHash> pairs;
+};
+
+// Global instance
+static FalseSharing* g_false_sharing = nullptr;
+
+static inline size_t home(uintptr_t line) {
+    return (line * 0x9e3779b97f4a7c15UL >> 20) & g_false_sharing->mask;
+}
+
+static Line* find(uintptr_t line) {
+    FalseSharing* fs = g_false_sharing;
+    for (size_t i = home(line);; i = (i + 1) & fs->mask) {
+        if (fs->table[i].line == line) return &fs->table[i];
+        if (fs->table[i].line == 0) return nullptr;
+    }
+}
+
+static void place(const Line& entry) {
+    FalseSharing* fs = g_false_sharing;
+    size_t i = home(entry.line);
+    while (fs->table[i].line) i = (i + 1) & fs->mask;
+    fs->table[i] = entry;
+}
+
+static bool grow(void) {
+    FalseSharing* fs = g_false_sharing;
+    size_t old_lines = fs->mask + 1;
+    Line* old = fs->table;
+
+    Line* table = (Line*)arena_calloc(2 * old_lines, sizeof(Line));
+    if (!table) return false;
+
+    fs->table = table;
+    fs->mask = 2 * old_lines - 1;
+    for (size_t i = 0; i < old_lines; i++) {
+        if (old[i].line) place(old[i]);
+    }
+    arena_free(old);
+    return true;
+}
+
+static Line* find_or_add(uintptr_t line) {
+    Line* l = find(line);
+    if (l) return l;
+
+    FalseSharing* fs = g_false_sharing;
+    if (2 * (fs->used + 1) > fs->mask + 1 && !grow()) return nullptr;
+
+    Line entry = Line();
+    entry.line = line;
+    place(entry);
+    fs->used++;
+    return find(line);
+}
+
+static void remove_line(Line* l) {
+    FalseSharing* fs = g_false_sharing;
+    size_t hole = l - fs->table;
+
+    for (size_t j = (hole + 1) & fs->mask; fs->table[j].line; j = (j + 1) & fs->mask) {
+        size_t h = home(fs->table[j].line);
+        if (((j - h) & fs->mask) >= ((j - hole) & fs->mask)) {
+            fs->table[hole] = fs->table[j];
+            hole = j;
+        }
+    }
+    fs->table[hole].line = 0;
+    fs->used--;
+}
+
+static void record(const Owner& a, const Owner& b, uintptr_t line) {
+    bool swap = a.site > b.site;
+    const Owner& first = swap ? b : a;
+    const Owner& second = swap ? a : b;
+
+    SharedTotals& totals = g_false_sharing->pairs[SitePair{first.site, second.site}];
+    if (totals.occurrences++ == 0) {
+        totals.first_thread = first.thread_id;
+        totals.second_thread = second.thread_id;
+        totals.line = line << LINE_SHIFT;
+    }
+    totals.first_bytes += first.size;
+    totals.second_bytes += second.size;
+}
+
+static inline uintptr_t last_line(uintptr_t start, size_t size) {
+    //Zero byte blocks still own their first address
+    return (start + (size ? size : 1) - 1) >> LINE_SHIFT;
+}
+
+static void print_site(log_file* f, void* site) {
+    if (site) log_printf(f, "\"%p\",", site);
+    else log_printf(f, "null,");
+}
+
+extern "C" {
+
+void false_sharing_init(size_t max_size) {
+    if (!g_false_sharing && max_size) {
+        g_false_sharing = new FalseSharing();
+        g_false_sharing->table = (Line*)arena_calloc(MIN_LINES, sizeof(Line));
+        g_false_sharing->mask = MIN_LINES - 1;
+        g_false_sharing->used = 0;
+        g_false_sharing->max_size = max_size;
+        if (!g_false_sharing->table) false_sharing_destroy();
+    }
+}
+
+void false_sharing_destroy(void) {
+    if (g_false_sharing) {
+        arena_free(g_false_sharing->table);
+        delete g_false_sharing;
+        g_false_sharing = nullptr;
+    }
+}
+
+void false_sharing_alloc(void* ptr, size_t size, void* site, pid_t thread_id, int fresh) {
+    if (!g_false_sharing || !ptr || size > g_false_sharing->max_size) return;
+
+    Owner self = { (uintptr_t)ptr, site, (uint32_t)size, thread_id };
+
+    //A block spanning several lines may meet the same neighbour on each, count the pair once
+    uintptr_t seen[LINE_OWNERS * 2];
+    int seen_count = 0;
+
+    uintptr_t first = self.start >> LINE_SHIFT;
+    uintptr_t last = last_line(self.start, size);
+    for (uintptr_t line = first; line <= last; line++) {
+        Line* l = find_or_add(line);
+        if (!l) return;
+
+        for (uint32_t i = 0; fresh && i < l->count; i++) {
+            const Owner& other = l->owners[i];
+            if (other.thread_id == thread_id) continue;
+            if (std::find(seen, seen + seen_count, other.start) != seen + seen_count) continue;
+
+            record(other, self, line);
+            if (seen_count < LINE_OWNERS * 2) seen[seen_count++] = other.start;
+        }
+
+        if (l->count < LINE_OWNERS) l->owners[l->count++] = self;
+        else l->overflow++;
+    }
+}
+
+void false_sharing_free(void* ptr, size_t size) {
+    if (!g_false_sharing || !ptr || size > g_false_sharing->max_size) return;
+
+    uintptr_t start = (uintptr_t)ptr;
+    uintptr_t first = start >> LINE_SHIFT;
+    uintptr_t last = last_line(start, size);
+    for (uintptr_t line = first; line <= last; line++) {
+        Line* l = find(line);
+        if (!l) continue;
+
+        uint32_t i = 0;
+        while (i < l->count && l->owners[i].start != start) i++;
+        if (i < l->count) l->owners[i] = l->owners[--l->count];
+        else if (l->overflow) l->overflow--;
+
+        if (l->count == 0 && l->overflow == 0) remove_line(l);
+    }
+}
+
+void false_sharing_report(void) {
+    if (!g_false_sharing || g_false_sharing->pairs.empty()) return;
+
+    ArenaVector<std::pair<SitePair, SharedTotals>> ranked(g_false_sharing->pairs.begin(), g_false_sharing->pairs.end());
+    std::sort(ranked.begin(), ranked.end(), [](const std::pair<SitePair, SharedTotals>& a, const std::pair<SitePair, SharedTotals>& b) {
+        return a.second.occurrences > b.second.occurrences;
+    });
+
+    log_file* f = log_open("false_sharing", "first_site,second_site,occurrences,first_average_size,second_average_size,"
+                                            "first_thread,second_thread,example_line");
+    if (!f) return;
+
+    for (const auto& entry : ranked) {
+        const SharedTotals& t = entry.second;
+        print_site(f, entry.first.first);
+        print_site(f, entry.first.second);
+        log_printf(f, "%lu,%lu,%lu,%d,%d,\"%p\"\n", t.occurrences,
+                   t.first_bytes / t.occurrences, t.second_bytes / t.occurrences, t.first_thread, t.second_thread,
+                   (void*)t.line);
+    }
+    log_close(f);
+}
+
+} // extern "C"
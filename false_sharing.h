@@ -0,0 +1,30 @@
+#pragma once
+#include <stddef.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Tracks which live small blocks sit on each cache line, and notices when a block lands on a line that already
+ * holds a live block of another thread. The heap index feeds it from the writer thread, so it needs no locking.
+ */
+
+// Track blocks of up to max_size bytes (LD_PRELOAD_FALSE_SHARING_MAX), 0 turns tracking off
+void false_sharing_init(size_t max_size);
+
+void false_sharing_destroy(void);
+
+// A block became live. Only fresh blocks are counted as sharing, a block grown in place just updates its lines.
+void false_sharing_alloc(void* ptr, size_t size, void* site, pid_t thread_id, int fresh);
+
+// A block (with the size it was tracked with) is no longer live
+void false_sharing_free(void* ptr, size_t size);
+
+// Write false_sharing.csv, allocation site pairs ranked by how often their blocks shared a line across threads
+void false_sharing_report(void);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,151 @@
+#include "fault_index.h"
+#include "arena.h"
+#include "log_writer.h"
+#include <algorithm>
+
+#define MAX_WINDOW 64  // Distinct (site, kind) entries kept per window, any more are folded into the last one
+
+struct Attribution {
+    pid_t thread_id;
+    void* site;
+    int kind;
+
+    bool operator==(const Attribution& other) const {
+        return thread_id == other.thread_id && site == other.site && kind == other.kind;
+    }
+};
+
+struct AttributionHash {
+    size_t operator()(const Attribution& a) const {
+        return (std::hash<void*>()(a.site) * 31 + a.thread_id) * 31 + a.kind;
+    }
+};
+
+struct FaultTotals {
+    unsigned long events;
+    unsigned long bytes;
+    double minor;
+    double major;
+};
+
+// Allocations a thread made since its last sample
+struct WindowEntry {
+    void* site;
+    int kind;
+    unsigned long events;
+    unsigned long bytes;
+};
+
+struct FaultIndex : ArenaObject {
+    ArenaHashMap<pid_t, ArenaVector<WindowEntry>> windows;
+    ArenaHashMap<Attribution, FaultTotals, AttributionHash> totals;
+};
+
+static FaultIndex* g_fault_index = nullptr;
+
+static const char* kind_name(int kind) {
+    switch (kind) {
+        case FAULT_HEAP: return "heap";
+        case FAULT_MMAP: return "mmap";
+        case FAULT_MMAP_POPULATE: return "mmap_populate";
+        default: return "none";
+    }
+}
+
+//Hands a window's faults out by bytes (by count if it only holds zero byte allocations), then empties it
+static void close_window(pid_t thread_id, ArenaVector<WindowEntry>& window, unsigned long minor, unsigned long major) {
+    if (window.empty()) {
+        FaultTotals& t = g_fault_index->totals[Attribution{thread_id, nullptr, FAULT_NONE}];
+        t.minor += minor;
+        t.major += major;
+        return;
+    }
+
+    unsigned long bytes = 0;
+    unsigned long events = 0;
+    for (const WindowEntry& e : window) {
+        bytes += e.bytes;
+        events += e.events;
+    }
+
+    for (const WindowEntry& e : window) {
+        double share = bytes ? (double)e.bytes / bytes : (double)e.events / events;
+        FaultTotals& t = g_fault_index->totals[Attribution{thread_id, e.site, e.kind}];
+        t.events += e.events;
+        t.bytes += e.bytes;
+        t.minor += minor * share;
+        t.major += major * share;
+    }
+    window.clear();
+}
+
+extern "C" {
+
+void fault_index_init(void) {
+    if (!g_fault_index) g_fault_index = new FaultIndex();
+}
+
+void fault_index_destroy(void) {
+    if (g_fault_index) {
+        delete g_fault_index;
+        g_fault_index = nullptr;
+    }
+}
+
+void fault_index_alloc(pid_t thread_id, void* site, int kind, size_t bytes) {
+    if (!g_fault_index) return;
+
+    ArenaVector<WindowEntry>& window = g_fault_index->windows[thread_id];
+    for (WindowEntry& e : window) {
+        if (e.site == site && e.kind == kind) {
+            e.events++;
+            e.bytes += bytes;
+            return;
+        }
+    }
+
+    if (window.size() < MAX_WINDOW) {
+        window.push_back(WindowEntry{site, kind, 1, bytes});
+    }
+    else {
+        window.back().events++;
+        window.back().bytes += bytes;
+    }
+}
+
+void fault_index_sample(pid_t thread_id, unsigned long minor, unsigned long major) {
+    if (!g_fault_index) return;
+    close_window(thread_id, g_fault_index->windows[thread_id], minor, major);
+}
+
+void fault_index_report(void) {
+    if (!g_fault_index) return;
+
+    //Allocations after each thread's last sample still count, just without faults
+    for (auto& entry : g_fault_index->windows) {
+        if (!entry.second.empty()) close_window(entry.first, entry.second, 0, 0);
+    }
+
+    bool sampled = false;
+    for (const auto& entry : g_fault_index->totals) sampled = sampled || entry.second.minor > 0 || entry.second.major > 0;
+    if (!sampled) return;
+
+    ArenaVector<std::pair<Attribution, FaultTotals>> ranked(g_fault_index->totals.begin(), g_fault_index->totals.end());
+    std::sort(ranked.begin(), ranked.end(), [](const std::pair<Attribution, FaultTotals>& a, const std::pair<Attribution, FaultTotals>& b) {
+        return a.second.minor > b.second.minor;
+    });
+
+    log_file* f = log_open("fault_attribution", "thread,call_site,kind,events,bytes,minor_faults,major_faults");
+    if (!f) return;
+
+    for (const auto& entry : ranked) {
+        const FaultTotals& t = entry.second;
+        log_printf(f, "%d,", entry.first.thread_id);
+        if (entry.first.site) log_printf(f, "\"%p\",", entry.first.site);
+        else log_printf(f, "null,");
+        log_printf(f, "%s,%lu,%lu,%.1f,%.1f\n", kind_name(entry.first.kind), t.events, t.bytes, t.minor, t.major);
+    }
+    log_close(f);
+}
+
+} // extern "C"
@@ -0,0 +1,37 @@
+#pragma once
+#include <stddef.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Attributes each thread's FAULTS samples to the allocations it made since its previous sample, split by bytes.
+ * Faults in a window without allocations are kept as unattributed (null site, "none").
+ */
+
+// How an allocation gets its pages. MAP_POPULATE mappings are faulted in by the mmap call itself, the rest on first touch.
+enum {
+    FAULT_HEAP,
+    FAULT_MMAP,
+    FAULT_MMAP_POPULATE,
+    FAULT_NONE,
+};
+
+void fault_index_init(void);
+
+void fault_index_destroy(void);
+
+// An allocation of bytes from site by thread_id, kind being one of the above
+void fault_index_alloc(pid_t thread_id, void* site, int kind, size_t bytes);
+
+// A FAULTS sample: thread_id's fault counters grew by minor and major since its last one
+void fault_index_sample(pid_t thread_id, unsigned long minor, unsigned long major);
+
+// Write fault_attribution.csv, per thread, site and kind, most minor faults first
+void fault_index_report(void);
+
+#ifdef __cplusplus
+}
+#endif
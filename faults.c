@@ -0,0 +1,64 @@
+#define _GNU_SOURCE
+#include "faults.h"
+#include "event_queue.h"
+#include <sys/resource.h>
+
+int faults_enabled;
+static unsigned long sample_every;
+static unsigned long sample_interval_ns;
+
+typedef struct {
+    int started;
+    unsigned long allocations;  // Since the last sample
+    unsigned long last_ns;
+    unsigned long minor;
+    unsigned long major;
+    struct timespec time;
+} fault_state;
+
+static __thread fault_state mine;
+
+
+void faults_init(void) {
+    sample_every = env_ulong("LD_PRELOAD_FAULTS_EVERY", 0);
+    sample_interval_ns = env_ulong("LD_PRELOAD_FAULTS_MS", 0) * 1000000UL;
+    faults_enabled = sample_every || sample_interval_ns;
+}
+
+void faults_sample(void) {
+    struct rusage usage;
+    if (getrusage(RUSAGE_THREAD, &usage) != 0) return;
+
+    unsigned long minor = usage.ru_minflt;
+    unsigned long major = usage.ru_majflt;
+
+    //The first sample is only a baseline. Quiet stretches push nothing.
+    if (mine.started && (minor != mine.minor || major != mine.major)) {
+        unsigned long* data = event_data(FAULTS);
+        data[0] = minor - mine.minor;
+        data[1] = major - mine.major;
+        push_event(FAULTS, data, &mine.time);
+    }
+
+    mine.started = 1;
+    mine.minor = minor;
+    mine.major = major;
+}
+
+void faults_tick(void) {
+    unsigned long ns = 0;
+    if (sample_interval_ns) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        ns = (now.tv_sec * 1000000000UL) + now.tv_nsec;
+    }
+    mine.allocations++;
+
+    if (!mine.started
+            || (sample_every && mine.allocations >= sample_every)
+            || (sample_interval_ns && ns - mine.last_ns >= sample_interval_ns)) {
+        mine.allocations = 0;
+        mine.last_ns = ns;
+        faults_sample();
+    }
+}
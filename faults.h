@@ -0,0 +1,28 @@
+#pragma once
+#include <time.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Per-thread page fault sampling. A thread reads its own minor and major fault counters (getrusage(RUSAGE_THREAD))
+ * every LD_PRELOAD_FAULTS_EVERY allocation events, or once LD_PRELOAD_FAULTS_MS has passed since its last sample,
+ * and pushes the growth since then as a FAULTS event. Both default to 0, which leaves sampling off.
+ * A MAP_POPULATE mmap is sampled right before and after, so the faults of populating it come out on their own.
+ */
+
+extern int faults_enabled;
+
+void faults_init(void);
+
+// Before each allocation event (MALLOC, CALLOC, REALLOC, MMAP) of the calling thread is pushed, so a sample's faults
+// go to the allocations before it and never to the one about to be returned, which nothing has touched yet
+void faults_tick(void);
+
+// Sample the calling thread now
+void faults_sample(void);
+
+#ifdef __cplusplus
+}
+#endif
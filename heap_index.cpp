@@ -0,0 +1,486 @@
+#include "heap_index.h"
+#include "event_queue.h"
+#include "arena.h"
+#include "log_writer.h"
+#include "false_sharing.h"
+#include "pprof.h"
+#include <map>
+#include <unordered_map>
+#include <vector>
+#include <algorithm>
+#include <stdint.h>
+
+// Successive reallocs of one logical buffer, followed through every move
+struct Chain : ArenaObject {
+    void* alloc_site;  // Where the buffer was first allocated
+    void* site;  // The realloc call that started the chain
+    pid_t thread_id;
+    size_t first_size;
+    size_t last_size;
+    unsigned long steps;
+    unsigned long moved;
+    unsigned long bytes_copied;  // Estimated as the smaller of the old and new size on every move
+};
+
+struct BlockInfo {
+    size_t size;
+    void* site;
+    pid_t thread_id;
+    Chain* chain;  // Only once the block has been realloc'd
+};
+
+struct SitePair {
+    void* source;
+    void* destination;
+
+    bool operator==(const SitePair& other) const {
+        return source == other.source && destination == other.destination;
+    }
+};
+
+struct SitePairHash {
+    size_t operator()(const SitePair& p) const {
+        return std::hash<void*>()(p.source) * 31 + std::hash<void*>()(p.destination);
+    }
+};
+
+struct CopyTotals {
+    unsigned long copies;
+    unsigned long bytes;
+};
+
+struct FreeTotals {
+    unsigned long frees;
+    unsigned long bytes;
+};
+
+// A remote free hotspot: blocks from one site, allocated on one thread and freed on another
+struct RemoteSite {
+    void* site;
+    pid_t alloc_thread;
+    pid_t free_thread;
+
+    bool operator==(const RemoteSite& other) const {
+        return site == other.site && alloc_thread == other.alloc_thread && free_thread == other.free_thread;
+    }
+};
+
+struct RemoteSiteHash {
+    size_t operator()(const RemoteSite& r) const {
+        return std::hash<void*>()(r.site) * 31 + ((size_t)r.alloc_thread << 32 | (uint32_t)r.free_thread);
+    }
+};
+
+struct ThreadInfo {
+    pid_t parent;
+    void* function;
+};
+
+// Finished chains, summed per (allocation site, realloc site)
+struct ChainTotals {
+    unsigned long chains;
+    unsigned long steps;
+    unsigned long moved;
+    unsigned long bytes_copied;
+    unsigned long max_steps;
+    double growth;  // Sum over chains, for the average
+    double max_growth;
+};
+
+// A chain that made it into realloc_chain_top.csv
+struct ChainRecord {
+    Chain chain;
+    bool ended;  // False if the buffer was still live at exit
+};
+
+// Keeps only this many rows of realloc_chain_top.csv
+#define CHAIN_ROWS 100
+
+// Keeps only this many rows of remote_free_sites.csv
+#define REMOTE_SITE_ROWS 100
+
+// Sorted by start address, so the owner of any address is one upper_bound() away
+using BlockTree = ArenaMap<uintptr_t, BlockInfo>;
+
+struct HeapIndex : ArenaObject {
+    BlockTree blocks;
+    size_t live_bytes;
+
+    // Copies tend to hit the same few blocks back to back, so remember the last hit
+    uintptr_t cached_start;
+    BlockInfo cached;
+
+    ArenaHashMap<SitePair, CopyTotals, SitePairHash> copies;
+
+    // Keyed by allocating thread << 32 | freeing thread
+    ArenaHashMap<uint64_t, FreeTotals> frees;
+    ArenaHashMap<RemoteSite, FreeTotals, RemoteSiteHash> remote_sites;
+    ArenaHashMap<pid_t, ThreadInfo> threads;
+
+    ArenaHashMap<SitePair, ChainTotals, SitePairHash> chain_sites;
+    // Min-heap on bytes_copied, so the cheapest of the kept chains is the one to replace
+    ArenaVector<ChainRecord> top_chains;
+};
+
+// Global instance
+static HeapIndex* g_heap_index = nullptr;
+
+static void forget_cached(uintptr_t start) {
+    if (g_heap_index->cached_start == start) g_heap_index->cached_start = 0;
+}
+
+static void fill(HeapBlock* block, uintptr_t start, const BlockInfo& info) {
+    block->start = (void*)start;
+    block->size = info.size;
+    block->site = info.site;
+    block->thread_id = info.thread_id;
+}
+
+static bool lookup(uintptr_t addr, HeapBlock* block) {
+    HeapIndex* index = g_heap_index;
+
+    if (index->cached_start && addr >= index->cached_start && addr < index->cached_start + index->cached.size) {
+        fill(block, index->cached_start, index->cached);
+        return true;
+    }
+
+    auto it = index->blocks.upper_bound(addr);
+    if (it != index->blocks.begin()) {
+        --it;
+        //Zero byte blocks still own their first address
+        size_t extent = it->second.size ? it->second.size : 1;
+        if (addr < it->first + extent) {
+            index->cached_start = it->first;
+            index->cached = it->second;
+            fill(block, it->first, it->second);
+            return true;
+        }
+    }
+
+    block->start = nullptr;
+    block->size = 0;
+    block->site = nullptr;
+    block->thread_id = 0;
+    return false;
+}
+
+static double growth(const Chain& c) {
+    return c.first_size ? (double)c.last_size / c.first_size : 0.0;
+}
+
+static bool cheaper(const ChainRecord& a, const ChainRecord& b) {
+    return a.chain.bytes_copied > b.chain.bytes_copied;
+}
+
+//Folds a chain into its site totals and the top list, then frees it
+static void finish_chain(Chain* c, bool ended) {
+    ChainTotals& totals = g_heap_index->chain_sites[SitePair{c->alloc_site, c->site}];
+    double g = growth(*c);
+    totals.chains++;
+    totals.steps += c->steps;
+    totals.moved += c->moved;
+    totals.bytes_copied += c->bytes_copied;
+    totals.growth += g;
+    if (c->steps > totals.max_steps) totals.max_steps = c->steps;
+    if (g > totals.max_growth) totals.max_growth = g;
+
+    ArenaVector<ChainRecord>& top = g_heap_index->top_chains;
+    if (top.size() < CHAIN_ROWS) {
+        top.push_back(ChainRecord{*c, ended});
+        std::push_heap(top.begin(), top.end(), cheaper);
+    }
+    else if (c->bytes_copied > top.front().chain.bytes_copied) {
+        std::pop_heap(top.begin(), top.end(), cheaper);
+        top.back() = ChainRecord{*c, ended};
+        std::push_heap(top.begin(), top.end(), cheaper);
+    }
+
+    delete c;
+}
+
+//Drops a block from the index. A block freed (rather than reallocated in place) goes into the free matrix.
+static void release(void* ptr, pid_t thread_id, bool freed) {
+    auto it = g_heap_index->blocks.find((uintptr_t)ptr);
+    if (it == g_heap_index->blocks.end()) return;
+
+    const BlockInfo& info = it->second;
+    if (freed) {
+        FreeTotals& pair = g_heap_index->frees[(uint64_t)(uint32_t)info.thread_id << 32 | (uint32_t)thread_id];
+        pair.frees++;
+        pair.bytes += info.size;
+
+        if (info.thread_id != thread_id) {
+            FreeTotals& site = g_heap_index->remote_sites[RemoteSite{info.site, info.thread_id, thread_id}];
+            site.frees++;
+            site.bytes += info.size;
+        }
+    }
+
+    //A realloc carries the chain over to the new block itself
+    if (freed && info.chain) finish_chain(info.chain, true);
+    false_sharing_free(ptr, info.size);
+    pprof_free(info.site, info.size);
+
+    g_heap_index->live_bytes -= info.size;
+    forget_cached(it->first);
+    g_heap_index->blocks.erase(it);
+}
+
+//fresh is false for a block realloc grew or shrank in place
+static void insert(void* ptr, size_t size, void* site, pid_t thread_id, bool fresh) {
+    uintptr_t start = (uintptr_t)ptr;
+    auto result = g_heap_index->blocks.emplace(start, BlockInfo());
+    BlockInfo& info = result.first->second;
+
+    //A free we never saw (e.g. one made while tracing was off) leaves a stale entry behind, replace it.
+    if (!result.second) {
+        if (info.chain) finish_chain(info.chain, false);
+        false_sharing_free(ptr, info.size);
+        pprof_free(info.site, info.size);
+        g_heap_index->live_bytes -= info.size;
+    }
+
+    g_heap_index->live_bytes += size;
+    info.size = size;
+    info.site = site;
+    info.thread_id = thread_id;
+    info.chain = nullptr;
+    forget_cached(start);
+
+    false_sharing_alloc(ptr, size, site, thread_id, fresh);
+    pprof_alloc(site, size);
+}
+
+static void print_site(log_file* f, void* site) {
+    if (site) log_printf(f, "\"%p\",", site);
+    else log_printf(f, "null,");
+}
+
+extern "C" {
+
+void heap_index_init(void) {
+    if (!g_heap_index) {
+        g_heap_index = new HeapIndex();
+        g_heap_index->live_bytes = 0;
+        g_heap_index->cached_start = 0;
+    }
+}
+
+void heap_index_destroy(void) {
+    if (g_heap_index) {
+        for (auto& entry : g_heap_index->blocks) delete entry.second.chain;
+        delete g_heap_index;
+        g_heap_index = nullptr;
+    }
+}
+
+void heap_index_alloc(void* ptr, size_t size, void* site, pid_t thread_id) {
+    if (!g_heap_index || !ptr) return;
+    insert(ptr, size, site, thread_id, true);
+}
+
+void heap_index_free(void* ptr, pid_t thread_id) {
+    if (!g_heap_index || !ptr) return;
+    release(ptr, thread_id, true);
+}
+
+void heap_index_realloc(void* old_ptr, size_t size, void* new_ptr, void* site, pid_t thread_id) {
+    if (!g_heap_index) return;
+
+    if (!new_ptr) {
+        //realloc(ptr, 0) frees, any other NULL return is a failure that leaves the block alone.
+        if (size == 0) heap_index_free(old_ptr, thread_id);
+        return;
+    }
+
+    Chain* chain = nullptr;
+    auto it = old_ptr ? g_heap_index->blocks.find((uintptr_t)old_ptr) : g_heap_index->blocks.end();
+    if (it != g_heap_index->blocks.end()) {
+        BlockInfo& old = it->second;
+        chain = old.chain;
+        if (!chain) {
+            chain = new Chain();
+            chain->alloc_site = old.site;
+            chain->site = site;
+            chain->thread_id = thread_id;
+            chain->first_size = old.size;
+        }
+        //Chains that start from an empty block measure growth from the first real size
+        if (chain->first_size == 0) chain->first_size = size;
+
+        chain->steps++;
+        if (old_ptr != new_ptr) {
+            chain->moved++;
+            chain->bytes_copied += std::min(old.size, size);
+        }
+        chain->last_size = size;
+        old.chain = nullptr;
+
+        release(old_ptr, thread_id, old_ptr != new_ptr);
+    }
+
+    insert(new_ptr, size, site, thread_id, old_ptr != new_ptr);
+    if (chain) g_heap_index->blocks[(uintptr_t)new_ptr].chain = chain;
+}
+
+void heap_index_thread(pid_t thread_id, pid_t parent, void* function) {
+    if (!g_heap_index) return;
+    g_heap_index->threads[thread_id] = ThreadInfo{parent, function};
+}
+
+int heap_index_find(const void* addr, HeapBlock* block) {
+    if (!g_heap_index) return 0;
+    return lookup((uintptr_t)addr, block);
+}
+
+void heap_index_copy(const void* dest, const void* src, size_t n, HeapBlock* dest_block, HeapBlock* src_block) {
+    if (!g_heap_index) {
+        *dest_block = HeapBlock();
+        *src_block = HeapBlock();
+        return;
+    }
+
+    bool dest_found = lookup((uintptr_t)dest, dest_block);
+    bool src_found = lookup((uintptr_t)src, src_block);
+
+    //Stack and static to stack and static copies say nothing about the heap.
+    if (!dest_found && !src_found) return;
+
+    CopyTotals& totals = g_heap_index->copies[SitePair{src_block->site, dest_block->site}];
+    totals.copies++;
+    totals.bytes += n;
+}
+
+size_t heap_index_live_bytes(void) {
+    if (!g_heap_index) return 0;
+    return g_heap_index->live_bytes;
+}
+
+static void report_copies(void) {
+    if (g_heap_index->copies.empty()) return;
+
+    //A null site means that end of the copy wasn't in a live heap block (stack, globals, mmap).
+    log_file* f = log_open("copy_pairs", "source_site,destination_site,copies,bytes");
+    if (!f) return;
+
+    ArenaVector<std::pair<SitePair, CopyTotals>> ranked(g_heap_index->copies.begin(), g_heap_index->copies.end());
+    std::sort(ranked.begin(), ranked.end(), [](const std::pair<SitePair, CopyTotals>& a, const std::pair<SitePair, CopyTotals>& b) {
+        return a.second.bytes > b.second.bytes;
+    });
+
+    for (const auto& entry : ranked) {
+        print_site(f, entry.first.source);
+        print_site(f, entry.first.destination);
+        log_printf(f, "%lu,%lu\n", entry.second.copies, entry.second.bytes);
+    }
+
+    log_close(f);
+}
+
+//thread id, the thread that created it and the function it started in (0 and null when its THREAD_CREATE wasn't seen)
+static void print_thread(log_file* f, pid_t thread_id) {
+    auto it = g_heap_index->threads.find(thread_id);
+    if (it == g_heap_index->threads.end()) {
+        log_printf(f, "%d,0,null,", thread_id);
+        return;
+    }
+    log_printf(f, "%d,%d,", thread_id, it->second.parent);
+    print_site(f, it->second.function);
+}
+
+static void report_frees(void) {
+    if (g_heap_index->frees.empty()) return;
+
+    //Cross-thread pairs first, then by bytes. Same-thread rows stay in for scale.
+    ArenaVector<std::pair<uint64_t, FreeTotals>> ranked(g_heap_index->frees.begin(), g_heap_index->frees.end());
+    std::sort(ranked.begin(), ranked.end(), [](const std::pair<uint64_t, FreeTotals>& a, const std::pair<uint64_t, FreeTotals>& b) {
+        bool a_cross = (a.first >> 32) != (a.first & 0xffffffff);
+        bool b_cross = (b.first >> 32) != (b.first & 0xffffffff);
+        if (a_cross != b_cross) return a_cross;
+        return a.second.bytes > b.second.bytes;
+    });
+
+    log_file* f = log_open("cross_thread_free", "alloc_thread,alloc_parent,alloc_function,free_thread,free_parent,free_function,"
+                                                "frees,bytes,cross_thread");
+    if (f) {
+        for (const auto& entry : ranked) {
+            pid_t alloc_thread = (pid_t)(entry.first >> 32);
+            pid_t free_thread = (pid_t)(entry.first & 0xffffffff);
+            print_thread(f, alloc_thread);
+            print_thread(f, free_thread);
+            log_printf(f, "%lu,%lu,%s\n", entry.second.frees, entry.second.bytes, alloc_thread != free_thread ? "True" : "False");
+        }
+        log_close(f);
+    }
+
+    if (g_heap_index->remote_sites.empty()) return;
+
+    ArenaVector<std::pair<RemoteSite, FreeTotals>> sites(g_heap_index->remote_sites.begin(), g_heap_index->remote_sites.end());
+    size_t rows = std::min(sites.size(), (size_t)REMOTE_SITE_ROWS);
+    std::partial_sort(sites.begin(), sites.begin() + rows, sites.end(),
+                      [](const std::pair<RemoteSite, FreeTotals>& a, const std::pair<RemoteSite, FreeTotals>& b) {
+        return a.second.bytes > b.second.bytes;
+    });
+
+    f = log_open("remote_free_sites", "alloc_site,alloc_thread,free_thread,frees,bytes");
+    if (!f) return;
+    for (size_t i = 0; i < rows; i++) {
+        print_site(f, sites[i].first.site);
+        log_printf(f, "%d,%d,%lu,%lu\n", sites[i].first.alloc_thread, sites[i].first.free_thread,
+                   sites[i].second.frees, sites[i].second.bytes);
+    }
+    log_close(f);
+}
+
+static void report_chains(void) {
+    //Buffers still live at exit end their chains here
+    for (auto& entry : g_heap_index->blocks) {
+        if (entry.second.chain) finish_chain(entry.second.chain, false);
+        entry.second.chain = nullptr;
+    }
+    if (g_heap_index->chain_sites.empty()) return;
+
+    ArenaVector<std::pair<SitePair, ChainTotals>> ranked(g_heap_index->chain_sites.begin(), g_heap_index->chain_sites.end());
+    std::sort(ranked.begin(), ranked.end(), [](const std::pair<SitePair, ChainTotals>& a, const std::pair<SitePair, ChainTotals>& b) {
+        return a.second.bytes_copied > b.second.bytes_copied;
+    });
+
+    log_file* f = log_open("realloc_chains", "alloc_site,realloc_site,chains,steps,moved,in_place,bytes_copied,"
+                                             "average_growth,max_growth,max_steps");
+    if (f) {
+        for (const auto& entry : ranked) {
+            const ChainTotals& t = entry.second;
+            print_site(f, entry.first.source);
+            print_site(f, entry.first.destination);
+            log_printf(f, "%lu,%lu,%lu,%lu,%lu,%.2f,%.2f,%lu\n", t.chains, t.steps, t.moved, t.steps - t.moved,
+                       t.bytes_copied, t.growth / t.chains, t.max_growth, t.max_steps);
+        }
+        log_close(f);
+    }
+
+    ArenaVector<ChainRecord>& top = g_heap_index->top_chains;
+    std::sort_heap(top.begin(), top.end(), cheaper);
+
+    f = log_open("realloc_chain_top", "thread,alloc_site,realloc_site,first_size,final_size,growth,steps,moved,in_place,"
+                                      "bytes_copied,ended");
+    if (!f) return;
+    for (const ChainRecord& r : top) {
+        const Chain& c = r.chain;
+        log_printf(f, "%d,", c.thread_id);
+        print_site(f, c.alloc_site);
+        print_site(f, c.site);
+        log_printf(f, "%lu,%lu,%.2f,%lu,%lu,%lu,%lu,%s\n", c.first_size, c.last_size, growth(c), c.steps, c.moved,
+                   c.steps - c.moved, c.bytes_copied, r.ended ? "True" : "False");
+    }
+    log_close(f);
+}
+
+void heap_index_report(void) {
+    if (!g_heap_index) return;
+
+    report_copies();
+    report_frees();
+    report_chains();
+}
+
+} // extern "C"
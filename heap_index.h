@@ -0,0 +1,54 @@
+#pragma once
+#include <stddef.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// A live heap block, as seen by the writer thread
+typedef struct {
+    void* start;
+    size_t size;
+    void* site;         // Return address of the malloc/calloc/realloc call that produced it
+    pid_t thread_id;    // Thread that allocated it
+} HeapBlock;
+
+// Initialize the global heap index
+void heap_index_init(void);
+
+// Clean up the global heap index
+void heap_index_destroy(void);
+
+// Record a new live block (malloc, calloc, or realloc from NULL)
+void heap_index_alloc(void* ptr, size_t size, void* site, pid_t thread_id);
+
+// Record a block being freed by thread_id, counting it in the (allocating thread, freeing thread) matrix. Unknown pointers are ignored.
+void heap_index_free(void* ptr, pid_t thread_id);
+
+// Record a realloc, with the same semantics as realloc() itself (NULL old pointer, zero size, failure).
+// A realloc that moves the block counts as thread_id freeing the old one.
+// Successive reallocs of the same buffer are followed as one chain, through every move.
+void heap_index_realloc(void* old_ptr, size_t size, void* new_ptr, void* site, pid_t thread_id);
+
+// Record where a thread came from (its THREAD_CREATE event), for the reports
+void heap_index_thread(pid_t thread_id, pid_t parent, void* function);
+
+// Find the live block containing addr. Returns 1 and fills in block if there is one, otherwise 0.
+int heap_index_find(const void* addr, HeapBlock* block);
+
+// Resolve both ends of a copy to their blocks and add it to the per-(source site, destination site) totals.
+// Either block comes back with a NULL start if that address isn't inside a live heap block.
+void heap_index_copy(const void* dest, const void* src, size_t n, HeapBlock* dest_block, HeapBlock* src_block);
+
+// Total requested bytes of all live blocks
+size_t heap_index_live_bytes(void);
+
+// Write copy_pairs.csv ranked by bytes copied, cross_thread_free.csv with the free matrix,
+// remote_free_sites.csv with the allocation sites behind the most cross-thread frees,
+// and realloc_chains.csv / realloc_chain_top.csv with realloc chains ranked by estimated bytes copied
+void heap_index_report(void);
+
+#ifdef __cplusplus
+}
+#endif
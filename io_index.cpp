@@ -0,0 +1,82 @@
+#include "io_index.h"
+#include "event_writer.h"
+#include "arena.h"
+#include "log_writer.h"
+#include "ns_histogram.h"
+
+struct FdCall {
+    int fd;
+    unsigned generation;  // Closes of fd seen before this call
+    int event_type;
+
+    bool operator==(const FdCall& other) const {
+        return fd == other.fd && generation == other.generation && event_type == other.event_type;
+    }
+};
+
+struct FdCallHash {
+    size_t operator()(const FdCall& c) const {
+        return (std::hash<int>()(c.fd) * 31 + c.generation) * 31 + c.event_type;
+    }
+};
+
+struct LatencyHistogram {
+    NsHistogram time;
+    unsigned long bytes[NS_BUCKETS];
+};
+
+struct IoIndex : ArenaObject {
+    ArenaHashMap<FdCall, LatencyHistogram, FdCallHash> calls;
+    ArenaHashMap<int, unsigned> generations;
+};
+
+static IoIndex* g_io_index = nullptr;
+
+extern "C" {
+
+void io_index_init(void) {
+    if (!g_io_index) g_io_index = new IoIndex();
+}
+
+void io_index_destroy(void) {
+    if (g_io_index) {
+        delete g_io_index;
+        g_io_index = nullptr;
+    }
+}
+
+void io_index_call(int event_type, int fd, unsigned long duration_ns, size_t bytes) {
+    if (!g_io_index) return;
+
+    auto generation = g_io_index->generations.find(fd);
+    FdCall call{fd, generation == g_io_index->generations.end() ? 0 : generation->second, event_type};
+
+    LatencyHistogram& h = g_io_index->calls[call];
+    h.bytes[h.time.add(duration_ns)] += bytes;
+}
+
+void io_index_close(int fd) {
+    if (!g_io_index) return;
+    g_io_index->generations[fd]++;
+}
+
+void io_index_report(void) {
+    if (!g_io_index || g_io_index->calls.empty()) return;
+
+    auto ranked = rank_by_time(g_io_index->calls, [](const LatencyHistogram& h) -> const NsHistogram& { return h.time; });
+
+    log_file* f = log_open("io_latency", "fd,generation,event,min_duration_ns,calls,duration_ns,bytes");
+    if (!f) return;
+
+    for (const auto& entry : ranked) {
+        const LatencyHistogram& h = entry.second;
+        for (int b = 0; b < NS_BUCKETS; b++) {
+            if (h.time.count[b] == 0) continue;
+            log_printf(f, "%d,%u,%s,%lu,%lu,%lu,%lu\n", entry.first.fd, entry.first.generation, event_name(entry.first.event_type),
+                       log2_bucket_min(b), h.time.count[b], h.time.ns[b], h.bytes[b]);
+        }
+    }
+    log_close(f);
+}
+
+} // extern "C"
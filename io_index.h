@@ -0,0 +1,29 @@
+#pragma once
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * I/O latency histograms per file descriptor and call, built from the READ ... FDATASYNC events on the writer thread.
+ * Every successful close() (the CLOSE event) starts a new generation of the descriptor, so a reused number doesn't add
+ * up across unrelated files. A descriptor replaced by dup2() or dup3() without a close() stays in its generation.
+ */
+
+void io_index_init(void);
+
+void io_index_destroy(void);
+
+// One call of event_type on fd that took duration_ns and moved bytes (0 for a failed call or a sync)
+void io_index_call(int event_type, int fd, unsigned long duration_ns, size_t bytes);
+
+// fd was closed, later calls on it go to a new generation
+void io_index_close(int fd);
+
+// Write io_latency.csv, one row per power of two duration bucket, descriptor generations and calls with the most time spent first
+void io_index_report(void);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,74 @@
+#include "lock_index.h"
+#include "event_writer.h"
+#include "arena.h"
+#include "log_writer.h"
+#include "ns_histogram.h"
+
+struct LockSite {
+    void* lock;
+    void* site;
+    int event_type;
+
+    bool operator==(const LockSite& other) const {
+        return lock == other.lock && site == other.site && event_type == other.event_type;
+    }
+};
+
+struct LockSiteHash {
+    size_t operator()(const LockSite& l) const {
+        return (std::hash<void*>()(l.lock) * 31 + std::hash<void*>()(l.site)) * 31 + l.event_type;
+    }
+};
+
+struct LockIndex : ArenaObject {
+    ArenaHashMap<LockSite, NsHistogram, LockSiteHash> sites;
+};
+
+static LockIndex* g_lock_index = nullptr;
+
+static void print_pointer(log_file* f, void* ptr) {
+    if (ptr) log_printf(f, "\"%p\",", ptr);
+    else log_printf(f, "null,");
+}
+
+extern "C" {
+
+void lock_index_init(void) {
+    if (!g_lock_index) g_lock_index = new LockIndex();
+}
+
+void lock_index_destroy(void) {
+    if (g_lock_index) {
+        delete g_lock_index;
+        g_lock_index = nullptr;
+    }
+}
+
+void lock_index_wait(int event_type, void* lock, void* site, unsigned long wait_ns) {
+    if (!g_lock_index) return;
+
+    g_lock_index->sites[LockSite{lock, site, event_type}].add(wait_ns);
+}
+
+void lock_index_report(void) {
+    if (!g_lock_index || g_lock_index->sites.empty()) return;
+
+    auto ranked = rank_by_time(g_lock_index->sites, [](const NsHistogram& h) -> const NsHistogram& { return h; });
+
+    log_file* f = log_open("lock_contention", "lock,call_site,event,min_wait_ns,waits,wait_ns");
+    if (!f) return;
+
+    for (const auto& entry : ranked) {
+        for (int b = 0; b < NS_BUCKETS; b++) {
+            if (entry.second.count[b] == 0) continue;
+
+            print_pointer(f, entry.first.lock);
+            print_pointer(f, entry.first.site);
+            log_printf(f, "%s,%lu,%lu,%lu\n", event_name(entry.first.event_type), log2_bucket_min(b),
+                       entry.second.count[b], entry.second.ns[b]);
+        }
+    }
+    log_close(f);
+}
+
+} // extern "C"
@@ -0,0 +1,25 @@
+#pragma once
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Lock contention histograms, per lock, call site and kind of wait, built from the MUTEX_WAIT, MUTEX_BUSY and
+ * COND_WAIT events on the writer thread.
+ */
+
+void lock_index_init(void);
+
+void lock_index_destroy(void);
+
+// One wait of event_type on lock (a mutex or a condition variable) from site. A busy trylock waited 0 ns.
+void lock_index_wait(int event_type, void* lock, void* site, unsigned long wait_ns);
+
+// Write lock_contention.csv, one row per power of two wait bucket, locks and sites with the most time waited first
+void lock_index_report(void);
+
+#ifdef __cplusplus
+}
+#endif
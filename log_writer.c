@@ -0,0 +1,450 @@
+#define _GNU_SOURCE
+#include "log_writer.h"
+#include "event_queue.h"
+#include "define_override.h"
+#include "arena.h"
+#include "collector.h"
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#define PAGE 4096UL
+
+//Each file has at most two buffers out, so this only fills up if there are over 128 files open.
+#define QUEUE_LEN 256
+
+//Streamed buffers are kept well under the socket buffer, so a frame can go out in one piece
+#define STREAM_BUFFER (32UL << 10)
+
+struct log_file {
+    int fd;
+    int direct;
+    int stream; //Sent to the collector rather than written to fd
+    char* label; //The frame label of a streamed file, see collector.h
+    size_t label_len;
+    size_t size; //Of each buffer
+    char* buffers[2];
+    int active;
+    size_t fill;
+    off_t offset; //Where the active buffer's contents go in the file
+    int in_flight[2]; //Guarded by io_lock
+};
+
+typedef struct io_request {
+    log_file* file;
+    int index;
+    size_t len;
+    off_t offset;
+} io_request;
+
+static pthread_mutex_t io_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t io_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t io_done = PTHREAD_COND_INITIALIZER;
+
+static io_request queue[QUEUE_LEN];
+static int queue_head;
+static int queue_count;
+
+static int io_running;
+static pthread_t io_thread;
+
+static size_t buffer_size;
+static int want_direct;
+
+static LogWriterStats stats;
+static unsigned long started_ns;
+
+//Connection to the collector. A forked child notices stream_pid isn't its own and connects separately.
+static pthread_mutex_t stream_lock = PTHREAD_MUTEX_INITIALIZER;
+static int stream_fd = -1;
+static pid_t stream_pid;
+
+
+static unsigned long clock_ns(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (t.tv_sec * 1000000000UL) + t.tv_nsec;
+}
+
+static int send_frame(int fd, collector_frame* h, const void* label, const void* data) {
+    h->magic = COLLECTOR_MAGIC;
+    h->pid = getpid();
+    h->ppid = getppid();
+
+    struct iovec iov[3] = {
+        { h, sizeof(*h) },
+        { (void*)label, h->label_len },
+        { (void*)data, h->length }
+    };
+    struct msghdr msg = { .msg_iov = iov, .msg_iovlen = 3 };
+
+    //Never block the writer on the collector. A full socket means this batch is lost.
+    return sendmsg(fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL) < 0 ? -1 : 0;
+}
+
+//Returns the collector connection for this process, or -1 when LD_PRELOAD_COLLECTOR is unset or nothing listens there.
+static int stream_connect(void) {
+    char* path = getenv("LD_PRELOAD_COLLECTOR");
+    if (path == NULL || path[0] == '\0') return -1;
+
+    pthread_mutex_lock(&stream_lock);
+    if (stream_pid != getpid()) {
+        //A connection inherited from the parent belongs to the parent
+        if (stream_fd >= 0) close(stream_fd);
+        stream_pid = getpid();
+
+        struct sockaddr_un addr = { .sun_family = AF_UNIX };
+        strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+        stream_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+        if (stream_fd >= 0) {
+            //More room in the socket means fewer dropped batches while the collector is busy with other processes
+            int sndbuf = 1 << 20;
+            setsockopt(stream_fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+        }
+        if (stream_fd >= 0 && connect(stream_fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+            close(stream_fd);
+            stream_fd = -1;
+        }
+
+        if (stream_fd >= 0) {
+            collector_frame hello = { .kind = FRAME_HELLO };
+            send_frame(stream_fd, &hello, NULL, NULL);
+        }
+    }
+    int fd = stream_fd;
+    pthread_mutex_unlock(&stream_lock);
+    return fd;
+}
+
+static size_t count_rows(const char* data, size_t len) {
+    size_t rows = 0;
+    for (size_t i = 0; i < len; i++) rows += data[i] == '\n';
+    return rows;
+}
+
+static size_t send_rows(log_file* f, const char* data, size_t len) {
+    int fd = stream_connect();
+
+    collector_frame h = { .kind = FRAME_ROWS, .label_len = f->label_len, .length = len };
+    if (fd >= 0 && send_frame(fd, &h, f->label, data) == 0) return len;
+
+    size_t rows = count_rows(data, len);
+    pthread_mutex_lock(&io_lock);
+    stats.frames_dropped++;
+    stats.rows_dropped += rows;
+    pthread_mutex_unlock(&io_lock);
+    return 0;
+}
+
+static void do_write(const io_request* req) {
+    const char* data = req->file->buffers[req->index];
+    size_t done = 0;
+
+    unsigned long start = clock_ns();
+    if (req->file->stream) done = send_rows(req->file, data, req->len);
+    while (!req->file->stream && done < req->len) {
+        ssize_t n = pwrite(req->file->fd, data + done, req->len - done, req->offset + done);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "LOG WRITE FAILED: %s\n", strerror(errno));
+            break;
+        }
+        done += n;
+    }
+    unsigned long took = clock_ns() - start;
+
+    int bucket = log2_bucket(took, LOG_LATENCY_BUCKETS);
+
+    pthread_mutex_lock(&io_lock);
+    stats.writes++;
+    stats.bytes += done;
+    stats.busy_ns += took;
+    stats.latency[bucket]++;
+    if (took > stats.max_latency_ns) stats.max_latency_ns = took;
+    pthread_mutex_unlock(&io_lock);
+}
+
+static void* io_loop(void* arg) {
+    pthread_mutex_lock(&io_lock);
+    while (1) {
+        while (queue_count == 0 && io_running) pthread_cond_wait(&io_work, &io_lock);
+        if (queue_count == 0) break;
+
+        io_request req = queue[queue_head];
+        queue_head = (queue_head + 1) % QUEUE_LEN;
+        queue_count--;
+        pthread_mutex_unlock(&io_lock);
+
+        do_write(&req);
+
+        pthread_mutex_lock(&io_lock);
+        req.file->in_flight[req.index] = 0;
+        pthread_cond_broadcast(&io_done);
+    }
+    pthread_mutex_unlock(&io_lock);
+    return NULL;
+}
+
+static void submit(log_file* f, int index, size_t len, off_t offset) {
+    io_request req = { f, index, len, offset };
+
+    pthread_mutex_lock(&io_lock);
+    if (!io_running) {
+        pthread_mutex_unlock(&io_lock);
+        do_write(&req);
+        return;
+    }
+
+    while (queue_count == QUEUE_LEN) pthread_cond_wait(&io_done, &io_lock);
+    f->in_flight[index] = 1;
+    queue[(queue_head + queue_count) % QUEUE_LEN] = req;
+    queue_count++;
+    pthread_cond_signal(&io_work);
+    pthread_mutex_unlock(&io_lock);
+}
+
+static void wait_for_buffer(log_file* f, int index) {
+    pthread_mutex_lock(&io_lock);
+    if (f->in_flight[index]) {
+        unsigned long start = clock_ns();
+        while (f->in_flight[index]) pthread_cond_wait(&io_done, &io_lock);
+        stats.stalls++;
+        stats.stall_ns += clock_ns() - start;
+    }
+    pthread_mutex_unlock(&io_lock);
+}
+
+//How much of the active buffer can go out now
+static size_t ready_bytes(log_file* f) {
+    if (f->direct) return f->fill & ~(PAGE - 1);
+
+    //Frames end on a line boundary, so the collector never has to stitch rows back together
+    if (f->stream) {
+        char* end = memrchr(f->buffers[f->active], '\n', f->fill);
+        return end ? end + 1 - f->buffers[f->active] : 0;
+    }
+    return f->fill;
+}
+
+//Sends the active buffer off and moves on to the other one. Whatever can't go out yet is carried over.
+static void swap_buffers(log_file* f) {
+    int next = f->active ^ 1;
+    wait_for_buffer(f, next);
+
+    size_t len = ready_bytes(f);
+    size_t tail = f->fill - len;
+    memcpy(f->buffers[next], f->buffers[f->active] + len, tail);
+
+    if (len) submit(f, f->active, len, f->offset);
+
+    f->offset += len;
+    f->active = next;
+    f->fill = tail;
+}
+
+void log_writer_start(void) {
+    if (buffer_size == 0) {
+        buffer_size = (env_ulong("LD_PRELOAD_WRITE_BUFFER_KB", 256) * 1024 + PAGE - 1) & ~(PAGE - 1);
+        if (buffer_size == 0) buffer_size = PAGE;
+        want_direct = env_ulong("LD_PRELOAD_DIRECT_IO", 0) != 0;
+        started_ns = clock_ns();
+    }
+
+    pthread_mutex_lock(&io_lock);
+    if (io_running) {
+        pthread_mutex_unlock(&io_lock);
+        return;
+    }
+    io_running = 1;
+    pthread_mutex_unlock(&io_lock);
+
+    pthread_create(&io_thread, NULL, io_loop, NULL);
+}
+
+void log_writer_stop(void) {
+    pthread_mutex_lock(&io_lock);
+    if (!io_running) {
+        pthread_mutex_unlock(&io_lock);
+        return;
+    }
+    io_running = 0;
+    pthread_cond_signal(&io_work);
+    pthread_mutex_unlock(&io_lock);
+
+    pthread_join(io_thread, NULL);
+}
+
+static log_file* new_file(int fd, size_t size) {
+    char* buffers = tracer_mmap(NULL, 2 * size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buffers == MAP_FAILED) return NULL;
+
+    log_file* f = arena_calloc(1, sizeof(log_file));
+    if (f == NULL) {
+        //The caller still owns fd and closes it
+        tracer_munmap(buffers, 2 * size);
+        return NULL;
+    }
+    f->fd = fd;
+    f->size = size;
+    f->buffers[0] = buffers;
+    f->buffers[1] = buffers + size;
+    return f;
+}
+
+log_file* log_open(const char* name, const char* header) {
+    if (buffer_size == 0) log_writer_start();
+
+    if (stream_connect() >= 0) {
+        log_file* f = new_file(-1, buffer_size < STREAM_BUFFER ? buffer_size : STREAM_BUFFER);
+        if (f == NULL) return NULL;
+
+        //The header rides along in every frame, so a dropped batch never costs the collector the schema
+        size_t name_len = strlen(name) + 1;
+        f->label_len = name_len + strlen(header) + 1;
+        f->label = arena_alloc(f->label_len);
+        if (f->label == NULL) {
+            tracer_munmap(f->buffers[0], 2 * f->size);
+            arena_free(f);
+            return NULL;
+        }
+        memcpy(f->label, name, name_len);
+        strcpy(f->label + name_len, header);
+        f->stream = 1;
+        return f;
+    }
+
+    char path[4096];
+    log_path(name, path, sizeof(path));
+
+    int direct = want_direct;
+    int fd = -1;
+    if (direct) {
+        fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | O_DIRECT, 0666);
+    }
+    if (fd < 0) {
+        //Not every filesystem takes O_DIRECT (tmpfs doesn't), plain writes still work there.
+        direct = 0;
+        fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    }
+    if (fd < 0) {
+        fprintf(stderr, "FAILED TO CREATE LOG FILE: %s\n", path);
+        return NULL;
+    }
+
+    log_file* f = new_file(fd, buffer_size);
+    if (f == NULL) {
+        close(fd);
+        return NULL;
+    }
+    f->direct = direct;
+
+    log_printf(f, "%s\n", header);
+    return f;
+}
+
+void log_printf(log_file* f, const char* format, ...) {
+    va_list ap;
+
+    while (1) {
+        size_t room = f->size - f->fill;
+
+        va_start(ap, format);
+        int n = vsnprintf(f->buffers[f->active] + f->fill, room, format, ap);
+        va_end(ap);
+
+        if (n < 0) return;
+        if ((size_t)n < room) {
+            f->fill += n;
+            return;
+        }
+
+        //A single line bigger than a whole buffer can't be written, drop it rather than loop forever.
+        size_t before = f->fill;
+        swap_buffers(f);
+        if (f->fill == before) return;
+    }
+}
+
+void log_flush(log_file* f) {
+    if (f->fill) swap_buffers(f);
+}
+
+void log_close(log_file* f) {
+    log_flush(f);
+
+    wait_for_buffer(f, 0);
+    wait_for_buffer(f, 1);
+
+    if (f->fill && !f->direct) {
+        io_request req = { f, f->active, f->fill, f->offset };
+        do_write(&req);
+    }
+
+    //An O_DIRECT file can only be written in whole pages, so the tail goes out padded and gets cut back afterwards.
+    if (f->direct && f->fill) {
+        size_t padded = (f->fill + PAGE - 1) & ~(PAGE - 1);
+        memset(f->buffers[f->active] + f->fill, 0, padded - f->fill);
+
+        io_request req = { f, f->active, padded, f->offset };
+        do_write(&req);
+        if (ftruncate(f->fd, f->offset + f->fill) != 0) {
+            fprintf(stderr, "LOG TRUNCATE FAILED: %s\n", strerror(errno));
+        }
+    }
+
+    if (f->fd >= 0) close(f->fd);
+    tracer_munmap(f->buffers[0], 2 * f->size);
+    arena_free(f->label);
+    arena_free(f);
+}
+
+void log_writer_stats(LogWriterStats* out) {
+    pthread_mutex_lock(&io_lock);
+    *out = stats;
+    pthread_mutex_unlock(&io_lock);
+}
+
+void log_writer_report(void) {
+    LogWriterStats s;
+    log_writer_stats(&s);
+
+    if (s.writes) {
+        unsigned long elapsed = clock_ns() - started_ns;
+
+        log_file* f = log_open("writer", "writes,bytes,busy_ns,elapsed_ns,write_bytes_per_second,average_bytes_per_second,"
+                                         "max_latency_ns,stalls,stall_ns,frames_dropped,rows_dropped");
+        if (f) {
+            log_printf(f, "%lu,%lu,%lu,%lu,%.0f,%.0f,%lu,%lu,%lu,%lu,%lu\n", s.writes, s.bytes, s.busy_ns, elapsed,
+                       s.busy_ns ? s.bytes * 1e9 / s.busy_ns : 0.0, elapsed ? s.bytes * 1e9 / elapsed : 0.0,
+                       s.max_latency_ns, s.stalls, s.stall_ns, s.frames_dropped, s.rows_dropped);
+            log_close(f);
+        }
+
+        //Each row counts the writes that took at least latency_ns, and less than the next row's latency_ns
+        f = log_open("writer_latency", "latency_ns,writes");
+        if (f) {
+            for (int i = 0; i < LOG_LATENCY_BUCKETS; i++) {
+                if (s.latency[i]) log_printf(f, "%lu,%lu\n", log2_bucket_min(i), s.latency[i]);
+            }
+            log_close(f);
+        }
+    }
+
+    int fd = stream_connect();
+    if (fd >= 0) {
+        log_writer_stats(&s);
+        collector_frame bye = { .kind = FRAME_BYE, .dropped_rows = s.rows_dropped };
+        send_frame(fd, &bye, NULL, NULL);
+    }
+}
@@ -0,0 +1,57 @@
+#pragma once
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Output path for the event logs. The writer thread formats lines into one of two large page-aligned buffers per file.
+ * Full buffers are handed to an I/O thread, so formatting carries on in the other buffer while the first is written.
+ * With LD_PRELOAD_DIRECT_IO=1 files are opened with O_DIRECT (when the filesystem allows it) and only whole pages are written.
+ * With LD_PRELOAD_COLLECTOR=<socket path> the buffers are streamed to the collector daemon instead (see collector.h),
+ * falling back to local files when nothing is listening there.
+ */
+
+typedef struct log_file log_file;
+
+#define LOG_LATENCY_BUCKETS 32
+
+// Write path metrics, see log_writer_stats()
+typedef struct {
+    unsigned long writes;
+    unsigned long bytes;
+    unsigned long busy_ns;  // Time spent inside write calls
+    unsigned long max_latency_ns;
+    unsigned long latency[LOG_LATENCY_BUCKETS];  // Bucketed by log2_bucket(), so bucket i counts writes that took [2^(i-1), 2^i) ns
+    unsigned long stalls;  // Times formatting had to wait for a buffer still being written
+    unsigned long stall_ns;
+    unsigned long frames_dropped;  // Batches the collector couldn't take without blocking, or that had nowhere to go
+    unsigned long rows_dropped;
+} LogWriterStats;
+
+// Start the I/O thread. Until it runs (e.g. in a forked child), buffers are written inline.
+void log_writer_start(void);
+
+// Write out everything submitted so far, then stop the I/O thread
+void log_writer_stop(void);
+
+// Open <log root>/<pid>/<name>.csv for writing, starting with the header line (no newline). Returns NULL on failure.
+log_file* log_open(const char* name, const char* header);
+
+void log_printf(log_file* f, const char* format, ...) __attribute__((format(printf, 2, 3)));
+
+// Hand whatever is buffered to the I/O thread (O_DIRECT files keep their unaligned tail, streamed ones their last partial line)
+void log_flush(log_file* f);
+
+// Flush, wait for the file's writes to finish and close it
+void log_close(log_file* f);
+
+void log_writer_stats(LogWriterStats* stats);
+
+// Write writer.csv with the totals and latency histogram, and tell the collector (if any) this process is done
+void log_writer_report(void);
+
+#ifdef __cplusplus
+}
+#endif
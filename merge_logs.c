@@ -0,0 +1,367 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*
+ * Merges the logs of a whole process tree into one timeline.
+ * Usage: merge_logs <log root> [output dir]
+ * Every numeric directory under the log root is one process, and every event log in it (a .csv starting with
+ * thread,time_ns) is one stream. All processes share the root's origin (LD_ORIGIN_TIME), so a k-way merge by time puts
+ * every stream in one order: timeline.csv, each row being the original one with the pid and event in front.
+ * Inputs are mapped rather than read and only the next line of each stream is looked at, so memory stays flat however
+ * big the logs get. process_tree.csv lists the processes, depth first, as the FORK and CLONE3 records connect them.
+ */
+
+#define RELEASE_BYTES (64UL << 20)  // Drop a stream's pages once this much of it has been merged
+
+typedef struct stream {
+    char* base;
+    size_t size;
+    const char* line;  // The current line, NULL once the stream is done
+    const char* line_end;
+    const char* rest;  // What follows the time column
+    const char* released;  // Everything before this has been handed back to the kernel
+    unsigned long time_ns;
+    int thread_len;
+    int pid;
+    char event[64];
+} stream;
+
+typedef struct process {
+    int pid;
+    int parent;  // 0 for a root
+    int thread;  // That forked it
+    unsigned long time_ns;
+    const char* created_by;  // "fork", "vfork", "clone3", or "" when no record of it was found
+    int has_logs;
+} process;
+
+static stream* streams;
+static size_t stream_count;
+
+//Min-heap of live streams, by the time of their current line
+static size_t* heap;
+static size_t heap_count;
+
+static process* processes;
+static size_t process_count;
+
+static size_t page_size;
+
+
+//Moves to the next complete line with a readable time. A line cut short by a crash ends the stream.
+static void advance(stream* s) {
+    const char* p = s->line_end + 1;
+    const char* end = s->base + s->size;
+
+    for (;;) {
+        const char* nl = p < end ? memchr(p, '\n', end - p) : NULL;
+        if (nl == NULL) {
+            s->line = NULL;
+            return;
+        }
+
+        const char* comma = memchr(p, ',', nl - p);
+        if (comma && comma + 1 < nl && comma[1] >= '0' && comma[1] <= '9') {
+            char* after;
+            s->time_ns = strtoul(comma + 1, &after, 10);
+            if (after < nl && *after == ',') {
+                s->line = p;
+                s->line_end = nl;
+                s->thread_len = comma - p;
+                s->rest = after + 1;
+                break;
+            }
+        }
+        p = nl + 1;
+    }
+
+    size_t done = (s->line - s->base) & ~(page_size - 1);
+    if (s->base + done - s->released >= RELEASE_BYTES) {
+        madvise((void*)s->released, s->base + done - s->released, MADV_DONTNEED);
+        s->released = s->base + done;
+    }
+}
+
+static int earlier(size_t a, size_t b) {
+    const stream* x = &streams[a];
+    const stream* y = &streams[b];
+    if (x->time_ns != y->time_ns) return x->time_ns < y->time_ns;
+    if (x->pid != y->pid) return x->pid < y->pid;
+    return a < b;
+}
+
+static void sift_down(size_t i) {
+    for (;;) {
+        size_t smallest = i;
+        size_t left = 2 * i + 1;
+        size_t right = left + 1;
+        if (left < heap_count && earlier(heap[left], heap[smallest])) smallest = left;
+        if (right < heap_count && earlier(heap[right], heap[smallest])) smallest = right;
+        if (smallest == i) return;
+
+        size_t swap = heap[i];
+        heap[i] = heap[smallest];
+        heap[smallest] = swap;
+        i = smallest;
+    }
+}
+
+//Maps one log. Returns NULL (and maps nothing) when it is empty or unreadable.
+static char* map_file(const char* path, size_t* size) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || st.st_size == 0) {
+        if (fd >= 0) close(fd);
+        return NULL;
+    }
+
+    char* base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) return NULL;
+
+    madvise(base, st.st_size, MADV_SEQUENTIAL);
+    *size = st.st_size;
+    return base;
+}
+
+static void add_stream(const char* dir, const char* name, int pid) {
+    char path[4096 + 256];
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+
+    size_t size;
+    char* base = map_file(path, &size);
+    if (base == NULL) return;
+
+    //Reports and the alloc_map spill have columns of their own, only event logs take part
+    static const char prefix[] = "thread,time_ns,";
+    if (size < sizeof(prefix) || memcmp(base, prefix, sizeof(prefix) - 1) != 0) {
+        munmap(base, size);
+        return;
+    }
+
+    streams = realloc(streams, (stream_count + 1) * sizeof(stream));
+    if (streams == NULL) exit(1);
+
+    stream* s = &streams[stream_count++];
+    memset(s, 0, sizeof(*s));
+    s->base = base;
+    s->size = size;
+    s->released = base;
+    s->pid = pid;
+    snprintf(s->event, sizeof(s->event), "%.*s", (int)(strlen(name) - 4), name);
+
+    //Past the header line
+    const char* nl = memchr(base, '\n', size);
+    s->line = nl ? base : NULL;
+    s->line_end = nl;
+    if (s->line) advance(s);
+}
+
+static process* find_process(int pid) {
+    for (size_t i = 0; i < process_count; i++) {
+        if (processes[i].pid == pid) return &processes[i];
+    }
+
+    processes = realloc(processes, (process_count + 1) * sizeof(process));
+    if (processes == NULL) exit(1);
+
+    process* p = &processes[process_count++];
+    memset(p, 0, sizeof(*p));
+    p->pid = pid;
+    p->created_by = "";
+    return p;
+}
+
+//Splits a line into at most max columns, returns how many there were
+static int split(char* line, char** columns, int max) {
+    int n = 0;
+    for (char* c = line; n < max;) {
+        columns[n++] = c;
+        c = strchr(c, ',');
+        if (c == NULL) break;
+        *c++ = '\0';
+    }
+    return n;
+}
+
+//Adds the children a process's fork.csv or clone3.csv records (clones that share the address space are threads, not processes)
+static void add_children(const char* dir, const char* name, int pid) {
+    char path[4096 + 256];
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+
+    FILE* f = fopen(path, "r");
+    if (f == NULL) return;
+
+    int clone = strcmp(name, "clone3.csv") == 0;
+    char line[4096];
+    char* columns[16];
+    if (fgets(line, sizeof(line), f) == NULL) {
+        fclose(f);
+        return;
+    }
+
+    while (fgets(line, sizeof(line), f)) {
+        line[strcspn(line, "\n")] = '\0';
+        int n = split(line, columns, 16);
+
+        const char* created_by;
+        int child;
+        if (clone) {
+            //thread,time_ns, the 11 clone_args fields, the size, then the return value
+            if (n < 15 || (strtoul(columns[2], NULL, 10) & CLONE_THREAD)) continue;
+            created_by = "clone3";
+            child = atoi(columns[n - 1]);
+        }
+        else {
+            if (n < 4) continue;
+            created_by = strcmp(columns[2], "True") == 0 ? "vfork" : "fork";
+            child = atoi(columns[3]);
+        }
+        if (child <= 0) continue;
+
+        process* p = find_process(child);
+        p->parent = pid;
+        p->thread = atoi(columns[0]);
+        p->time_ns = strtoul(columns[1], NULL, 10);
+        p->created_by = created_by;
+    }
+    fclose(f);
+}
+
+static void add_process(const char* root, int pid) {
+    char dir[4096];
+    snprintf(dir, sizeof(dir), "%s/%d", root, pid);
+
+    DIR* d = opendir(dir);
+    if (d == NULL) return;
+
+    find_process(pid)->has_logs = 1;
+
+    struct dirent* entry;
+    while ((entry = readdir(d)) != NULL) {
+        size_t len = strlen(entry->d_name);
+        if (len <= 4 || strcmp(entry->d_name + len - 4, ".csv") != 0) continue;
+
+        add_stream(dir, entry->d_name, pid);
+        if (strcmp(entry->d_name, "fork.csv") == 0 || strcmp(entry->d_name, "clone3.csv") == 0) {
+            add_children(dir, entry->d_name, pid);
+        }
+    }
+    closedir(d);
+}
+
+static int by_time(const void* a, const void* b) {
+    const process* x = *(const process* const*)a;
+    const process* y = *(const process* const*)b;
+    if (x->time_ns != y->time_ns) return x->time_ns < y->time_ns ? -1 : 1;
+    return x->pid - y->pid;
+}
+
+//Writes pid and then its children, oldest first
+static void write_tree(FILE* out, process** ordered, int pid, int depth) {
+    for (size_t i = 0; i < process_count; i++) {
+        process* p = ordered[i];
+        if (p->parent != pid) continue;
+
+        fprintf(out, "%d,%d,%d,%s,%d,%lu,%s\n", p->pid, p->parent, depth, p->created_by, p->thread, p->time_ns,
+                p->has_logs ? "True" : "False");
+        //A pid reused within the tree would loop forever, so stop at any depth a real tree can't reach
+        if (depth < (int)process_count) write_tree(out, ordered, p->pid, depth + 1);
+    }
+}
+
+static FILE* open_output(const char* dir, const char* name) {
+    char path[4096 + 256];
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    FILE* f = fopen(path, "w");
+    if (f == NULL) perror(path);
+    return f;
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <log root> [output dir]\n", argv[0]);
+        return 1;
+    }
+    const char* root = argv[1];
+    const char* out_dir = argc > 2 ? argv[2] : argv[1];
+    page_size = sysconf(_SC_PAGESIZE);
+
+    DIR* dir = opendir(root);
+    if (dir == NULL) {
+        perror("merge_logs");
+        return 1;
+    }
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] && strspn(entry->d_name, "0123456789") == strlen(entry->d_name)) {
+            add_process(root, atoi(entry->d_name));
+        }
+    }
+    closedir(dir);
+
+    if (stream_count == 0) {
+        fprintf(stderr, "merge_logs: no event logs under %s\n", root);
+        return 1;
+    }
+
+    //Processes whose parent left no logs of its own still hang off that parent
+    size_t known = process_count;
+    for (size_t i = 0; i < known; i++) {
+        if (processes[i].parent) find_process(processes[i].parent);
+    }
+
+    process** ordered = malloc(process_count * sizeof(process*));
+    if (ordered == NULL) return 1;
+    for (size_t i = 0; i < process_count; i++) ordered[i] = &processes[i];
+    qsort(ordered, process_count, sizeof(process*), by_time);
+
+    FILE* tree = open_output(out_dir, "process_tree.csv");
+    if (tree == NULL) return 1;
+    fprintf(tree, "pid,parent,depth,created_by,thread,time_ns,has_logs\n");
+    write_tree(tree, ordered, 0, 0);
+    fclose(tree);
+
+    FILE* out = open_output(out_dir, "timeline.csv");
+    if (out == NULL) return 1;
+    setvbuf(out, NULL, _IOFBF, 1 << 20);
+    fprintf(out, "time_ns,pid,event,thread,fields\n");
+
+    heap = malloc(stream_count * sizeof(size_t));
+    if (heap == NULL) return 1;
+    for (size_t i = 0; i < stream_count; i++) {
+        if (streams[i].line) heap[heap_count++] = i;
+    }
+    for (size_t i = heap_count / 2; i-- > 0;) sift_down(i);
+
+    unsigned long rows = 0;
+    while (heap_count) {
+        stream* s = &streams[heap[0]];
+
+        fprintf(out, "%lu,%d,%s,%.*s,", s->time_ns, s->pid, s->event, s->thread_len, s->line);
+        fwrite(s->rest, 1, s->line_end - s->rest + 1, out);
+        rows++;
+
+        advance(s);
+        if (s->line == NULL) heap[0] = heap[--heap_count];
+        sift_down(0);
+    }
+    fclose(out);
+
+    fprintf(stderr, "merge_logs: %lu rows from %zu logs of %zu processes\n", rows, stream_count, process_count);
+
+    for (size_t i = 0; i < stream_count; i++) munmap(streams[i].base, streams[i].size);
+    free(streams);
+    free(processes);
+    free(ordered);
+    free(heap);
+    return 0;
+}
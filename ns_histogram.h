@@ -0,0 +1,34 @@
+#pragma once
+#include "arena.h"
+#include "event_queue.h"
+#include <algorithm>
+#include <utility>
+
+// Shared by the writer-side indexes that time things (lock_index.cpp, io_index.cpp). C++ only.
+
+#define NS_BUCKETS 40  // Bucket b holds [2^(b-1), 2^b) ns, bucket 0 is 0 ns and the last one is open ended
+
+struct NsHistogram {
+    unsigned long total_ns;
+    unsigned long count[NS_BUCKETS];
+    unsigned long ns[NS_BUCKETS];
+
+    // Returns the bucket ns went to
+    int add(unsigned long duration_ns) {
+        int b = log2_bucket(duration_ns, NS_BUCKETS);
+        total_ns += duration_ns;
+        count[b]++;
+        ns[b] += duration_ns;
+        return b;
+    }
+};
+
+// Copies the entries of an index out, the ones with the most time (histogram(value).total_ns) first
+template <typename K, typename V, typename Hash, typename F>
+ArenaVector<std::pair<K, V>> rank_by_time(const ArenaHashMap<K, V, Hash>& index, F histogram) {
+    ArenaVector<std::pair<K, V>> ranked(index.begin(), index.end());
+    std::sort(ranked.begin(), ranked.end(), [&histogram](const std::pair<K, V>& a, const std::pair<K, V>& b) {
+        return histogram(a.second).total_ns > histogram(b.second).total_ns;
+    });
+    return ranked;
+}
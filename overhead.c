@@ -0,0 +1,121 @@
+#define _GNU_SOURCE
+#include "overhead.h"
+#include "event_writer.h"
+#include "log_writer.h"
+#include <string.h>
+
+int overhead_enabled;
+__thread overhead_block* overhead_mine __attribute__((tls_model("initial-exec")));
+__thread int overhead_event __attribute__((tls_model("initial-exec")));
+__thread unsigned long overhead_real __attribute__((tls_model("initial-exec")));
+
+static const char* metric_names[OVERHEAD_METRICS] = {
+    "wrapper_ns", "real_ns", "lock_wait_ns", "queue_depth", "alloc_map_ns"
+};
+
+static const char* writer_metric_names[OVERHEAD_WRITER_METRICS] = {
+    "batch_events", "flush_ns", "alloc_map_apply_ns"
+};
+
+//Everything exited threads recorded
+static overhead_block retired;
+
+//Only the writer thread (or fini(), once it has stopped) touches these
+static unsigned long writer_counts[OVERHEAD_WRITER_METRICS][OVERHEAD_BUCKETS];
+static unsigned long writer_totals[OVERHEAD_WRITER_METRICS];
+static overhead_block merged;
+
+
+static void add_block(thread_block* into, const thread_block* from) {
+    overhead_block* sum = (overhead_block*)into;
+    const overhead_block* o = (const overhead_block*)from;
+    for (int id = 0; id < MAX_OVERRIDE_VAL; id++) {
+        for (int m = 0; m < OVERHEAD_METRICS; m++) {
+            for (int b = 0; b < OVERHEAD_BUCKETS; b++) {
+                sum->counts[id][m][b] += __atomic_load_n(&o->counts[id][m][b], __ATOMIC_RELAXED);
+            }
+            sum->totals[id][m] += __atomic_load_n(&o->totals[id][m], __ATOMIC_RELAXED);
+        }
+    }
+}
+
+static void set_mine(thread_block* block) {
+    overhead_mine = (overhead_block*)block;
+}
+
+static thread_blocks registry = THREAD_BLOCKS_INITIALIZER(overhead_block, retired, add_block, set_mine);
+
+overhead_block* overhead_register(void) {
+    return (overhead_block*)thread_blocks_register(&registry);
+}
+
+void overhead_init(void) {
+    overhead_enabled = 1;
+    thread_blocks_init(&registry);
+}
+
+static void merge_block(const thread_block* block, pid_t thread_id, void* ctx) {
+    add_block(&merged.header, block);
+}
+
+void overhead_writer_add(int metric, unsigned long value) {
+    writer_counts[metric][log2_bucket(value, OVERHEAD_BUCKETS)]++;
+    writer_totals[metric] += value;
+}
+
+//The lower bound of the bucket the q-th of count samples falls in
+static unsigned long quantile(const unsigned long* counts, unsigned long count, double q) {
+    unsigned long rank = (unsigned long)(q * (count - 1));
+    unsigned long seen = 0;
+    for (int b = 0; b < OVERHEAD_BUCKETS; b++) {
+        seen += counts[b];
+        if (seen > rank) return log2_bucket_min(b);
+    }
+    return 0;
+}
+
+static void write_metric(log_file* totals, log_file* histogram, const char* event, const char* metric,
+                         const unsigned long* counts, unsigned long total) {
+    unsigned long samples = 0;
+    int top = 0;
+    for (int b = 0; b < OVERHEAD_BUCKETS; b++) {
+        samples += counts[b];
+        if (counts[b]) top = b;
+    }
+    if (samples == 0) return;
+
+    log_printf(totals, "%s,%s,%lu,%lu,%.1f,%lu,%lu,%lu\n", event, metric, samples, total, (double)total / samples,
+               quantile(counts, samples, 0.5), quantile(counts, samples, 0.99), log2_bucket_min(top));
+
+    for (int b = 0; b < OVERHEAD_BUCKETS; b++) {
+        if (counts[b]) log_printf(histogram, "%s,%s,%lu,%lu\n", event, metric, log2_bucket_min(b), counts[b]);
+    }
+}
+
+void overhead_write(void) {
+    if (!overhead_enabled) return;
+
+    //Percentiles and max are the lower bounds of their log2 buckets
+    log_file* totals = log_open("overhead", "event,metric,samples,total,mean,p50,p99,max");
+    if (totals == NULL) return;
+    log_file* histogram = log_open("overhead_histogram", "event,metric,min_value,samples");
+    if (histogram == NULL) {
+        log_close(totals);
+        return;
+    }
+
+    memset(&merged, 0, sizeof(merged));
+    thread_blocks_visit(&registry, merge_block, NULL);
+
+    for (int id = 0; id < MAX_OVERRIDE_VAL; id++) {
+        for (int m = 0; m < OVERHEAD_METRICS; m++) {
+            write_metric(totals, histogram, event_name(id), metric_names[m], merged.counts[id][m], merged.totals[id][m]);
+        }
+    }
+    for (int m = 0; m < OVERHEAD_WRITER_METRICS; m++) {
+        write_metric(totals, histogram, "writer", writer_metric_names[m], writer_counts[m], writer_totals[m]);
+    }
+
+    log_close(totals);
+    log_close(histogram);
+}
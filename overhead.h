@@ -0,0 +1,122 @@
+#pragma once
+#include "event_queue.h"
+#include "thread_blocks.h"
+#include <stddef.h>
+#include <time.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * LD_PRELOAD_OVERHEAD=1: the tracer times itself. Per OVERRIDE_ID, every traced call adds to log2 histograms of the time
+ * spent in the hook outside the real call, the real call, waiting for the event queue's lock, the queue depth it
+ * enqueued at, and the alloc_map update it made. The writer thread adds its batch sizes, flush times and async
+ * alloc_map batches. overhead.csv (totals) and overhead_histogram.csv are written at exit, every LD_PRELOAD_OVERHEAD_MS
+ * (0 for exit only) and whenever LD_PRELOAD_OVERHEAD_SIGNAL arrives. Off, each hook pays one predictable branch.
+ */
+
+#define OVERHEAD_BUCKETS 32  // Bucket b holds values in [2^(b-1), 2^b), bucket 0 is 0 and the last one is open ended
+
+enum OVERHEAD_METRIC {
+    OVERHEAD_WRAPPER_NS,  // In the hook, outside the real call. Calls that record no event (an uncontended lock) aren't counted.
+    OVERHEAD_REAL_NS,
+    OVERHEAD_LOCK_WAIT_NS,  // Taking the event queue's lock, including any LD_PRELOAD_MAX_QUEUE wait
+    OVERHEAD_QUEUE_DEPTH,  // Events queued, this one included
+    OVERHEAD_ALLOC_MAP_NS,  // The hook's own alloc_map update, when it isn't left to the writer (LD_PRELOAD_ASYNC_INDEX)
+    OVERHEAD_METRICS
+};
+
+enum OVERHEAD_WRITER_METRIC {
+    OVERHEAD_BATCH_EVENTS,  // Events the writer took off the queue at once
+    OVERHEAD_FLUSH_NS,  // Formatting and writing one batch
+    OVERHEAD_APPLY_NS,  // One alloc_map_apply() of up to INDEX_BATCH updates
+    OVERHEAD_WRITER_METRICS
+};
+
+// One thread's histograms. Only the owning thread writes to it, and the alignment keeps it off other threads' lines.
+typedef struct overhead_block {
+    thread_block header;
+    unsigned long counts[MAX_OVERRIDE_VAL][OVERHEAD_METRICS][OVERHEAD_BUCKETS];
+    unsigned long totals[MAX_OVERRIDE_VAL][OVERHEAD_METRICS];
+} __attribute__((aligned(64))) overhead_block;
+
+extern int overhead_enabled;
+extern __thread overhead_block* overhead_mine __attribute__((tls_model("initial-exec")));
+// The OVERRIDE_ID the hook the thread is in recorded (-1 until it does), and the ns it spent in real calls so far
+extern __thread int overhead_event __attribute__((tls_model("initial-exec")));
+extern __thread unsigned long overhead_real __attribute__((tls_model("initial-exec")));
+
+// Hands the calling thread its block on its first timed call, NULL if none could be mapped
+overhead_block* overhead_register(void);
+
+static inline __attribute__((always_inline)) void overhead_add(int id, int metric, unsigned long value) {
+    overhead_block* o = overhead_mine;
+    if (__builtin_expect(o == NULL, 0)) {
+        o = overhead_register();
+        if (o == NULL) return;
+    }
+
+    //Plain stores, since only this thread writes here. Being atomic just keeps the writer thread's reads well defined.
+    int b = log2_bucket(value, OVERHEAD_BUCKETS);
+    __atomic_store_n(&o->counts[id][metric][b], o->counts[id][metric][b] + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&o->totals[id][metric], o->totals[id][metric] + value, __ATOMIC_RELAXED);
+}
+
+// Monotonic ns while the stats are on, 0 (never a real reading) while they are off
+static inline __attribute__((always_inline)) unsigned long overhead_clock(void) {
+    if (__builtin_expect(!overhead_enabled, 1)) return 0;
+
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (t.tv_sec * 1000000000UL) + t.tv_nsec;
+}
+
+// Tags the hook the thread is in with the event it records. Counts mode calls this where it would push the event.
+static inline __attribute__((always_inline)) void overhead_note(int id) {
+    overhead_event = id;
+}
+
+static inline __attribute__((always_inline)) unsigned long overhead_hook_begin(void) {
+    unsigned long start = overhead_clock();
+    if (start) {
+        overhead_event = -1;
+        overhead_real = 0;
+    }
+    return start;
+}
+
+static inline __attribute__((always_inline)) void overhead_hook_end(unsigned long start) {
+    if (__builtin_expect(start == 0, 1) || overhead_event < 0) return;
+
+    unsigned long total = overhead_clock() - start;
+    unsigned long real = overhead_real < total ? overhead_real : total;
+    overhead_add(overhead_event, OVERHEAD_WRAPPER_NS, total - real);
+    overhead_add(overhead_event, OVERHEAD_REAL_NS, real);
+}
+
+// Evaluates a real_##name call, adding its time to the hook's real call time
+#define OVERHEAD_REAL(call) ({                                                      \
+        unsigned long overhead_start = overhead_clock();                            \
+        __typeof__(call) overhead_send = call;                                      \
+        if (overhead_start) overhead_real += overhead_clock() - overhead_start;     \
+        overhead_send;                                                              \
+    })
+
+#define OVERHEAD_REAL_VOID(call) do {                                               \
+        unsigned long overhead_start = overhead_clock();                            \
+        call;                                                                       \
+        if (overhead_start) overhead_real += overhead_clock() - overhead_start;     \
+    } while (0)
+
+void overhead_init(void);
+
+// Writer thread only
+void overhead_writer_add(int metric, unsigned long value);
+
+// (Re)write overhead.csv and overhead_histogram.csv with everything so far, all threads merged
+void overhead_write(void);
+
+#ifdef __cplusplus
+}
+#endif
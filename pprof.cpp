@@ -0,0 +1,296 @@
+#include "pprof.h"
+#include "arena.h"
+#include "event_queue.h"
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+struct SiteTotals {
+    unsigned long alloc_objects;
+    unsigned long alloc_space;
+    unsigned long inuse_objects;
+    unsigned long inuse_space;
+};
+
+struct Pprof : ArenaObject {
+    ArenaHashMap<void*, SiteTotals> sites;
+    unsigned long start_ns;  // Wall clock, for the profiles' duration
+    char maps[4096];
+};
+
+static Pprof* g_pprof = nullptr;
+
+// An executable mapping of /proc/self/maps, so pprof can tie addresses back to a binary and symbolize them
+struct Mapping {
+    uint64_t start;
+    uint64_t limit;
+    uint64_t offset;
+    uint64_t filename;  // Index into the string table
+};
+
+// The strings every profile starts its string table with. Index 0 has to be the empty string.
+enum {
+    STR_EMPTY,
+    STR_ALLOC_OBJECTS,
+    STR_COUNT,
+    STR_ALLOC_SPACE,
+    STR_BYTES,
+    STR_INUSE_OBJECTS,
+    STR_INUSE_SPACE,
+    FIXED_STRINGS
+};
+
+static const char* const fixed_strings[FIXED_STRINGS] = {
+    "", "alloc_objects", "count", "alloc_space", "bytes", "inuse_objects", "inuse_space"
+};
+
+// Field numbers from pprof's profile.proto
+enum {
+    PROFILE_SAMPLE_TYPE = 1,
+    PROFILE_SAMPLE = 2,
+    PROFILE_MAPPING = 3,
+    PROFILE_LOCATION = 4,
+    PROFILE_STRING_TABLE = 6,
+    PROFILE_TIME_NANOS = 9,
+    PROFILE_DURATION_NANOS = 10,
+    PROFILE_DEFAULT_SAMPLE_TYPE = 14,
+
+    VALUE_TYPE_TYPE = 1,
+    VALUE_TYPE_UNIT = 2,
+
+    SAMPLE_LOCATION_ID = 1,
+    SAMPLE_VALUE = 2,
+
+    MAPPING_ID = 1,
+    MAPPING_MEMORY_START = 2,
+    MAPPING_MEMORY_LIMIT = 3,
+    MAPPING_FILE_OFFSET = 4,
+    MAPPING_FILENAME = 5,
+
+    LOCATION_ID = 1,
+    LOCATION_MAPPING_ID = 2,
+    LOCATION_ADDRESS = 3,
+};
+
+// The bit of the protobuf wire format profile.proto needs: varints and length delimited fields
+struct Encoder {
+    ArenaVector<uint8_t> bytes;
+
+    void varint(uint64_t v) {
+        while (v >= 0x80) {
+            bytes.push_back((uint8_t)v | 0x80);
+            v >>= 7;
+        }
+        bytes.push_back((uint8_t)v);
+    }
+
+    // Zero is every field's default, so it is left out like any protobuf encoder would
+    void number(int field, uint64_t v) {
+        if (v == 0) return;
+        varint((uint64_t)field << 3);
+        varint(v);
+    }
+
+    void data(int field, const void* ptr, size_t len) {
+        varint((uint64_t)field << 3 | 2);
+        varint(len);
+        bytes.insert(bytes.end(), (const uint8_t*)ptr, (const uint8_t*)ptr + len);
+    }
+
+    void message(int field, const Encoder& m) {
+        data(field, m.bytes.data(), m.bytes.size());
+    }
+
+    void packed(int field, const uint64_t* values, size_t count) {
+        Encoder m;
+        for (size_t i = 0; i < count; i++) m.varint(values[i]);
+        message(field, m);
+    }
+
+    void value_type(int field, uint64_t type, uint64_t unit) {
+        Encoder m;
+        m.number(VALUE_TYPE_TYPE, type);
+        m.number(VALUE_TYPE_UNIT, unit);
+        message(field, m);
+    }
+};
+
+static unsigned long wall_ns(void) {
+    struct timespec t;
+    timespec_get(&t, TIME_UTC);
+    return (t.tv_sec * 1000000000UL) + t.tv_nsec;
+}
+
+//Reads the whole maps file into text (NUL terminated), which the string table then points into
+static bool read_maps(ArenaVector<char>& text) {
+    int fd = open(g_pprof->maps, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+
+    char buf[4096];
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof(buf))) > 0) text.insert(text.end(), buf, buf + n);
+    close(fd);
+
+    text.push_back('\0');
+    return n == 0;
+}
+
+//Adds the executable mappings, one string per file (a file's mappings are next to each other in the maps)
+static void parse_mappings(ArenaVector<char>& text, ArenaVector<Mapping>& mappings, ArenaVector<const char*>& strings) {
+    const char* previous = nullptr;
+    for (char* line = text.data(); *line;) {
+        char* end = strchr(line, '\n');
+        if (end) *end = '\0';
+
+        unsigned long start, limit, offset;
+        char perms[5];
+        int path_at = 0;
+        if (sscanf(line, "%lx-%lx %4s %lx %*s %*s %n", &start, &limit, perms, &offset, &path_at) == 4 && perms[2] == 'x') {
+            const char* path = path_at ? line + path_at : "";
+            if (!previous || strcmp(previous, path) != 0) strings.push_back(path);
+            previous = path;
+            mappings.push_back(Mapping{start, limit, offset, strings.size() - 1});
+        }
+
+        if (!end) break;
+        line = end + 1;
+    }
+}
+
+static uint64_t mapping_of(const ArenaVector<Mapping>& mappings, uintptr_t address) {
+    for (size_t i = 0; i < mappings.size(); i++) {
+        if (address >= mappings[i].start && address < mappings[i].limit) return i + 1;
+    }
+    return 0;
+}
+
+//Writes through a temporary file, so whoever picks it up never sees half of it
+static void write_file(const char* name, const void* bytes, size_t size) {
+    char path[4096];
+    char temp[4096 + 8];
+    log_dir(path, sizeof(path));
+    size_t len = strlen(path);
+    snprintf(path + len, sizeof(path) - len, "/%s", name);
+    snprintf(temp, sizeof(temp), "%s.tmp", path);
+
+    int fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) return;
+
+    const uint8_t* data = (const uint8_t*)bytes;
+    size_t left = size;
+    while (left) {
+        ssize_t n = write(fd, data, left);
+        if (n <= 0) break;
+        data += n;
+        left -= n;
+    }
+    close(fd);
+
+    if (left == 0) rename(temp, path);
+    else unlink(temp);
+}
+
+extern "C" {
+
+void pprof_init(const char* maps) {
+    if (!g_pprof) {
+        g_pprof = new Pprof();
+        g_pprof->start_ns = wall_ns();
+        snprintf(g_pprof->maps, sizeof(g_pprof->maps), "%s", maps ? maps : "/proc/self/maps");
+    }
+}
+
+void pprof_destroy(void) {
+    if (g_pprof) {
+        delete g_pprof;
+        g_pprof = nullptr;
+    }
+}
+
+void pprof_save_maps(void) {
+    if (!g_pprof) return;
+
+    ArenaVector<char> text;
+    if (read_maps(text)) write_file("maps", text.data(), text.size() - 1);
+}
+
+void pprof_alloc(void* site, size_t size) {
+    if (!g_pprof) return;
+
+    SiteTotals& t = g_pprof->sites[site];
+    t.alloc_objects++;
+    t.alloc_space += size;
+    t.inuse_objects++;
+    t.inuse_space += size;
+}
+
+void pprof_free(void* site, size_t size) {
+    if (!g_pprof) return;
+
+    auto it = g_pprof->sites.find(site);
+    if (it == g_pprof->sites.end()) return;
+    it->second.inuse_objects--;
+    it->second.inuse_space -= size;
+}
+
+void pprof_write(const char* name) {
+    if (!g_pprof || g_pprof->sites.empty()) return;
+
+    ArenaVector<const char*> strings(fixed_strings, fixed_strings + FIXED_STRINGS);
+    ArenaVector<char> maps;
+    ArenaVector<Mapping> mappings;
+    if (read_maps(maps)) parse_mappings(maps, mappings, strings);
+
+    Encoder profile;
+    profile.value_type(PROFILE_SAMPLE_TYPE, STR_ALLOC_OBJECTS, STR_COUNT);
+    profile.value_type(PROFILE_SAMPLE_TYPE, STR_ALLOC_SPACE, STR_BYTES);
+    profile.value_type(PROFILE_SAMPLE_TYPE, STR_INUSE_OBJECTS, STR_COUNT);
+    profile.value_type(PROFILE_SAMPLE_TYPE, STR_INUSE_SPACE, STR_BYTES);
+
+    //One location (and one sample) per call site, numbered from 1
+    uint64_t id = 0;
+    for (auto& entry : g_pprof->sites) {
+        const SiteTotals& t = entry.second;
+        uintptr_t site = (uintptr_t)entry.first;
+        id++;
+
+        Encoder location;
+        location.number(LOCATION_ID, id);
+        location.number(LOCATION_MAPPING_ID, mapping_of(mappings, site));
+        //Sites are return addresses, one byte back lands on the call itself and so on the calling line
+        location.number(LOCATION_ADDRESS, site ? site - 1 : 0);
+        profile.message(PROFILE_LOCATION, location);
+
+        uint64_t values[4] = {t.alloc_objects, t.alloc_space, t.inuse_objects, t.inuse_space};
+        Encoder sample;
+        sample.packed(SAMPLE_LOCATION_ID, &id, 1);
+        sample.packed(SAMPLE_VALUE, values, 4);
+        profile.message(PROFILE_SAMPLE, sample);
+    }
+
+    for (size_t i = 0; i < mappings.size(); i++) {
+        Encoder mapping;
+        mapping.number(MAPPING_ID, i + 1);
+        mapping.number(MAPPING_MEMORY_START, mappings[i].start);
+        mapping.number(MAPPING_MEMORY_LIMIT, mappings[i].limit);
+        mapping.number(MAPPING_FILE_OFFSET, mappings[i].offset);
+        mapping.number(MAPPING_FILENAME, mappings[i].filename);
+        profile.message(PROFILE_MAPPING, mapping);
+    }
+
+    for (const char* s : strings) profile.data(PROFILE_STRING_TABLE, s, strlen(s));
+
+    unsigned long now = wall_ns();
+    profile.number(PROFILE_TIME_NANOS, now);
+    profile.number(PROFILE_DURATION_NANOS, now - g_pprof->start_ns);
+    profile.number(PROFILE_DEFAULT_SAMPLE_TYPE, STR_INUSE_SPACE);
+
+    char file[256];
+    snprintf(file, sizeof(file), "%s.pb", name);
+    write_file(file, profile.bytes.data(), profile.bytes.size());
+}
+
+}
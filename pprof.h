@@ -0,0 +1,33 @@
+#pragma once
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Per call site allocation totals, kept up to date by the heap index on the writer thread and written out as pprof
+ * protobuf profiles (alloc_objects, alloc_space, inuse_objects, inuse_space), readable with "go tool pprof".
+ * The hooks record a single return address per call, so every sample has a one frame stack.
+ */
+
+// maps is the /proc/<pid>/maps copy to resolve mappings from, NULL for the live /proc/self/maps
+void pprof_init(const char* maps);
+
+void pprof_destroy(void);
+
+// A block became live. Reallocs count as a new allocation of the new size at the realloc's site.
+void pprof_alloc(void* site, size_t size);
+
+// A block from site (with the size it was tracked with) is no longer live
+void pprof_free(void* site, size_t size);
+
+// Copy /proc/self/maps to <log dir>/maps, for writing the profile after the process is gone (seg2csv)
+void pprof_save_maps(void);
+
+// Write <log dir>/<name>.pb (uncompressed, which pprof accepts as is). Does nothing before the first allocation.
+void pprof_write(const char* name);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,243 @@
+#include "region_map.h"
+#include "arena.h"
+#include <map>
+#include <vector>
+#include <mutex>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+// A run of pages with identical attributes, [start, end)
+struct Region {
+    uintptr_t end;
+    int prot;
+    bool anonymous;
+};
+
+struct Piece {
+    uintptr_t start;
+    Region region;
+};
+
+// Regions never overlap, and neighbours with the same attributes are always merged,
+// so every operation is a logarithmic lookup plus work proportional to the regions it touches.
+using RegionTree = ArenaMap<uintptr_t, Region>;
+
+struct RegionMap : ArenaObject {
+    RegionTree regions;
+    MappedTotals totals;
+    std::mutex lock;
+};
+
+// Global instance
+static RegionMap* g_region_map = nullptr;
+static uintptr_t g_page_mask = 0;
+
+static inline uintptr_t page_down(uintptr_t addr) {
+    return addr & ~g_page_mask;
+}
+
+static inline uintptr_t page_up(uintptr_t addr) {
+    return (addr + g_page_mask) & ~g_page_mask;
+}
+
+static void account(const Region& r, uintptr_t start, long sign) {
+    size_t len = r.end - start;
+    MappedTotals& t = g_region_map->totals;
+
+    t.total += sign * len;
+    if (r.anonymous) t.anonymous += sign * len;
+    else t.file_backed += sign * len;
+    t.by_prot[r.prot & (PROT_READ | PROT_WRITE | PROT_EXEC)] += sign * len;
+    t.regions += sign;
+}
+
+static RegionTree::iterator erase_region(RegionTree::iterator it) {
+    account(it->second, it->first, -1);
+    return g_region_map->regions.erase(it);
+}
+
+// First region that ends after addr
+static RegionTree::iterator first_overlap(uintptr_t addr) {
+    RegionTree& tree = g_region_map->regions;
+    auto it = tree.upper_bound(addr);
+    if (it != tree.begin()) {
+        auto prev = std::prev(it);
+        if (prev->second.end > addr) return prev;
+    }
+    return it;
+}
+
+static bool same_kind(const Region& a, const Region& b) {
+    return a.prot == b.prot && a.anonymous == b.anonymous;
+}
+
+// Removes [start, end) from the index, trimming or splitting regions that stick out of it.
+// The pieces that were removed are handed back through cut, if requested.
+static void carve(uintptr_t start, uintptr_t end, ArenaVector<Piece>* cut) {
+    RegionTree& tree = g_region_map->regions;
+    auto it = first_overlap(start);
+
+    while (it != tree.end() && it->first < end) {
+        uintptr_t r_start = it->first;
+        Region r = it->second;
+        it = erase_region(it);
+
+        if (r_start < start) {
+            Region left = r;
+            left.end = start;
+            tree.emplace(r_start, left);
+            account(left, r_start, 1);
+        }
+        if (r.end > end) {
+            Region right = r;
+            it = tree.emplace(end, right).first;
+            account(right, end, 1);
+        }
+        if (cut) {
+            Region inner = r;
+            inner.end = r.end < end ? r.end : end;
+            cut->push_back({r_start > start ? r_start : start, inner});
+        }
+    }
+}
+
+// Adds [start, r.end), which must not overlap anything, merging with matching neighbours.
+static void insert(uintptr_t start, Region r) {
+    RegionTree& tree = g_region_map->regions;
+    if (start >= r.end) return;
+
+    auto next = tree.lower_bound(start);
+    if (next != tree.end() && next->first == r.end && same_kind(next->second, r)) {
+        r.end = next->second.end;
+        next = erase_region(next);
+    }
+    if (next != tree.begin()) {
+        auto prev = std::prev(next);
+        if (prev->second.end == start && same_kind(prev->second, r)) {
+            account(prev->second, prev->first, -1);
+            prev->second.end = r.end;
+            account(prev->second, prev->first, 1);
+            return;
+        }
+    }
+
+    tree.emplace(start, r);
+    account(r, start, 1);
+}
+
+extern "C" {
+
+void region_map_init(void) {
+    if (!g_region_map) {
+        g_page_mask = sysconf(_SC_PAGESIZE) - 1;
+        g_region_map = new RegionMap();
+        g_region_map->totals = MappedTotals();
+    }
+}
+
+void region_map_destroy(void) {
+    if (g_region_map) {
+        delete g_region_map;
+        g_region_map = nullptr;
+    }
+}
+
+void region_map_map(void* addr, size_t len, int prot, int flags) {
+    if (!g_region_map || addr == MAP_FAILED || len == 0) return;
+
+    std::lock_guard<std::mutex> guard(g_region_map->lock);
+
+    uintptr_t start = (uintptr_t)addr;
+    uintptr_t end = page_up(start + len);
+
+    Region r;
+    r.end = end;
+    r.prot = prot;
+    r.anonymous = (flags & MAP_ANONYMOUS) != 0;
+
+    carve(start, end, nullptr);
+    insert(start, r);
+}
+
+void region_map_unmap(void* addr, size_t len) {
+    if (!g_region_map || len == 0) return;
+
+    std::lock_guard<std::mutex> guard(g_region_map->lock);
+
+    uintptr_t start = (uintptr_t)addr;
+    carve(start, page_up(start + len), nullptr);
+}
+
+void region_map_protect(void* addr, size_t len, int prot) {
+    if (!g_region_map || len == 0) return;
+
+    std::lock_guard<std::mutex> guard(g_region_map->lock);
+
+    uintptr_t start = (uintptr_t)addr;
+    ArenaVector<Piece> pieces;
+    carve(start, page_up(start + len), &pieces);
+
+    for (Piece& p : pieces) {
+        p.region.prot = prot;
+        insert(p.start, p.region);
+    }
+}
+
+void region_map_remap(void* old_addr, size_t old_size, void* new_addr, size_t new_size, int keep_old) {
+    if (!g_region_map || new_addr == MAP_FAILED) return;
+
+    std::lock_guard<std::mutex> guard(g_region_map->lock);
+
+    uintptr_t old_start = (uintptr_t)old_addr;
+    uintptr_t old_end = page_up(old_start + old_size);
+    uintptr_t new_start = (uintptr_t)new_addr;
+    uintptr_t new_end = page_up(new_start + new_size);
+
+    ArenaVector<Piece> pieces;
+    if (keep_old) {
+        auto it = first_overlap(old_start);
+        for (; it != g_region_map->regions.end() && it->first < old_end; ++it) {
+            Region inner = it->second;
+            if (inner.end > old_end) inner.end = old_end;
+            pieces.push_back({it->first > old_start ? it->first : old_start, inner});
+        }
+    }
+    else {
+        carve(old_start, old_end, &pieces);
+    }
+
+    //Mappings we never saw being created (from before the library loaded) stay untracked.
+    if (pieces.empty()) return;
+
+    carve(new_start, new_end, nullptr);
+
+    for (const Piece& p : pieces) {
+        uintptr_t start = p.start - old_start + new_start;
+        if (start >= new_end) break;
+
+        Region r = p.region;
+        r.end = r.end - old_start + new_start;
+        if (r.end > new_end) r.end = new_end;
+        insert(start, r);
+    }
+
+    //Growth takes on the attributes of the last page of the old mapping.
+    if (new_end - new_start > old_end - old_start) {
+        Region grown = pieces.back().region;
+        grown.end = new_end;
+        insert(new_start + (old_end - old_start), grown);
+    }
+}
+
+void region_map_totals(MappedTotals* totals) {
+    if (!g_region_map) {
+        *totals = MappedTotals();
+        return;
+    }
+
+    std::lock_guard<std::mutex> guard(g_region_map->lock);
+    *totals = g_region_map->totals;
+}
+
+} // extern "C"
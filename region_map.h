@@ -0,0 +1,40 @@
+#pragma once
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Mapped bytes of every region created through the mmap hooks, split up by kind
+typedef struct {
+    size_t total;
+    size_t anonymous;
+    size_t file_backed;
+    size_t by_prot[8];  // Indexed by (prot & (PROT_READ | PROT_WRITE | PROT_EXEC))
+    int regions;
+} MappedTotals;
+
+// Initialize the global region index
+void region_map_init(void);
+
+// Clean up the global region index
+void region_map_destroy(void);
+
+// Record a successful mmap. Anything already mapped in the range is replaced (MAP_FIXED overlays).
+void region_map_map(void* addr, size_t len, int prot, int flags);
+
+// Record a successful munmap. The range may cover parts of several regions, or nothing at all.
+void region_map_unmap(void* addr, size_t len);
+
+// Record a successful mprotect, splitting regions at the range boundaries
+void region_map_protect(void* addr, size_t len, int prot);
+
+// Record a successful mremap. The old range keeps its mapping if keep_old is set (MREMAP_DONTUNMAP).
+void region_map_remap(void* old_addr, size_t old_size, void* new_addr, size_t new_size, int keep_old);
+
+// Copy out the current totals
+void region_map_totals(MappedTotals* totals);
+
+#ifdef __cplusplus
+}
+#endif
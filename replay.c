@@ -0,0 +1,521 @@
+#define _GNU_SOURCE
+#include <malloc.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+/*
+ * Replays a recorded allocation trace against whichever allocator this program is linked with (or has LD_PRELOADed).
+ * Usage: replay <pid log dir>
+ * Reads malloc, calloc, realloc, free, mmap and munmap .csv from the directory, orders everything by time, and re-issues
+ * the same sizes and realloc chains from one thread per recorded thread. Every operation gets a global ticket and waits
+ * for its turn, so the interleaving is the recorded one on every run. Run it without the tracer preloaded.
+ */
+
+enum { OP_MALLOC, OP_CALLOC, OP_REALLOC, OP_FREE, OP_MMAP, OP_MUNMAP, OP_KINDS };
+
+static const char* op_names[OP_KINDS] = { "malloc", "calloc", "realloc", "free", "mmap", "munmap" };
+
+#define NO_SLOT UINT32_MAX
+#define PAGE 4096UL
+
+typedef struct op {
+    unsigned long time_ns;
+    unsigned long row;  // Load order, breaks timestamp ties
+    int thread;
+    int kind;  // -1 once it turns out it can't be replayed
+    size_t size;
+    size_t count;  // calloc members
+    uintptr_t addr;  // Recorded argument of realloc, free and munmap
+    uintptr_t result;  // Recorded return value
+    uint32_t source;  // Slot the op consumes
+    uint32_t target;  // Slot the op produces
+    unsigned long ticket;
+} op;
+
+typedef struct replay_thread {
+    int tid;
+    unsigned long* ops;  // Indexes into ops, in ticket order
+    unsigned long count;
+    pthread_t thread;
+} replay_thread;
+
+//Everything big is mapped directly, so the tool's own data stays out of the allocator being measured
+static op* ops;
+static unsigned long op_count;
+static size_t op_capacity;
+
+static void** slots;
+static size_t* slot_sizes;
+static uint32_t slot_count;
+
+static unsigned long* latencies;  // By ticket
+static unsigned long ticket_count;
+static unsigned long next_ticket;
+
+static replay_thread* threads;
+static int thread_count;
+
+static size_t live_bytes;
+static size_t peak_live_bytes;
+static unsigned long skipped[OP_KINDS];
+
+
+static unsigned long now_ns(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (t.tv_sec * 1000000000UL) + t.tv_nsec;
+}
+
+static void* map_array(size_t bytes) {
+    void* p = mmap(NULL, bytes ? bytes : PAGE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        perror("replay: mmap");
+        exit(1);
+    }
+    return p;
+}
+
+static void add_op(const op* o) {
+    if (op_count == op_capacity) {
+        size_t grown = op_capacity ? 2 * op_capacity : 65536;
+        if (ops == NULL) ops = map_array(grown * sizeof(op));
+        else ops = mremap(ops, op_capacity * sizeof(op), grown * sizeof(op), MREMAP_MAYMOVE);
+        if (ops == MAP_FAILED) {
+            perror("replay: mremap");
+            exit(1);
+        }
+        op_capacity = grown;
+    }
+    ops[op_count] = *o;
+    ops[op_count].row = op_count;
+    op_count++;
+}
+
+// Address -> slot, open addressing with linear probing and backward shift deletion
+typedef struct {
+    uintptr_t key;
+    uint32_t slot;
+} addr_entry;
+
+static addr_entry* table;
+static size_t table_mask;
+
+static size_t addr_hash(uintptr_t key) {
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdUL;
+    key ^= key >> 33;
+    return key & table_mask;
+}
+
+static void addr_put(uintptr_t key, uint32_t slot) {
+    size_t i = addr_hash(key);
+    while (table[i].key && table[i].key != key) i = (i + 1) & table_mask;
+    table[i].key = key;
+    table[i].slot = slot;
+}
+
+static uint32_t addr_take(uintptr_t key) {
+    if (key == 0) return NO_SLOT;
+
+    size_t i = addr_hash(key);
+    while (table[i].key != key) {
+        if (table[i].key == 0) return NO_SLOT;
+        i = (i + 1) & table_mask;
+    }
+    uint32_t slot = table[i].slot;
+
+    //Pull later entries of the same run back, so lookups never stop early at the hole
+    size_t hole = i;
+    for (size_t j = (i + 1) & table_mask; table[j].key; j = (j + 1) & table_mask) {
+        size_t home = addr_hash(table[j].key);
+        if (((j - home) & table_mask) >= ((j - hole) & table_mask)) {
+            table[hole] = table[j];
+            hole = j;
+        }
+    }
+    table[hole].key = 0;
+    return slot;
+}
+
+static uintptr_t parse_ptr(const char* s) {
+    if (s[0] == '"') s++;
+    if (strncmp(s, "null", 4) == 0) return 0;
+    return strtoull(s, NULL, 16);
+}
+
+static int split(char* line, char** fields, int max) {
+    int n = 0;
+    fields[n++] = line;
+    for (char* c = line; *c && n < max; c++) {
+        if (*c == ',') {
+            *c = '\0';
+            fields[n++] = c + 1;
+        }
+    }
+    return n;
+}
+
+//Appends the rows of <dir>/<name>.csv. Rows too short for their kind are ignored.
+static void load(const char* dir, const char* name, int kind) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s.csv", dir, name);
+    FILE* f = fopen(path, "r");
+    if (f == NULL) return;
+
+    char* line = NULL;
+    size_t len = 0;
+    char* fields[32];
+
+    //Header first
+    if (getline(&line, &len, f) < 0) {
+        fclose(f);
+        return;
+    }
+
+    while (getline(&line, &len, f) > 0) {
+        int n = split(line, fields, 32);
+        if (n < 3) continue;
+
+        op o = { 0 };
+        o.thread = atoi(fields[0]);
+        o.time_ns = strtoul(fields[1], NULL, 10);
+        o.kind = kind;
+
+        switch (kind) {
+            case OP_MALLOC:
+                if (n < 4) continue;
+                o.size = strtoul(fields[2], NULL, 10);
+                o.result = parse_ptr(fields[3]);
+                break;
+            case OP_CALLOC:
+                if (n < 6) continue;
+                o.count = strtoul(fields[2], NULL, 10);
+                o.size = strtoul(fields[3], NULL, 10);
+                o.result = parse_ptr(fields[5]);
+                break;
+            case OP_REALLOC:
+                if (n < 5) continue;
+                o.addr = parse_ptr(fields[2]);
+                o.size = strtoul(fields[3], NULL, 10);
+                o.result = parse_ptr(fields[4]);
+                break;
+            case OP_FREE:
+                o.addr = parse_ptr(fields[2]);
+                break;
+            case OP_MMAP:
+                //Only fresh anonymous mappings say anything about memory use: fields 11 and 12 are anonymous and exact_hint
+                if (n < 24 || strcmp(fields[11], "True") != 0 || strcmp(fields[12], "True") == 0) {
+                    skipped[kind]++;
+                    continue;
+                }
+                o.size = strtoul(fields[3], NULL, 10);
+                o.result = parse_ptr(fields[23]);
+                if (o.result == (uintptr_t)MAP_FAILED) o.result = 0;
+                break;
+            case OP_MUNMAP:
+                if (n < 5 || strncmp(fields[4], "True", 4) != 0) {
+                    skipped[kind]++;
+                    continue;
+                }
+                o.addr = parse_ptr(fields[2]);
+                o.size = strtoul(fields[3], NULL, 10);
+                break;
+        }
+
+        add_op(&o);
+    }
+
+    free(line);
+    fclose(f);
+}
+
+static int by_time(const void* a, const void* b) {
+    const op* x = a;
+    const op* y = b;
+    if (x->time_ns != y->time_ns) return x->time_ns < y->time_ns ? -1 : 1;
+    return x->row < y->row ? -1 : x->row > y->row;
+}
+
+static void drop(op* o) {
+    skipped[o->kind]++;
+    o->kind = -1;
+}
+
+static uint32_t new_slot(size_t size) {
+    slot_sizes[slot_count] = size;
+    return slot_count++;
+}
+
+/**
+ * Walks the ops in order and turns recorded addresses into slots, so the replay only ever deals with its own pointers.
+ * Anything that refers to memory the trace never saw being allocated (from before the library loaded) is dropped.
+ */
+static void resolve(void) {
+    size_t buckets = 1024;
+    while (buckets < 2 * op_count) buckets <<= 1;
+    table = map_array(buckets * sizeof(addr_entry));
+    table_mask = buckets - 1;
+
+    //At most one new slot per op
+    slots = map_array(op_count * sizeof(void*));
+    slot_sizes = map_array(op_count * sizeof(size_t));
+
+    for (unsigned long i = 0; i < op_count; i++) {
+        op* o = &ops[i];
+        o->source = NO_SLOT;
+        o->target = NO_SLOT;
+
+        switch (o->kind) {
+            case OP_MALLOC:
+            case OP_CALLOC:
+            case OP_MMAP:
+                if (o->result == 0) {
+                    drop(o);
+                    break;
+                }
+                o->target = new_slot(o->kind == OP_CALLOC ? o->count * o->size : o->size);
+                addr_put(o->result, o->target);
+                break;
+            case OP_REALLOC:
+                o->source = addr_take(o->addr);
+                if (o->result == 0 && o->size) {
+                    //A failed realloc leaves the original alone
+                    if (o->source != NO_SLOT) addr_put(o->addr, o->source);
+                    drop(o);
+                    break;
+                }
+                //Growing a block we never saw allocated ends up as realloc(NULL), the closest thing to it
+                if (o->result) {
+                    o->target = new_slot(o->size);
+                    addr_put(o->result, o->target);
+                }
+                if (o->source == NO_SLOT && o->target == NO_SLOT) drop(o);
+                break;
+            case OP_FREE:
+                o->source = addr_take(o->addr);
+                if (o->source == NO_SLOT) drop(o);
+                break;
+            case OP_MUNMAP:
+                o->source = addr_take(o->addr);
+                //Only whole mappings are replayed, a partial munmap leaves the mapping in the index
+                if (o->source != NO_SLOT && (o->size + PAGE - 1) / PAGE != (slot_sizes[o->source] + PAGE - 1) / PAGE) {
+                    addr_put(o->addr, o->source);
+                    o->source = NO_SLOT;
+                }
+                if (o->source == NO_SLOT) drop(o);
+                break;
+        }
+    }
+
+    munmap(table, buckets * sizeof(addr_entry));
+}
+
+static replay_thread* find_thread(int tid) {
+    for (int i = 0; i < thread_count; i++) {
+        if (threads[i].tid == tid) return &threads[i];
+    }
+    replay_thread* t = &threads[thread_count++];
+    t->tid = tid;
+    return t;
+}
+
+//Hands every thread its own list of ops in ticket order
+static void assign(void) {
+    //Sized for the worst case of one thread per op, only the pages actually used get backed
+    threads = map_array(op_count * sizeof(replay_thread));
+
+    for (unsigned long i = 0; i < op_count; i++) {
+        if (ops[i].kind < 0) continue;
+        ops[i].ticket = ticket_count++;
+        find_thread(ops[i].thread)->count++;
+    }
+
+    for (int i = 0; i < thread_count; i++) {
+        threads[i].ops = map_array(threads[i].count * sizeof(unsigned long));
+        threads[i].count = 0;
+    }
+    for (unsigned long i = 0; i < op_count; i++) {
+        if (ops[i].kind < 0) continue;
+        replay_thread* t = find_thread(ops[i].thread);
+        t->ops[t->count++] = i;
+    }
+
+    latencies = map_array(ticket_count * sizeof(unsigned long));
+}
+
+static void wait_turn(unsigned long ticket) {
+    unsigned spins = 0;
+    while (__atomic_load_n(&next_ticket, __ATOMIC_ACQUIRE) != ticket) {
+        if (++spins > 256) sched_yield();
+    }
+}
+
+//Real programs write to what they allocate, so touch every page to make RSS mean something
+static void touch(void* ptr, size_t size) {
+    char* p = ptr;
+    for (size_t i = 0; i < size; i += PAGE) p[i] = 1;
+}
+
+static void run_op(op* o) {
+    void* p = NULL;
+    size_t size = 0;
+
+    unsigned long start = now_ns();
+    switch (o->kind) {
+        case OP_MALLOC:
+            p = malloc(o->size);
+            break;
+        case OP_CALLOC:
+            p = calloc(o->count, o->size);
+            break;
+        case OP_REALLOC:
+            p = realloc(o->source == NO_SLOT ? NULL : slots[o->source], o->size);
+            break;
+        case OP_FREE:
+            free(slots[o->source]);
+            break;
+        case OP_MMAP:
+            p = mmap(NULL, o->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (p == MAP_FAILED) p = NULL;
+            break;
+        case OP_MUNMAP:
+            munmap(slots[o->source], slot_sizes[o->source]);
+            break;
+    }
+    latencies[o->ticket] = now_ns() - start;
+
+    //Ops run one at a time, so the bookkeeping needs no locking
+    if (o->source != NO_SLOT) {
+        live_bytes -= slot_sizes[o->source];
+        slots[o->source] = NULL;
+    }
+    if (o->target != NO_SLOT) {
+        slots[o->target] = p;
+        if (p) {
+            size = slot_sizes[o->target];
+            live_bytes += size;
+            touch(p, size);
+        }
+    }
+    if (live_bytes > peak_live_bytes) peak_live_bytes = live_bytes;
+}
+
+static void* thread_main(void* arg) {
+    replay_thread* t = arg;
+    for (unsigned long i = 0; i < t->count; i++) {
+        op* o = &ops[t->ops[i]];
+        wait_turn(o->ticket);
+        run_op(o);
+        __atomic_store_n(&next_ticket, o->ticket + 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+static unsigned long resident_bytes(void) {
+    unsigned long size = 0, resident = 0;
+    FILE* f = fopen("/proc/self/statm", "r");
+    if (f) {
+        if (fscanf(f, "%lu %lu", &size, &resident) != 2) resident = 0;
+        fclose(f);
+    }
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+static int by_value(const void* a, const void* b) {
+    unsigned long x = *(const unsigned long*)a;
+    unsigned long y = *(const unsigned long*)b;
+    return x < y ? -1 : x > y;
+}
+
+static void report_latencies(unsigned long total_ns) {
+    unsigned long* sorted = map_array(ticket_count * sizeof(unsigned long));
+
+    printf("replayed %lu ops on %d threads in %lu ns\n\n", ticket_count, thread_count, total_ns);
+    printf("op,count,skipped,p50_ns,p90_ns,p99_ns,p999_ns,max_ns\n");
+
+    for (int kind = 0; kind < OP_KINDS; kind++) {
+        unsigned long n = 0;
+        for (unsigned long i = 0; i < op_count; i++) {
+            if (ops[i].kind == kind) sorted[n++] = latencies[ops[i].ticket];
+        }
+        if (n == 0 && skipped[kind] == 0) continue;
+
+        qsort(sorted, n, sizeof(unsigned long), by_value);
+        printf("%s,%lu,%lu", op_names[kind], n, skipped[kind]);
+        if (n == 0) {
+            printf(",0,0,0,0,0\n");
+            continue;
+        }
+        printf(",%lu,%lu,%lu,%lu,%lu\n", sorted[n * 50 / 100], sorted[n * 90 / 100], sorted[n * 99 / 100],
+               sorted[n * 999 / 1000], sorted[n - 1]);
+    }
+
+    munmap(sorted, ticket_count * sizeof(unsigned long));
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <pid log dir>\n", argv[0]);
+        return 1;
+    }
+
+    load(argv[1], "malloc", OP_MALLOC);
+    load(argv[1], "calloc", OP_CALLOC);
+    load(argv[1], "realloc", OP_REALLOC);
+    load(argv[1], "free", OP_FREE);
+    load(argv[1], "mmap", OP_MMAP);
+    load(argv[1], "munmap", OP_MUNMAP);
+    if (op_count == 0) {
+        fprintf(stderr, "replay: no allocation logs in %s\n", argv[1]);
+        return 1;
+    }
+
+    qsort(ops, op_count, sizeof(op), by_time);
+    resolve();
+    assign();
+
+    //Fault in the arrays the replay writes to, so they land in the baseline rather than the growth
+    memset(slots, 0, op_count * sizeof(void*));
+    memset(latencies, 0, ticket_count * sizeof(unsigned long));
+
+    unsigned long baseline_rss = resident_bytes();
+    unsigned long start = now_ns();
+
+    for (int i = 0; i < thread_count; i++) pthread_create(&threads[i].thread, NULL, thread_main, &threads[i]);
+    for (int i = 0; i < thread_count; i++) pthread_join(threads[i].thread, NULL);
+
+    unsigned long total_ns = now_ns() - start;
+    unsigned long final_rss = resident_bytes();
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    report_latencies(total_ns);
+
+    //Whatever the process holds beyond the baseline and the live blocks is allocator overhead and fragmentation
+    unsigned long grown = final_rss > baseline_rss ? final_rss - baseline_rss : 0;
+    double fragmentation = grown > live_bytes ? (double)(grown - live_bytes) / grown : 0.0;
+
+    printf("\npeak_rss_bytes,baseline_rss_bytes,final_rss_bytes,live_bytes,peak_live_bytes,fragmentation\n");
+    printf("%lu,%lu,%lu,%lu,%lu,%.4f\n", (unsigned long)usage.ru_maxrss * 1024, baseline_rss, final_rss,
+           live_bytes, peak_live_bytes, fragmentation);
+
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+    //Only glibc's own allocator fills this in, a preloaded one leaves it empty
+    struct mallinfo2 mi = mallinfo2();
+    if (mi.arena) {
+        printf("\nheap_bytes,in_use_bytes,free_bytes,mmapped_bytes,heap_fragmentation\n");
+        printf("%lu,%lu,%lu,%lu,%.4f\n", mi.arena, mi.uordblks, mi.fordblks, mi.hblkhd, (double)mi.fordblks / mi.arena);
+    }
+#endif
+
+    return 0;
+}
@@ -0,0 +1,228 @@
+#define _GNU_SOURCE
+#include "segment_log.h"
+#include "event_writer.h"
+#include "heap_index.h"
+#include "region_map.h"
+#include "false_sharing.h"
+#include "pprof.h"
+#include "lock_index.h"
+#include "io_index.h"
+#include "fault_index.h"
+#include "arena.h"
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*
+ * Turns the segment files of an LD_PRELOAD_MODE=segments run back into the usual logs.
+ * Usage: seg2csv <segment dir> [output dir]
+ * The segment dir is one process's <log root>/<pid>, which is also where the logs go by default.
+ * Records are merged across threads by time, then written and indexed exactly like the writer thread would,
+ * so the heap index reports (copy pairs, cross-thread frees, realloc chains, false sharing, lock contention,
+ * I/O latency, fault attribution) come out as well.
+ * The heap profile (heap_profile.pb) resolves its mappings from the maps file the process left next to its segments.
+ */
+
+typedef struct run {
+    char* base;
+    size_t size;
+    const segment_record* next;
+    const segment_record* end;
+    uint64_t origin_ns;
+    pid_t thread_id;
+    uint32_t sequence;
+} run;
+
+static run* runs;
+static size_t run_count;
+
+//Min-heap of runs with records left, by the time of their next record
+static size_t* heap;
+static size_t heap_count;
+
+static const char* out_dir;
+
+
+//What the library gets from define_override.c and event_queue.c, without any hooks around it
+void* tracer_mmap(void* addr, size_t len, int prot, int flags, int fd, off_t offset) {
+    return mmap(addr, len, prot, flags, fd, offset);
+}
+
+int tracer_munmap(void* addr, size_t len) {
+    return munmap(addr, len);
+}
+
+int tracer_madvise(void* addr, size_t len, int advice) {
+    return madvise(addr, len, advice);
+}
+
+unsigned long env_ulong(const char* name, unsigned long fallback) {
+    char* value = getenv(name);
+    if (value == NULL || value[0] == '\0') return fallback;
+    return strtoul(value, NULL, 10);
+}
+
+void log_dir(char* path, size_t len) {
+    snprintf(path, len, "%s", out_dir);
+}
+
+void log_path(const char* name, char* path, size_t len) {
+    snprintf(path, len, "%s/%s.csv", out_dir, name);
+}
+
+static int valid(const run* r) {
+    return r->next < r->end && r->next->valid == SEGMENT_VALID;
+}
+
+//Ties keep each thread's segments in order
+static int earlier(size_t a, size_t b) {
+    const run* x = &runs[a];
+    const run* y = &runs[b];
+    if (x->next->time_ns != y->next->time_ns) return x->next->time_ns < y->next->time_ns;
+    if (x->thread_id != y->thread_id) return x->thread_id < y->thread_id;
+    return x->sequence < y->sequence;
+}
+
+static void sift_down(size_t i) {
+    for (;;) {
+        size_t smallest = i;
+        size_t left = 2 * i + 1;
+        size_t right = left + 1;
+        if (left < heap_count && earlier(heap[left], heap[smallest])) smallest = left;
+        if (right < heap_count && earlier(heap[right], heap[smallest])) smallest = right;
+        if (smallest == i) return;
+
+        size_t swap = heap[i];
+        heap[i] = heap[smallest];
+        heap[smallest] = swap;
+        i = smallest;
+    }
+}
+
+static void add_run(const char* dir, const char* name) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(segment_header)) {
+        if (fd >= 0) close(fd);
+        return;
+    }
+
+    char* base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) return;
+
+    const segment_header* h = (const segment_header*)base;
+    if (memcmp(h->magic, SEGMENT_MAGIC, sizeof(h->magic)) != 0 || h->record_size != SEGMENT_RECORD_SIZE) {
+        fprintf(stderr, "seg2csv: %s is not a segment file\n", path);
+        munmap(base, st.st_size);
+        return;
+    }
+
+    runs = realloc(runs, (run_count + 1) * sizeof(run));
+    if (runs == NULL) exit(1);
+
+    run* r = &runs[run_count++];
+    r->base = base;
+    r->size = st.st_size;
+    r->next = (const segment_record*)base + 1;
+    r->end = (const segment_record*)base + st.st_size / SEGMENT_RECORD_SIZE;
+    r->origin_ns = h->origin_ns;
+    r->thread_id = h->thread_id;
+    r->sequence = h->sequence;
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <segment dir> [output dir]\n", argv[0]);
+        return 1;
+    }
+    out_dir = argc > 2 ? argv[2] : argv[1];
+    mkdir(out_dir, 0777);
+
+    DIR* dir = opendir(argv[1]);
+    if (dir == NULL) {
+        perror("seg2csv");
+        return 1;
+    }
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        size_t len = strlen(entry->d_name);
+        if (strncmp(entry->d_name, "seg-", 4) == 0 && len > 4 && strcmp(entry->d_name + len - 4, ".bin") == 0) {
+            add_run(argv[1], entry->d_name);
+        }
+    }
+    closedir(dir);
+
+    if (run_count == 0) {
+        fprintf(stderr, "seg2csv: no segments in %s\n", argv[1]);
+        return 1;
+    }
+
+    arena_init();
+    region_map_init();
+    heap_index_init();
+    false_sharing_init(env_ulong("LD_PRELOAD_FALSE_SHARING_MAX", 256));
+    lock_index_init();
+    io_index_init();
+    fault_index_init();
+    char maps[4096];
+    snprintf(maps, sizeof(maps), "%s/maps", argv[1]);
+    pprof_init(maps);
+    log_writer_start();
+
+    heap = malloc(run_count * sizeof(size_t));
+    if (heap == NULL) return 1;
+    for (size_t i = 0; i < run_count; i++) {
+        if (valid(&runs[i])) heap[heap_count++] = i;
+    }
+    for (size_t i = heap_count / 2; i-- > 0;) sift_down(i);
+
+    unsigned long events = 0;
+    unsigned long skipped = 0;
+    while (heap_count) {
+        run* r = &runs[heap[0]];
+        const segment_record* rec = r->next++;
+
+        size_t expected = event_payload_size(rec->event_type);
+        if (rec->event_type >= STATM || rec->length != (expected ? expected : sizeof(void*))) {
+            skipped++;
+        }
+        else {
+            //Value events carry the data pointer itself, the others point at their payload
+            void* data = (void*)rec->payload;
+            if (expected == 0) memcpy(&data, rec->payload, sizeof(data));
+
+            write_event(rec->event_type, rec->thread_id, rec->time_ns - r->origin_ns, data);
+            events++;
+        }
+
+        if (!valid(r)) heap[0] = heap[--heap_count];
+        sift_down(0);
+    }
+
+    close_event_files();
+    heap_index_report();
+    false_sharing_report();
+    lock_index_report();
+    io_index_report();
+    fault_index_report();
+    pprof_write("heap_profile");
+    log_writer_stop();
+
+    fprintf(stderr, "seg2csv: %lu events from %zu segments", events, run_count);
+    if (skipped) fprintf(stderr, ", %lu unknown records skipped", skipped);
+    fprintf(stderr, "\n");
+
+    for (size_t i = 0; i < run_count; i++) munmap(runs[i].base, runs[i].size);
+    free(runs);
+    free(heap);
+    return 0;
+}
@@ -0,0 +1,143 @@
+#define _GNU_SOURCE
+#include "segment_log.h"
+#include "event_writer.h"
+#include "define_override.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+typedef struct segment {
+    char* base;  // NULL until the thread's next event
+    segment_record* next;
+    segment_record* end;
+    uint32_t sequence;
+    unsigned generation;
+    pid_t thread_id;  // Cached, 0 until the thread's first event
+    int fd;
+} segment;
+
+static size_t segment_size;
+static pthread_key_t segment_key;
+
+//Bumped in fork children, so the thread that forked leaves the parent's segment alone and starts its own.
+static unsigned generation;
+
+static __thread segment current;
+
+
+//Cuts the file down to the records actually written and lets go of it
+static void trim(segment* s) {
+    if (s->base == NULL) return;
+
+    size_t used = (char*)s->next - s->base;
+    tracer_munmap(s->base, segment_size);
+    //If this fails the zeroed tail still reads as the end of the segment
+    ftruncate(s->fd, used);
+    close(s->fd);
+
+    s->base = NULL;
+    s->sequence++;
+}
+
+static void thread_done(void* arg) {
+    trim(arg);
+}
+
+static void fork_child(void) {
+    generation++;
+}
+
+static int open_segment(segment* s, uint64_t origin_ns) {
+    char path[4096];
+    size_t len;
+    log_dir(path, sizeof(path));
+    len = strlen(path);
+    snprintf(path + len, sizeof(path) - len, "/seg-%d-%u.bin", s->thread_id, s->sequence);
+
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) return 0;
+
+    char* base = MAP_FAILED;
+    if (ftruncate(fd, segment_size) == 0) {
+        base = tracer_mmap(NULL, segment_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    if (base == MAP_FAILED) {
+        close(fd);
+        unlink(path);
+        return 0;
+    }
+
+    segment_header* h = (segment_header*)base;
+    memcpy(h->magic, SEGMENT_MAGIC, sizeof(h->magic));
+    h->record_size = SEGMENT_RECORD_SIZE;
+    h->sequence = s->sequence;
+    h->pid = getpid();
+    h->ppid = getppid();
+    h->thread_id = s->thread_id;
+    h->origin_ns = origin_ns;
+
+    s->base = base;
+    s->next = (segment_record*)base + 1;
+    s->end = (segment_record*)(base + segment_size);
+    s->fd = fd;
+
+    //Gets the segment trimmed when the thread exits
+    pthread_setspecific(segment_key, s);
+    return 1;
+}
+
+void segment_log_init(void) {
+    segment_size = env_ulong("LD_PRELOAD_SEGMENT_KB", 4096) * 1024;
+    segment_size -= segment_size % SEGMENT_RECORD_SIZE;
+    if (segment_size < 2 * SEGMENT_RECORD_SIZE) segment_size = 2 * SEGMENT_RECORD_SIZE;
+
+    pthread_key_create(&segment_key, thread_done);
+    pthread_atfork(NULL, NULL, fork_child);
+}
+
+void segment_log_append(int event_type, uint64_t time_ns, uint64_t origin_ns, void* data) {
+    segment* s = &current;
+
+    if (s->generation != generation) {
+        //Inherited through fork(). The mapping is the parent's file, so drop it without trimming.
+        if (s->base) {
+            tracer_munmap(s->base, segment_size);
+            close(s->fd);
+            s->base = NULL;
+        }
+        s->sequence = 0;
+        s->thread_id = 0;
+        s->generation = generation;
+    }
+    //Once per thread (and per fork), not a syscall per record
+    if (s->thread_id == 0) s->thread_id = gettid();
+    if (s->base && s->next == s->end) trim(s);
+    if (s->base == NULL && !open_segment(s, origin_ns)) return;
+
+    segment_record* r = s->next++;
+
+    size_t len = event_payload_size(event_type);
+    if (len == 0) {
+        len = sizeof(data);
+        memcpy(r->payload, &data, len);
+    }
+    else {
+        if (len > sizeof(r->payload)) len = sizeof(r->payload);
+        memcpy(r->payload, data, len);
+    }
+
+    r->event_type = event_type;
+    r->thread_id = s->thread_id;
+    r->time_ns = time_ns;
+    r->length = len;
+
+    //Last, so a record cut short by a crash never looks complete
+    __atomic_store_n(&r->valid, SEGMENT_VALID, __ATOMIC_RELEASE);
+}
+
+void segment_log_close(void) {
+    trim(&current);
+}
@@ -0,0 +1,55 @@
+#pragma once
+#include <stdint.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * LD_PRELOAD_MODE=segments: instead of queueing events for the writer thread, every thread appends fixed size records
+ * to its own MAP_SHARED segment file (<log root>/<pid>/seg-<thread>-<n>.bin) with plain stores. The pages belong to
+ * the file, so whatever was recorded survives the process crashing. seg2csv turns the segments back into the usual logs.
+ * There is no writer thread in this mode, so no alloc_map either: its lookups find nothing and no alloc_spill.csv is
+ * written. seg2csv rebuilds the heap index offline from the records instead.
+ */
+
+#define SEGMENT_MAGIC "MEMSEG1"
+#define SEGMENT_RECORD_SIZE 128
+#define SEGMENT_VALID 0x5345
+
+// The first record slot of every segment file
+typedef struct {
+    char magic[8];
+    uint32_t record_size;
+    uint32_t sequence;  // Counts up from 0 per thread as segments fill up
+    pid_t pid;
+    pid_t ppid;
+    pid_t thread_id;
+    uint32_t reserved;
+    uint64_t origin_ns;  // What time_ns is relative to in the logs
+    char padding[SEGMENT_RECORD_SIZE - 40];
+} segment_header;
+
+typedef struct {
+    uint16_t valid;  // SEGMENT_VALID, stored last. Zero marks the end of the segment (or a record cut off by a crash).
+    uint16_t event_type;
+    pid_t thread_id;
+    uint64_t time_ns;  // Absolute, like origin_ns
+    uint32_t length;  // Bytes of payload used
+    uint32_t reserved;
+    unsigned char payload[SEGMENT_RECORD_SIZE - 24];
+} segment_record;
+
+// Segment size comes from LD_PRELOAD_SEGMENT_KB (default 4096)
+void segment_log_init(void);
+
+// Append an event for the calling thread, tagged with its (cached) thread id. data is what the hook gave push_event().
+void segment_log_append(int event_type, uint64_t time_ns, uint64_t origin_ns, void* data);
+
+// Trim the calling thread's segment down to what was written, at exit
+void segment_log_close(void);
+
+#ifdef __cplusplus
+}
+#endif
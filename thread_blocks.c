@@ -0,0 +1,63 @@
+#define _GNU_SOURCE
+#include "thread_blocks.h"
+#include "define_override.h"
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+
+//Folds an exiting thread's block into the retired totals and keeps the block for the next new thread
+static void thread_done(void* arg) {
+    thread_block* block = arg;
+    thread_blocks* registry = block->registry;
+
+    pthread_mutex_lock(&registry->lock);
+    for (thread_block** p = &registry->live; *p; p = &(*p)->next) {
+        if (*p == block) {
+            *p = block->next;
+            break;
+        }
+    }
+    registry->fold(registry->retired, block);
+    memset(block, 0, registry->size);
+    block->next = registry->spare;
+    registry->spare = block;
+    pthread_mutex_unlock(&registry->lock);
+
+    registry->set_mine(NULL);
+}
+
+void thread_blocks_init(thread_blocks* registry) {
+    pthread_key_create(&registry->key, thread_done);
+}
+
+thread_block* thread_blocks_register(thread_blocks* registry) {
+    pthread_mutex_lock(&registry->lock);
+    thread_block* block = registry->spare;
+    if (block) {
+        registry->spare = block->next;
+    }
+    else {
+        block = tracer_mmap(NULL, registry->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (block == MAP_FAILED) {
+            pthread_mutex_unlock(&registry->lock);
+            return NULL;
+        }
+    }
+    block->registry = registry;
+    block->thread_id = gettid();
+    block->next = registry->live;
+    registry->live = block;
+    pthread_mutex_unlock(&registry->lock);
+
+    registry->set_mine(block);
+    pthread_setspecific(registry->key, block);
+    return block;
+}
+
+void thread_blocks_visit(thread_blocks* registry, void (*visit)(const thread_block* block, pid_t thread_id, void* ctx), void* ctx) {
+    pthread_mutex_lock(&registry->lock);
+    for (thread_block* block = registry->live; block; block = block->next) visit(block, block->thread_id, ctx);
+    visit(registry->retired, 0, ctx);
+    pthread_mutex_unlock(&registry->lock);
+}
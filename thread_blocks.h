@@ -0,0 +1,47 @@
+#pragma once
+#include <pthread.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Per-thread blocks the hooks write to without locks (counters.c, overhead.c). Each thread gets its block on first use,
+ * mapped or reused from an exited thread. When a thread exits, its block is folded into the registry's retired block
+ * and kept for the next new thread. Only registration, exits and thread_blocks_visit() take the registry's lock.
+ */
+
+// Starts every block
+typedef struct thread_block {
+    struct thread_block* next;
+    struct thread_blocks* registry;
+    pid_t thread_id;
+} thread_block;
+
+typedef struct thread_blocks {
+    pthread_mutex_t lock;
+    size_t size;  // Of one block, header included
+    thread_block* retired;  // Everything exited threads recorded
+    void (*fold)(thread_block* into, const thread_block* from);  // Adds an exiting thread's block to retired
+    void (*set_mine)(thread_block* block);  // Points the calling thread's own TLS at its block, or at NULL once it exits
+    pthread_key_t key;
+    thread_block* live;
+    thread_block* spare;
+} thread_blocks;
+
+#define THREAD_BLOCKS_INITIALIZER(type, retired_block, fold, set_mine) \
+    { PTHREAD_MUTEX_INITIALIZER, sizeof(type), &(retired_block).header, fold, set_mine, 0, NULL, NULL }
+
+void thread_blocks_init(thread_blocks* registry);
+
+// Hands the calling thread its block, passing it to registry->set_mine() too. NULL if none could be mapped.
+thread_block* thread_blocks_register(thread_blocks* registry);
+
+// Calls visit for every live block and then the retired one (as thread 0), under the registry's lock
+void thread_blocks_visit(thread_blocks* registry, void (*visit)(const thread_block* block, pid_t thread_id, void* ctx), void* ctx);
+
+#ifdef __cplusplus
+}
+#endif